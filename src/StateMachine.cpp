@@ -14,6 +14,7 @@
 #include "timers/timers.h"
 #include "store/store.h"
 #include "actioncontext/actioncontext.h"
+#include "binary/binary.h"
 
 #include "StateMachineDebug.h"
 
@@ -33,6 +34,18 @@ void StateMachineController::registerAction(const char *name, ActionFunction fun
   _actionMap[name] = func;
 }
 
+void StateMachineController::registerAsyncAction(const char *name, AsyncActionFunction func)
+{
+  _asyncActionMap[name] = func;
+}
+
+#ifdef ASYNC_COROUTINES
+void StateMachineController::registerAsyncAction(const char *name, CoroutineActionFunction func)
+{
+  _coroutineActionMap[name] = func;
+}
+#endif
+
 void StateMachineController::registerFunction(const char *name, MathFunction func)
 {
   compute.registerFunction(name, func);
@@ -49,6 +62,39 @@ void StateMachineController::registerPlugin(Plugin *plugin)
   plugin->initialize(this);
 }
 
+/**
+ * @return true if action of this name is registered (including plugin actions "plugin.action")
+ */
+bool StateMachineController::hasAction(const char *name)
+{
+  if (strcasecmp(name, ASSIGNMENT_ACTION_ID) == 0 || _actionMap.count(name) || _typedActionMap.count(name) || _asyncActionMap.count(name))
+    return true;
+#ifdef ASYNC_COROUTINES
+  if (_coroutineActionMap.count(name))
+    return true;
+#endif
+
+  const char *separator = strchr(name, '.');
+  if (separator == nullptr)
+    return false;
+
+  char pluginId[separator - name + 1];
+  strncpy(pluginId, name, separator - name);
+  pluginId[separator - name] = 0;
+
+  std::map<const char *, Plugin *, KeyCompare>::iterator it = _pluginMap.find(pluginId);
+  return it != _pluginMap.end() && it->second->actionMap.count(separator + 1);
+}
+
+/**
+ * @return number of parameters of action registered with typed arguments, -1 for other actions
+ */
+int StateMachineController::getActionArity(const char *name)
+{
+  std::map<const char *, ActionBinding *, KeyCompare>::iterator it = _typedActionMap.find(name);
+  return it == _typedActionMap.end() ? -1 : it->second->arity();
+}
+
 void StateMachineController::setDefinition(JsonDocument *definition)
 {
   setDefinition(definition->as<JsonVariant>());
@@ -57,7 +103,172 @@ void StateMachineController::setDefinition(JsonDocument *definition)
 void StateMachineController::setDefinition(JsonVariant definition)
 {
   SM_DEBUG("State Machine definition: " << definition << "\n");
-  _definition = definition;
+  _definition = definition.as<JsonObject>();
+  _validated = false;
+  _prepareInfix();
+  compute.tables.load(_definition[DEFINITION_TABLES]);
+  compute.expressions.load(_definition[DEFINITION_EXPRESSIONS]);
+  _compileActions();
+}
+
+RELOAD_STATS StateMachineController::reload(JsonDocument *definition)
+{
+  return reload(definition->as<JsonVariant>());
+}
+
+/**
+ * Replace definition between cycles, without re-initialization. Variables, timers and filters are kept,
+ * machines stay in their current states if these exist in new definition, otherwise they are switched
+ * to initial state. New machines are initialized as in init(). Rule tables of unchanged states are reused.
+ * Old definition can be released after this call, pending asynchronous actions are cancelled.
+ * @return summary of differences
+ */
+RELOAD_STATS StateMachineController::reload(JsonVariant definition)
+{
+  RELOAD_STATS stats = RELOAD_STATS();
+
+  // take over current machines, rule tables are handed over to unchanged states of new machines
+
+  std::vector<STATE_MACHINE_SLOT> previous(_stateMachines, _stateMachines + _stateMachineCount);
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    _clearTasks(&_stateMachines[i]);
+    _clearActions(&_stateMachines[i]);
+    _stateMachines[i].ruleTables.clear();
+    _stateMachines[i].timerStates.clear();
+    previous[i].actions.clear();
+    previous[i].tasks.clear();
+    previous[i].deferred.clear();
+  }
+  _stateMachineCount = 0;
+
+  // parameters of asynchronous actions started outside of machines point into old definition
+
+  for (size_t i = 0; i < _detachedTasks.size(); i++)
+    delete _detachedTasks[i];
+  _detachedTasks.clear();
+
+  setDefinition(definition);
+  _loadStateMachines(&previous, &stats);
+
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    STATE_MACHINE_SLOT *slot = &_stateMachines[i];
+    STATE_MACHINE_SLOT *old = _findPrevious(&previous, slot->name);
+
+    if (old == nullptr)
+    {
+      _initStateMachine(slot);
+      stats.machinesAdded++;
+      continue;
+    }
+
+    const char *state = old->state == nullptr ? nullptr : _findState(slot, old->state);
+    JsonVariant stateDefinition = state == nullptr ? JsonVariant() : slot->states_definition[state].as<JsonVariant>();
+    bool sameState = state != nullptr && _sameDefinition(old->states_definition[old->state], stateDefinition);
+    old->name = nullptr; // matched
+
+    if (state == nullptr)
+    {
+      // state is gone, start over without running machine initial actions
+
+      _runningMachine = slot;
+      auto initial_state = slot->machine[SM_INITIAL_STATE];
+      if (initial_state.is<char *>() && ((const char *)initial_state)[0])
+        _switchState(slot, (const char *)initial_state);
+      _runningMachine = nullptr;
+
+      stats.machinesReset++;
+      continue;
+    }
+
+    slot->state = state;
+    slot->enteredAt = old->enteredAt;
+    slot->seenVersion = old->seenVersion;
+    if (slot->period == old->period)
+      slot->nextRun = old->nextRun;
+    if (old->parked && sameState)
+    {
+      slot->parked = true;
+      slot->parkedUntil = old->parkedUntil;
+    }
+    stats.machinesKept++;
+  }
+
+  for (size_t i = 0; i < previous.size(); i++)
+  {
+    if (previous[i].name != nullptr)
+      stats.machinesRemoved++;
+    _clearRules(&previous[i]);
+  }
+
+  SM_DEBUG("Reloaded: " << stats.machinesKept << " kept, " << stats.machinesAdded << " added, "
+                        << stats.machinesRemoved << " removed, " << stats.machinesReset << " reset\n");
+
+  return stats;
+}
+
+STATE_MACHINE_SLOT *StateMachineController::_findPrevious(std::vector<STATE_MACHINE_SLOT> *previous, const char *name)
+{
+  if (previous == nullptr)
+    return nullptr;
+
+  for (size_t i = 0; i < previous->size(); i++)
+  {
+    if ((*previous)[i].name != nullptr && strcasecmp((*previous)[i].name, name) == 0)
+      return &(*previous)[i];
+  }
+  return nullptr;
+}
+
+/**
+ * Compare parts of two definitions
+ * @return true if both are of the same structure and values
+ */
+bool StateMachineController::_sameDefinition(JsonVariant a, JsonVariant b)
+{
+  if (a.isNull() || b.isNull())
+    return a.isNull() && b.isNull();
+
+  if (a.is<JsonObject>())
+  {
+    if (!b.is<JsonObject>() || a.size() != b.size())
+      return false;
+
+    JsonObject other = b.as<JsonObject>();
+    for (JsonPair item : a.as<JsonObject>())
+    {
+      if (!other.containsKey(item.key().c_str()) || !_sameDefinition(item.value(), other[item.key().c_str()]))
+        return false;
+    }
+    return true;
+  }
+
+  if (a.is<JsonArray>())
+  {
+    if (!b.is<JsonArray>() || a.size() != b.size())
+      return false;
+
+    JsonArray other = b.as<JsonArray>();
+    size_t index = 0;
+    for (JsonVariant item : a.as<JsonArray>())
+    {
+      if (!_sameDefinition(item, other[index++]))
+        return false;
+    }
+    return true;
+  }
+
+  if (a.is<const char *>())
+    return b.is<const char *>() && strcmp(a.as<const char *>(), b.as<const char *>()) == 0;
+
+  if (a.is<bool>())
+    return b.is<bool>() && a.as<bool>() == b.as<bool>();
+
+  if (a.is<long int>())
+    return b.is<long int>() && a.as<long int>() == b.as<long int>();
+
+  return !b.is<long int>() && b.is<float>() && a.as<float>() == b.as<float>();
 }
 
 void StateMachineController::init()
@@ -72,6 +283,115 @@ void StateMachineController::setHooks(Hooks *hooks)
   compute.setHooks(hooks);
 }
 
+/**
+ * Deliver variable changes once per cycle as a batch (Hooks::onVarsUpdate)
+ * instead of calling Hooks::onVarUpdate on every write
+ */
+void StateMachineController::setChangeTracking(bool enabled)
+{
+  compute.store.setChangeTracking(enabled);
+}
+
+/**
+ * Handle events while sleeping. Sleep callback is woken up by wake function, called from postEvent,
+ * if it is given: callback may then return before its time is up and it is called again for the rest.
+ * Otherwise sleep is split to slices of given length (ms)
+ */
+void StateMachineController::enableEvents(unsigned long slice, WakeFunction wake)
+{
+  _eventSlice = slice;
+  _wakeCallback = wake;
+}
+
+/**
+ * Queue event, it can be called from interrupt handler or another thread.
+ * Event sets variable of its name to payload, and machines referencing it are evaluated
+ * @return false if queue is full
+ */
+bool StateMachineController::postEvent(const char *name, const VarStruct &payload)
+{
+  if (!_events.push(name, payload))
+    return false;
+
+  if (_wakeCallback)
+    _wakeCallback();
+  return true;
+}
+
+/**
+ * Handle queued events, it is done automatically at the beginning of a cycle and while sleeping
+ * @return number of machines evaluated
+ */
+size_t StateMachineController::processEvents()
+{
+  EVENT_SLOT event;
+  size_t count = 0;
+
+  while (_events.pop(&event))
+  {
+    SM_DEBUG("Event: " << event.name << "\n");
+
+    compute.store.setVar(event.name, event.payload);
+    count += _runTargeted(event.name);
+  }
+  return count;
+}
+
+/**
+ * Fixed rate mode: cycles (and periodic machines) are scheduled against absolute deadlines,
+ * controller sleeps only for time remaining until the next one.
+ * Missed deadlines are skipped (FIXED_RATE_SKIP) or run without sleep (FIXED_RATE_CATCH_UP)
+ */
+void StateMachineController::setFixedRate(bool enabled, int policy)
+{
+  if (enabled && !_fixedRate)
+    _hasDeadline = false; // schedule starts with the next cycle
+
+  _fixedRate = enabled;
+  _overrunPolicy = policy;
+}
+
+const CYCLE_STATS *StateMachineController::getCycleStats()
+{
+  return &_cycleStats;
+}
+
+void StateMachineController::resetCycleStats()
+{
+  _cycleStats = CYCLE_STATS();
+}
+
+/**
+ * Attach document with global variables (populated by server), see Store::attachGlobalMemory
+ */
+void StateMachineController::attachGlobalMemory(JsonDocument *memory)
+{
+  compute.store.attachGlobalMemory(memory);
+}
+
+/**
+ * Call after content of global memory document was replaced
+ * @return number of changed globals
+ */
+size_t StateMachineController::refreshGlobalMemory()
+{
+  return compute.store.refreshGlobalMemory();
+}
+
+/**
+ * Attach persistent storage for crash durable variables, persistent variables are restored
+ * from it immediately. Changes are written once per cycle (group commit with a single sync).
+ */
+void StateMachineController::setJournal(JournalStorage *storage)
+{
+  compute.store.attachJournal(storage);
+}
+
+void StateMachineController::setPersistent(const char *varName, bool persistent)
+{
+  compute.store.setPersistent(varName, persistent);
+}
+
 void StateMachineController::setVar(const char *varName, const VarStruct &value, bool isLocal)
 {
   compute.setVar(varName, value, isLocal);
@@ -87,6 +407,19 @@ void StateMachineController::setVar(const char *varName, long int value, bool is
   compute.setVar(varName, value, isLocal);
 }
 
+/**
+ * Bulk update, see Store::setVars
+ */
+size_t StateMachineController::setVars(JsonObject values, const char *scope)
+{
+  return compute.store.setVars(values, scope, cycleNum);
+}
+
+size_t StateMachineController::setVars(const char *payload, size_t length, const char *scope)
+{
+  return compute.store.setVars(payload, length, scope, cycleNum);
+}
+
 float StateMachineController::getVarFloat(const char *varName, float defaultValue)
 {
   return compute.getVarFloat(varName, defaultValue);
@@ -104,6 +437,14 @@ long int StateMachineController::getVarInt(const char *varName, long int default
 void StateMachineController::cycle()
 {
   cycleNum++;
+  compute.expressions.nextCycle();
+
+  unsigned long cycleStart = timers.getTime();
+  if (_fixedRate)
+    _recordLateness(cycleStart);
+
+  _resumeTasks(&_detachedTasks);
+  processEvents();
 
   SM_DEBUG("==============================================================\n");
   SM_DEBUG("Entering cycle " << cycleNum << "\n");
@@ -112,22 +453,31 @@ void StateMachineController::cycle()
 
   if (_definition.containsKey(DEFINITION_BEFORE_ACTION))
   {
-    _runActions(_definition[DEFINITION_BEFORE_ACTION]);
+    _runActions(_definition[DEFINITION_BEFORE_ACTION], 0, _beforeActions);
   }
 
   // Run main loop of state machines
 
   _runStateMachines();
 
+  // Writes done from now on are seen by edge conditions ("changed", "rising", "falling") outside of
+  // machines in the next cycle, machines see all writes since they were last evaluated
+
+  compute.store.markVersions();
+
   // Run actions after main loop
 
   SM_DEBUG("Checking post loop actions\n");
 
   if (_definition.containsKey(DEFINITION_AFTER_ACTION))
   {
-    _runActions(_definition[DEFINITION_AFTER_ACTION]);
+    _runActions(_definition[DEFINITION_AFTER_ACTION], 0, _afterActions);
   }
 
+  // Make persistent variables durable, once per cycle
+
+  compute.store.commitJournal();
+
   // Sleep for time specified in definition, or default 1000ms
 
   long timeout = 0;
@@ -139,6 +489,23 @@ void StateMachineController::cycle()
     timeout = compute.evalMath(_definition[DEFINITION_SLEEP_TIMEOUT]).vInt;
   }
 
+  // machines with own periods wake controller up when the first of them is due,
+  // global timeout is still applied to machines running every cycle.
+  // In fixed rate mode sleep only what is left until the next deadline, so work time does not add up
+
+  long wait = _timeToNextMachine();
+
+  if (_fixedRate && timeout > 0)
+  {
+    timeout = _advanceDeadline(cycleStart, (unsigned long)timeout);
+    if (wait >= 0 && wait < timeout)
+      timeout = wait;
+  }
+  else if (wait >= 0 && (timeout <= 0 || wait < timeout))
+  {
+    timeout = wait;
+  }
+
   if (timeout > 0)
   {
     SM_DEBUG("Sleep for " << timeout << "ms\n");
@@ -146,10 +513,257 @@ void StateMachineController::cycle()
   }
 
   if (_hooks)
+  {
+    if (compute.store.isTrackingChanges())
+    {
+      size_t count = compute.store.collectChanges();
+      if (count > 0)
+        _hooks->onVarsUpdate(compute.store.getChanges(), count, cycleNum);
+    }
     _hooks->afterCycle(cycleNum);
+  }
+  compute.store.clearChanges();
   SM_DEBUG("Exiting cycle\n");
 }
 
+/**
+ * Account lateness of cycle start against its deadline
+ */
+void StateMachineController::_recordLateness(unsigned long now)
+{
+  if (!_hasDeadline)
+    return;
+
+  long lateness = (long)(now - _deadline);
+  if (lateness < 0)
+    return; // woken up early by periodic machine, not a deadline cycle
+
+  _cycleStats.cycles++;
+  if ((unsigned long)lateness > _cycleStats.maxLateness)
+    _cycleStats.maxLateness = lateness;
+
+  // bucket 0 - on time, bucket n - up to 2^n - 1 ms late, last bucket - everything later
+
+  int bucket = 0;
+  while (lateness > 0 && bucket < CYCLE_JITTER_BUCKETS - 1)
+  {
+    lateness >>= 1;
+    bucket++;
+  }
+  _cycleStats.jitter[bucket]++;
+}
+
+/**
+ * Move cycle deadline by the period
+ * @return time to sleep until the new deadline
+ */
+long StateMachineController::_advanceDeadline(unsigned long cycleStart, unsigned long period)
+{
+  if (!_hasDeadline)
+  {
+    _deadline = cycleStart;
+    _hasDeadline = true;
+  }
+
+  unsigned long now = timers.getTime();
+
+  // cycle started before its deadline (woken up by periodic machine), keep the deadline
+
+  if ((long)(cycleStart - _deadline) < 0)
+  {
+    long remaining = (long)(_deadline - now);
+    return remaining > 0 ? remaining : 0;
+  }
+
+  unsigned long missed = 0;
+  _deadline = _nextDeadline(_deadline, period, now, &missed);
+
+  long remaining = (long)(_deadline - now);
+  if (remaining < 0)
+  {
+    _cycleStats.overruns++;
+    return 0;
+  }
+  if (missed > 0)
+  {
+    _cycleStats.overruns++;
+    _cycleStats.skipped += missed;
+  }
+  return remaining;
+}
+
+/**
+ * Next deadline after given one, according to overrun policy
+ * @param missed number of skipped deadlines (optional)
+ */
+unsigned long StateMachineController::_nextDeadline(unsigned long deadline, unsigned long period, unsigned long now, unsigned long *missed)
+{
+  deadline += period;
+
+  long late = (long)(now - deadline);
+  if (late < 0)
+    return deadline;
+
+  // deadline passed already
+
+  unsigned long periods = (unsigned long)late / period + 1;
+  if (_overrunPolicy == FIXED_RATE_CATCH_UP && periods <= FIXED_RATE_MAX_CATCH_UP)
+    return deadline;
+
+  if (missed != nullptr)
+    *missed = periods;
+  return deadline + periods * period;
+}
+
+/**************************************************************************
+ *                          Snapshot / restore
+ **************************************************************************/
+
+/**
+ * Serialize full runtime state (variables, machine states and time in them, timers, filters, cycle number)
+ * into a caller provided buffer. Buffer layout is position independent, so it can be
+ * a memory mapped file (flush it with msync after this call)
+ * @return number of bytes written, 0 if buffer is too small (see snapshotSize)
+ */
+size_t StateMachineController::snapshot(uint8_t *buffer, size_t size)
+{
+  BinaryWriter writer(buffer, size);
+  _writeSnapshot(&writer);
+
+  if (writer.overflowed())
+    return 0;
+
+  return writer.size();
+}
+
+/**
+ * @return number of bytes required to store current snapshot
+ */
+size_t StateMachineController::snapshotSize()
+{
+  BinaryWriter writer(nullptr, 0);
+  _writeSnapshot(&writer);
+  return writer.size();
+}
+
+/**
+ * Restore runtime state from snapshot. Use it instead of init() for a warm restart:
+ * definition should be already set, init actions are not executed.
+ * Machines not present in snapshot are initialized as in init().
+ * @return false if snapshot is corrupted or of unsupported version, nothing is changed then
+ */
+bool StateMachineController::restore(const uint8_t *buffer, size_t size)
+{
+  if (buffer == nullptr || size < SNAPSHOT_HEADER_SIZE + 4)
+    return false;
+
+  BinaryReader header(buffer, size);
+  if (header.readByte() != SNAPSHOT_MAGIC_0 ||
+      header.readByte() != SNAPSHOT_MAGIC_1 ||
+      header.readByte() != SNAPSHOT_MAGIC_2 ||
+      header.readByte() != SNAPSHOT_VERSION)
+    return false;
+
+  size_t length = header.readUInt32();
+  if (length > size || length < SNAPSHOT_HEADER_SIZE + 4)
+    return false;
+
+  BinaryReader checksum(buffer + length - 4, 4);
+  if (binaryCrc32(buffer, length - 4) != checksum.readUInt32())
+    return false;
+
+  // checksum is fine, so data can be applied while reading
+
+  BinaryReader reader(buffer + SNAPSHOT_HEADER_SIZE, length - SNAPSHOT_HEADER_SIZE - 4);
+
+  cycleNum = reader.readVarUInt();
+
+  if (!compute.store.readSnapshot(&reader) ||
+      !timers.readSnapshot(&reader) ||
+      !compute.filters.readSnapshot(&reader))
+    return false;
+
+  _loadStateMachines();
+
+  bool restored[MAX_STATE_MACHINES] = {false};
+  char machineName[MAX_BINARY_STRING_LEN];
+  char stateName[MAX_BINARY_STRING_LEN];
+  unsigned long count = reader.readVarUInt();
+  unsigned long now = timers.getTime();
+
+  for (unsigned long i = 0; i < count && !reader.failed(); i++)
+  {
+    if (!reader.readString(machineName, MAX_BINARY_STRING_LEN) ||
+        !reader.readString(stateName, MAX_BINARY_STRING_LEN))
+      break;
+
+    // time in state is stored relative to snapshot time, as timers are
+    unsigned long inState = reader.readVarUInt();
+    if (reader.failed())
+      break;
+
+    STATE_MACHINE_SLOT *slot = _findStateMachine(machineName);
+    if (slot == nullptr)
+      continue;
+
+    restored[slot - _stateMachines] = true;
+
+    if (!stateName[0])
+      continue;
+
+    // state may be gone if definition has changed, fall back to initial state then
+
+    slot->state = _findState(slot, stateName);
+    if (slot->state != nullptr)
+      slot->enteredAt = now - inState;
+    else
+    {
+      auto initial_state = slot->machine[SM_INITIAL_STATE];
+      if (initial_state.is<char *>() && ((const char *)initial_state)[0])
+        _switchState(slot, (const char *)initial_state);
+    }
+  }
+
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    if (!restored[i])
+      _initStateMachine(&_stateMachines[i]);
+  }
+
+  return true;
+}
+
+void StateMachineController::_writeSnapshot(BinaryWriter *writer)
+{
+  writer->writeByte(SNAPSHOT_MAGIC_0);
+  writer->writeByte(SNAPSHOT_MAGIC_1);
+  writer->writeByte(SNAPSHOT_MAGIC_2);
+  writer->writeByte(SNAPSHOT_VERSION);
+  writer->writeUInt32(0); // total length, patched below
+
+  writer->writeVarUInt(cycleNum);
+
+  compute.store.writeSnapshot(writer);
+  timers.writeSnapshot(writer);
+  compute.filters.writeSnapshot(writer);
+
+  writer->writeVarUInt(_stateMachineCount);
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    writer->writeString(_stateMachines[i].name);
+    writer->writeString(_stateMachines[i].state);
+    writer->writeVarUInt(timers.elapsed(_stateMachines[i].enteredAt));
+  }
+
+  size_t length = writer->size() + 4;
+  writer->patchUInt32(4, length);
+
+  if (!writer->overflowed())
+    writer->writeUInt32(binaryCrc32(writer->buffer(), writer->size()));
+  else
+    writer->writeUInt32(0);
+}
+
 /**************************************************************************
  *                        Private methods
  **************************************************************************/
@@ -168,11 +782,43 @@ void StateMachineController::_yield()
 
 void StateMachineController::_sleep(unsigned long ms)
 {
-  if (_sleepCallback)
+  if (!_sleepCallback)
+    return;
+
+  if ((_eventSlice == 0 && !_wakeCallback) || ms == 0)
+  {
     _sleepCallback(ms);
+    return;
+  }
+
+  // sleep is ended early by wake function, events are handled when it returns
+
+  if (_wakeCallback)
+  {
+    unsigned long start = timers.getTime();
+    for (unsigned long slept = 0; slept < ms; slept = timers.elapsed(start))
+    {
+      processEvents();
+      _sleepCallback(ms - slept);
+    }
+    processEvents();
+    return;
+  }
+
+  // fallback: sleep in slices, events are handled as soon as a slice ends
+
+  for (unsigned long slept = 0; slept < ms;)
+  {
+    processEvents();
+
+    unsigned long slice = ms - slept < _eventSlice ? ms - slept : _eventSlice;
+    _sleepCallback(slice);
+    slept += slice;
+  }
+  processEvents();
 }
 
-void StateMachineController::_runAction(JsonVariant action)
+void StateMachineController::_runAction(JsonVariant action, ActionList *compiled, size_t item)
 {
   // check if action is string and it is not empty
   if (action.is<char *>() && ((const char *)action)[0])
@@ -182,7 +828,7 @@ void StateMachineController::_runAction(JsonVariant action)
   }
   else if (action.is<JsonObject>())
   {
-    _runActionWithParams(action.as<JsonObject>());
+    _runActionWithParams(action.as<JsonObject>(), compiled, item);
   }
 }
 
@@ -194,6 +840,14 @@ void StateMachineController::_runAction(const char *actionId)
     _actionMap[actionId](&_actionContext);
     SM_DEBUG("Action done: " << actionId << "\n");
   }
+  else if (_runTypedAction(actionId))
+  {
+    SM_DEBUG("Typed action done: " << actionId << "\n");
+  }
+  else if (_startAsyncAction(actionId))
+  {
+    SM_DEBUG("Async action started: " << actionId << "\n");
+  }
   // check if action is one of registered plugin actions
   else
   {
@@ -201,40 +855,153 @@ void StateMachineController::_runAction(const char *actionId)
   }
 }
 
-void StateMachineController::_runActionWithParams(JsonObject actions)
+/**
+ * Run actions of action object, compiled parameters of list item are used if available
+ */
+void StateMachineController::_runActionWithParams(JsonObject actions, ActionList *compiled, size_t item)
 {
   if (actions.isNull())
     return;
 
+  size_t index = 0;
+
   for (JsonPair action : actions)
   {
     const char *actionId = action.key().c_str();
+    ActionParams *compiledParams = compiled == nullptr ? nullptr : compiled->get(item, index);
+    index++;
 
-    JsonVariant item = action.value();
-    if (!item.is<JsonArray>())
+    JsonVariant value = action.value();
+    if (!value.is<JsonArray>())
       continue;
-    JsonArray params = item.as<JsonArray>();
+    JsonArray params = value.as<JsonArray>();
 
     if (strcasecmp(actionId, ASSIGNMENT_ACTION_ID) == 0)
     {
       // variable assignment action (variable := expression)
       if (params.size() < 2 || !params[0].is<char *>())
         return;
-      _runAssignmentAction(params[0], params[1]);
+      _runAssignmentAction(params[0], params[1], compiledParams);
     }
     else
     {
       // regular actions
-      _actionContext.setParams(&params);
+      _actionContext.setParams(&params, compiledParams);
       _runAction(actionId);
       _actionContext.resetParams();
     }
   }
 }
 
-void StateMachineController::_runPluginActions(const char *actionId)
+/**
+ * Run action registered with typed arguments
+ * @return false if there is no such action
+ */
+bool StateMachineController::_runTypedAction(const char *actionId)
 {
-  SM_DEBUG("Try run plugin action: " << actionId << "\n");
+  std::map<const char *, ActionBinding *, KeyCompare>::iterator it = _typedActionMap.find(actionId);
+  if (it == _typedActionMap.end())
+    return false;
+
+  it->second->run(&_actionContext);
+  return true;
+}
+
+/**
+ * Start asynchronous action, it is kept as pending task if it does not complete at once
+ * @return false if there is no such asynchronous action
+ */
+bool StateMachineController::_startAsyncAction(const char *actionId)
+{
+  AsyncTask *task = nullptr;
+
+  std::map<const char *, AsyncActionFunction, KeyCompare>::iterator it = _asyncActionMap.find(actionId);
+  if (it != _asyncActionMap.end())
+    task = new AsyncTask(it->second, _actionContext.getParams(), &timers);
+
+#ifdef ASYNC_COROUTINES
+  std::map<const char *, CoroutineActionFunction, KeyCompare>::iterator co = _coroutineActionMap.find(actionId);
+  if (task == nullptr && co != _coroutineActionMap.end())
+    task = new AsyncTask(co->second, _actionContext.getParams(), &timers, &_actionContext);
+#endif
+
+  if (task == nullptr)
+    return false;
+
+  if (task->resume(&_actionContext) == ASYNC_DONE)
+    delete task;
+  else
+    _addTask(task);
+
+  return true;
+}
+
+void StateMachineController::_addTask(AsyncTask *task)
+{
+  if (_runningMachine != nullptr)
+    _runningMachine->tasks.push_back(task);
+  else
+    _detachedTasks.push_back(task);
+}
+
+/**
+ * Resume tasks which are ready and remove completed ones
+ * @return true if all tasks are completed
+ */
+bool StateMachineController::_resumeTasks(std::vector<AsyncTask *> *tasks)
+{
+  for (size_t i = 0; i < tasks->size();)
+  {
+    AsyncTask *task = (*tasks)[i];
+
+    bool ready = task->isTimeReady();
+    if (ready && task->waitMachine != nullptr)
+    {
+      STATE_MACHINE_SLOT *machine = _findStateMachine(task->waitMachine);
+      ready = machine != nullptr && machine->state != nullptr && strcmp(machine->state, task->waitMachineState) == 0;
+    }
+
+    if (ready && task->resume(&_actionContext) == ASYNC_DONE)
+    {
+      delete task;
+      tasks->erase(tasks->begin() + i);
+    }
+    else
+      i++;
+  }
+  return tasks->empty();
+}
+
+/**
+ * Continue machine waiting for asynchronous actions, run actions deferred while waiting
+ * @return true if machine is not waiting anymore
+ */
+bool StateMachineController::_resumeMachine(STATE_MACHINE_SLOT *slot)
+{
+  if (!_resumeTasks(&slot->tasks))
+    return false;
+
+  std::vector<DEFERRED_ACTIONS> deferred;
+  deferred.swap(slot->deferred);
+
+  // actions deferred again (new task is pending) keep their order in slot->deferred
+  for (size_t i = 0; i < deferred.size(); i++)
+    _runActions(deferred[i].actions, deferred[i].from, deferred[i].compiled);
+
+  return slot->tasks.empty();
+}
+
+void StateMachineController::_clearTasks(STATE_MACHINE_SLOT *slot)
+{
+  for (size_t i = 0; i < slot->tasks.size(); i++)
+    delete slot->tasks[i];
+  slot->tasks.clear();
+  slot->deferred.clear();
+}
+
+void StateMachineController::_runPluginActions(const char *actionId)
+{
+  SM_DEBUG("Try run plugin action: " << actionId << "\n");
 
   char *pluginId, *pluginActionId;
   char buff[strlen(actionId) + 1];
@@ -261,36 +1028,99 @@ void StateMachineController::_runPluginActions(const char *actionId)
   }
 }
 
-void StateMachineController::_runActions(JsonVariant actions)
+void StateMachineController::_runActions(JsonVariant actions, size_t from, ActionList *compiled)
 {
   if (!actions.isNull() && actions.is<JsonArray>())
   {
-    for (JsonVariant action : (JsonArray)actions)
+    JsonArray list = actions.as<JsonArray>();
+    size_t index = 0;
+
+    for (JsonVariant action : list)
     {
-      _runAction(action);
+      if (index++ < from)
+        continue;
+
+      // machine waits for asynchronous action, the rest runs when it completes
+
+      if (_runningMachine != nullptr && !_runningMachine->tasks.empty())
+      {
+        _runningMachine->deferred.push_back({list, index - 1, compiled});
+        return;
+      }
+
+      _runAction(action, compiled, index - 1);
       _yield();
     }
   }
 }
 
-void StateMachineController::_runAssignmentAction(const char *varName, JsonVariant expression)
+void StateMachineController::_runAssignmentAction(const char *varName, JsonVariant expression, ActionParams *compiled)
 {
-  setVar(varName, compute.evalMath(expression));
+  setVar(varName, compiled != nullptr ? compiled->get(1) : compute.evalMath(expression));
 }
 
 void StateMachineController::_runInitAction()
 {
-  _runActions(_definition[DEFINITION_INIT_ACTION]);
+  _runActions(_definition[DEFINITION_INIT_ACTION], 0, _initActions);
 }
 
 void StateMachineController::_initStateMachines()
 {
+  _loadStateMachines();
+
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    _initStateMachine(&_stateMachines[i]);
+  }
+}
+
+void StateMachineController::_initStateMachine(STATE_MACHINE_SLOT *slot)
+{
+  _runningMachine = slot;
+
+  // run initial actions
+
+  _runActions(slot->machine[SM_INITIAL_ACTIONS], 0, slot->initialActions);
+
+  // set machine to the starting state
+
+  auto initial_state = slot->machine[SM_INITIAL_STATE];
+  if (initial_state.is<char *>() && ((const char *)initial_state)[0])
+  {
+    _switchState(slot, (const char *)initial_state);
+  }
+  else
+  {
+    // no initial state => state machine will not be working
+    slot->state = nullptr;
+  }
+
+  _runningMachine = nullptr;
+}
+
+void StateMachineController::_loadStateMachines(std::vector<STATE_MACHINE_SLOT> *previous, RELOAD_STATS *stats)
+{
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    _clearRules(&_stateMachines[i]);
+    _clearActions(&_stateMachines[i]);
+    _clearTasks(&_stateMachines[i]);
+  }
+
+  _stateMachineCount = 0;
+  actionErrors.resize(_definitionErrors); // errors of machine actions are found again
+
   auto state_machines = _definition[DEFINITION_STATE_MACHINES];
 
   if (!state_machines.is<JsonObject>())
     return;
 
-  _stateMachineCount = 0;
+  // timers referenced in definition, to find timers owned by a single state
+
+  std::map<const char *, int, KeyCompare> timerRefs;
+  _countTimers(_definition, &timerRefs);
+  _eventTargets.clear();
+
   for (JsonPair state_machine : (JsonObject)state_machines)
   {
 
@@ -311,34 +1141,523 @@ void StateMachineController::_initStateMachines()
     STATE_MACHINE_SLOT *slot = &_stateMachines[_stateMachineCount];
 
     slot->name = state_machine.key().c_str();
+    slot->state = nullptr;
     slot->machine = machine;
     slot->states_definition = states_definition.as<JsonObject>();
+    slot->maxSteps = _getMaxSteps(machine[SM_RUN_TO_COMPLETION]);
+    long int period = machine[SM_PERIOD].is<long int>() ? machine[SM_PERIOD].as<long int>() : 0;
+    slot->period = period > 0 ? period : 0;
+    slot->priority = machine[SM_PRIORITY].is<int>() ? machine[SM_PRIORITY].as<int>() : 0;
+    slot->nextRun = timers.getTime();
+    slot->enteredAt = slot->nextRun;
+    slot->seenVersion = compute.store.getVersion();
+    slot->parked = false;
+    _compileRules(slot, _findPrevious(previous, slot->name), stats);
+    _compileActions(slot);
+    _findTimerStates(slot, &timerRefs);
+    _indexReferences(_stateMachineCount);
 
-    // run initial actions
+    if (++_stateMachineCount >= MAX_STATE_MACHINES)
+    {
+      --_stateMachineCount;
+      break;
+    }
+  }
 
-    _runActions(machine[SM_INITIAL_ACTIONS]);
+  // higher priority machines run first, equal priorities keep definition order
 
-    // set machine to the starting state
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    int j = i;
+    for (; j > 0 && _stateMachines[_runOrder[j - 1]].priority < _stateMachines[i].priority; j--)
+      _runOrder[j] = _runOrder[j - 1];
+    _runOrder[j] = i;
+  }
+}
+
+/**
+ * Time until the first machine with own period is due
+ * @return time in ms, or -1 if any machine runs every cycle
+ */
+long StateMachineController::_timeToNextMachine()
+{
+  if (_stateMachineCount == 0)
+    return -1;
+
+  unsigned long now = timers.getTime();
+  long wait = -1;
+
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    STATE_MACHINE_SLOT *slot = &_stateMachines[i];
+    if (slot->period == 0)
+      return -1;
+
+    long due = (long)(slot->nextRun - now);
+    if (due < 0)
+      due = 0;
+    if (wait < 0 || due < wait)
+      wait = due;
+  }
+
+  return wait;
+}
 
-    auto initial_state = machine[SM_INITIAL_STATE];
-    if (initial_state.is<char *>() && ((const char *)initial_state)[0])
+/**
+ * Compile exit rules of all states, so long runs of comparisons
+ * of a single variable are evaluated by table lookup
+ */
+void StateMachineController::_compileRules(STATE_MACHINE_SLOT *slot, STATE_MACHINE_SLOT *previous, RELOAD_STATS *stats)
+{
+  for (JsonPair state : slot->states_definition)
+  {
+    JsonVariant rules = state.value()[STATE_EXIT_RULES];
+    if (!rules.is<JsonArray>() || rules.size() < RULE_TABLE_MIN_RULES)
+      continue;
+
+    // on reload, table of the same rules is taken over from previous machine
+
+    RuleTable *table = previous == nullptr ? nullptr : _findRules(previous, state.key().c_str());
+    if (table != nullptr && _sameDefinition(previous->states_definition[state.key().c_str()][STATE_EXIT_RULES], rules))
     {
-      _switchState(slot, (const char *)initial_state);
+      previous->ruleTables.erase(state.key().c_str());
+
+      size_t index = 0;
+      for (JsonVariant rule : rules.as<JsonArray>())
+        table->rebind(index++, _isValidRule(rule) ? rule[STATE_RULE_IF].as<JsonVariant>() : JsonVariant(), &compute);
+
+      slot->ruleTables[state.key().c_str()] = table;
+      if (stats != nullptr)
+        stats->rulesReused++;
+      continue;
     }
+
+    if (stats != nullptr)
+      stats->rulesCompiled++;
+
+    table = new RuleTable();
+    size_t index = 0;
+
+    for (JsonVariant rule : rules.as<JsonArray>())
+      table->addRule(index++, _isValidRule(rule) ? rule[STATE_RULE_IF].as<JsonVariant>() : JsonVariant(), &compute);
+
+    if (table->finish())
+      slot->ruleTables[state.key().c_str()] = table;
     else
+      delete table;
+  }
+}
+
+/**
+ * Compile rules of loaded machines again, after definition was modified in place
+ */
+void StateMachineController::_recompileRules()
+{
+  std::map<const char *, int, KeyCompare> timerRefs;
+  _countTimers(_definition, &timerRefs);
+
+  _compileActions();
+  _eventTargets.clear();
+
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    _clearRules(&_stateMachines[i]);
+    _compileRules(&_stateMachines[i]);
+    _findTimerStates(&_stateMachines[i], &timerRefs);
+    _indexReferences(i);
+
+    // deferred actions run with parameters evaluated from definition
+
+    for (size_t j = 0; j < _stateMachines[i].deferred.size(); j++)
+      _stateMachines[i].deferred[j].compiled = nullptr;
+    _clearActions(&_stateMachines[i]);
+    _compileActions(&_stateMachines[i]);
+  }
+}
+
+void StateMachineController::_clearRules(STATE_MACHINE_SLOT *slot)
+{
+  for (std::map<const char *, RuleTable *, KeyCompare>::iterator it = slot->ruleTables.begin(); it != slot->ruleTables.end(); ++it)
+    delete it->second;
+  slot->ruleTables.clear();
+  slot->timerStates.clear();
+}
+
+/**
+ * Compile parameters of definition actions, parameters of machine actions are compiled with machines
+ */
+void StateMachineController::_compileActions()
+{
+  actionErrors.clear();
+  delete _initActions;
+  delete _beforeActions;
+  delete _afterActions;
+  _initActions = _compileActionList(_definition[DEFINITION_INIT_ACTION]);
+  _beforeActions = _compileActionList(_definition[DEFINITION_BEFORE_ACTION]);
+  _afterActions = _compileActionList(_definition[DEFINITION_AFTER_ACTION]);
+  _definitionErrors = actionErrors.size();
+}
+
+/**
+ * Compile parameters of machine actions, state entry actions and rule exit actions, so that
+ * constants are evaluated and variables are looked up once, not every time action runs
+ */
+void StateMachineController::_compileActions(STATE_MACHINE_SLOT *slot)
+{
+  slot->initialActions = _compileActionList(slot->machine[SM_INITIAL_ACTIONS]);
+  slot->beforeActions = _compileActionList(slot->machine[SM_BEFORE_CYCLE_ACTIONS]);
+
+  for (JsonPair state : slot->states_definition)
+  {
+    STATE_ACTIONS *actions = new STATE_ACTIONS();
+    actions->entry = _compileActionList(state.value()[STATE_ENTRY_ACTIONS]);
+
+    JsonVariant rules = state.value()[STATE_EXIT_RULES];
+    if (rules.is<JsonArray>())
     {
-      // no initial state => state machine will not be working
-      slot->state = nullptr;
+      for (JsonVariant rule : rules.as<JsonArray>())
+        actions->exit.push_back(_compileActionList(rule[STATE_RULE_EXIT_ACTIONS]));
     }
 
-    if (++_stateMachineCount >= MAX_STATE_MACHINES)
+    slot->actions[state.key().c_str()] = actions;
+  }
+}
+
+void StateMachineController::_clearActions(STATE_MACHINE_SLOT *slot)
+{
+  for (std::map<const char *, STATE_ACTIONS *, KeyCompare>::iterator it = slot->actions.begin(); it != slot->actions.end(); ++it)
+  {
+    delete it->second->entry;
+    for (size_t i = 0; i < it->second->exit.size(); i++)
+      delete it->second->exit[i];
+    delete it->second;
+  }
+  slot->actions.clear();
+
+  delete slot->initialActions;
+  delete slot->beforeActions;
+  slot->initialActions = nullptr;
+  slot->beforeActions = nullptr;
+}
+
+/**
+ * @return compiled parameters of action list, nullptr if there is no action list
+ */
+ActionList *StateMachineController::_compileActionList(JsonVariant actions)
+{
+  if (!actions.is<JsonArray>())
+    return nullptr;
+
+  _checkArity(actions.as<JsonArray>());
+  return new ActionList(actions.as<JsonArray>(), &compute);
+}
+
+/**
+ * Report typed actions called with wrong number of parameters (see actionErrors)
+ */
+void StateMachineController::_checkArity(JsonArray actions)
+{
+  for (JsonVariant action : actions)
+  {
+    if (action.is<const char *>() && getActionArity(action.as<const char *>()) > 0)
     {
-      --_stateMachineCount;
-      break;
+      ACTION_ERROR error = {action.as<const char *>(), getActionArity(action.as<const char *>()), 0};
+      actionErrors.push_back(error);
+    }
+    if (!action.is<JsonObject>())
+      continue;
+
+    for (JsonPair item : action.as<JsonObject>())
+    {
+      int arity = getActionArity(item.key().c_str());
+      int given = item.value().is<JsonArray>() ? item.value().size() : 0;
+      if (arity < 0 || arity == given)
+        continue;
+
+      ACTION_ERROR error = {item.key().c_str(), arity, given};
+      actionErrors.push_back(error);
+    }
+  }
+}
+
+STATE_ACTIONS *StateMachineController::_findActions(STATE_MACHINE_SLOT *slot, const char *state)
+{
+  // state names are case sensitive in definition
+  std::map<const char *, STATE_ACTIONS *, KeyCompare>::iterator it = slot->actions.find(state);
+  if (it == slot->actions.end() || strcmp(it->first, state) != 0)
+    return nullptr;
+
+  return it->second;
+}
+
+/**
+ * Compile text expressions of conditions, named expressions and assignments at load
+ */
+void StateMachineController::_prepareInfix()
+{
+  compute.infix.clear();
+  compute.infix.prepare(_definition[DEFINITION_EXPRESSIONS]);
+  _prepareInfixActions(_definition[DEFINITION_INIT_ACTION]);
+  _prepareInfixActions(_definition[DEFINITION_BEFORE_ACTION]);
+  _prepareInfixActions(_definition[DEFINITION_AFTER_ACTION]);
+
+  JsonVariant machines = _definition[DEFINITION_STATE_MACHINES];
+  if (!machines.is<JsonObject>())
+    return;
+
+  for (JsonPair machine : machines.as<JsonObject>())
+  {
+    _prepareInfixActions(machine.value()[SM_INITIAL_ACTIONS]);
+    _prepareInfixActions(machine.value()[SM_BEFORE_CYCLE_ACTIONS]);
+
+    JsonVariant states = machine.value()[SM_STATES];
+    if (!states.is<JsonObject>())
+      continue;
+
+    for (JsonPair state : states.as<JsonObject>())
+    {
+      _prepareInfixActions(state.value()[STATE_ENTRY_ACTIONS]);
+
+      JsonVariant rules = state.value()[STATE_EXIT_RULES];
+      if (!rules.is<JsonArray>())
+        continue;
+
+      for (JsonVariant rule : rules.as<JsonArray>())
+      {
+        compute.infix.prepare(rule[STATE_RULE_IF]);
+        _prepareInfixActions(rule[STATE_RULE_EXIT_ACTIONS]);
+      }
     }
   }
 }
 
+/**
+ * Compile text expressions of assignment actions, ex. {":=": ["power", "level * 10"]}
+ */
+void StateMachineController::_prepareInfixActions(JsonVariant actions)
+{
+  if (!actions.is<JsonArray>())
+    return;
+
+  for (JsonVariant action : actions.as<JsonArray>())
+  {
+    JsonVariant params = action[ASSIGNMENT_ACTION_ID];
+    if (params.is<JsonArray>() && params.size() > 1)
+      compute.infix.prepare(params[1]);
+  }
+}
+
+/**
+ * Count "elapsed" conditions by timer name in definition
+ */
+void StateMachineController::_countTimers(JsonVariant node, std::map<const char *, int, KeyCompare> *refs)
+{
+  if (node.is<const char *>())
+  {
+    // compiled text expression, ex. "elapsed('blink', 500)"
+    JsonVariant compiled = compute.infix.find(node.as<const char *>());
+    if (!compiled.isNull())
+      _countTimers(compiled, refs);
+  }
+  else if (node.is<JsonArray>())
+  {
+    for (JsonVariant item : node.as<JsonArray>())
+      _countTimers(item, refs);
+  }
+  else if (node.is<JsonObject>())
+  {
+    for (JsonPair item : node.as<JsonObject>())
+    {
+      JsonVariant operands = item.value();
+      if (strcasecmp(item.key().c_str(), "elapsed") == 0 && operands.is<JsonArray>() && operands[0].is<const char *>())
+        (*refs)[operands[0].as<const char *>()]++;
+      _countTimers(operands, refs);
+    }
+  }
+}
+
+/**
+ * Find states which can be parked: all exit rules are "in_state" or "elapsed" conditions with constant timeouts,
+ * and their timers are not checked anywhere else, so skipping evaluation until the first
+ * timer elapses gives the same result as evaluating every cycle
+ */
+void StateMachineController::_findTimerStates(STATE_MACHINE_SLOT *slot, std::map<const char *, int, KeyCompare> *refs)
+{
+  for (JsonPair state : slot->states_definition)
+  {
+    JsonVariant rules = state.value()[STATE_EXIT_RULES];
+    if (!rules.is<JsonArray>() || rules.size() == 0)
+      continue;
+
+    std::map<const char *, int, KeyCompare> ownRefs;
+    bool timerOnly = true;
+
+    for (JsonVariant rule : rules.as<JsonArray>())
+    {
+      JsonVariant condition = compute.infix.resolve(rule[STATE_RULE_IF]);
+      if (!_isValidRule(rule) || condition.size() != 1)
+      {
+        timerOnly = false;
+        break;
+      }
+
+      JsonVariant timeout = condition["in_state"];
+      if (timeout.is<int>() || timeout.is<float>())
+        continue;
+
+      JsonVariant operands = condition["elapsed"];
+      if (!operands.is<JsonArray>() || operands.size() < 2 || !operands[0].is<const char *>() ||
+          !operands[0].as<const char *>()[0] || (!operands[1].is<int>() && !operands[1].is<float>()))
+      {
+        timerOnly = false;
+        break;
+      }
+      ownRefs[operands[0].as<const char *>()]++;
+    }
+
+    for (std::map<const char *, int, KeyCompare>::iterator it = ownRefs.begin(); timerOnly && it != ownRefs.end(); ++it)
+      timerOnly = (*refs)[it->first] == it->second;
+
+    if (timerOnly)
+      slot->timerStates[state.key().c_str()] = true;
+  }
+}
+
+/**
+ * Add states of machine to variable index used by events, names are taken
+ * from exit rules, text expressions and named expressions they use
+ */
+void StateMachineController::_indexReferences(int machine)
+{
+  for (JsonPair state : _stateMachines[machine].states_definition)
+  {
+    std::vector<const char *> names;
+    _collectReferences(state.value()[STATE_EXIT_RULES], &names);
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+      std::vector<STATE_REF> &refs = _eventTargets[names[i]];
+      if (!refs.empty() && refs.back().machine == machine && refs.back().state == state.key().c_str())
+        continue;
+
+      STATE_REF ref = {machine, state.key().c_str()};
+      refs.push_back(ref);
+    }
+  }
+}
+
+bool StateMachineController::_isTimerState(STATE_MACHINE_SLOT *slot, const char *state)
+{
+  if (slot->timerStates.empty())
+    return false;
+
+  std::map<const char *, bool, KeyCompare>::iterator it = slot->timerStates.find(state);
+  return it != slot->timerStates.end() && strcmp(it->first, state) == 0;
+}
+
+/**
+ * Skip evaluation of machine in timer state until its first timer elapses
+ */
+void StateMachineController::_park(STATE_MACHINE_SLOT *slot, JsonArray rules)
+{
+  unsigned long wait = 0;
+
+  for (JsonVariant rule : rules)
+  {
+    JsonVariant condition = compute.infix.resolve(rule[STATE_RULE_IF]);
+    unsigned long remaining;
+
+    if (condition.containsKey("in_state"))
+    {
+      unsigned long timeout = compute.evalMath(condition["in_state"]).vInt;
+      unsigned long passed = timers.elapsed(slot->enteredAt);
+      remaining = passed >= timeout ? 0 : timeout - passed;
+    }
+    else
+    {
+      JsonArray operands = condition["elapsed"].as<JsonArray>();
+      remaining = timers.remaining(operands[0].as<const char *>(), compute.evalMath(operands[1]).vInt);
+    }
+
+    // timer is not armed or is reset on next check
+    if (remaining == 0)
+      return;
+
+    if (wait == 0 || remaining < wait)
+      wait = remaining;
+  }
+
+  SM_DEBUG("Parking state machine " << slot->name << " for " << wait << "ms\n");
+
+  slot->parked = true;
+  slot->parkedUntil = timers.getTime() + wait;
+}
+
+RuleTable *StateMachineController::_findRules(STATE_MACHINE_SLOT *slot, const char *state)
+{
+  if (slot->ruleTables.empty())
+    return nullptr;
+
+  // state names are case sensitive in definition
+  std::map<const char *, RuleTable *, KeyCompare>::iterator it = slot->ruleTables.find(state);
+  if (it == slot->ruleTables.end() || strcmp(it->first, state) != 0)
+    return nullptr;
+
+  return it->second;
+}
+
+bool StateMachineController::_isValidRule(JsonVariant item)
+{
+  if (!item.is<JsonObject>() || item.isNull())
+    return false;
+
+  JsonObject rule = item.as<JsonObject>();
+  return !(rule[STATE_RULE_IF].isNull() ||
+           rule[STATE_RULE_THEN].isNull() ||
+           !rule[STATE_RULE_THEN].is<char *>() ||
+           !rule[STATE_RULE_THEN].as<char *>()[0]);
+}
+
+STATE_MACHINE_SLOT *StateMachineController::_findStateMachine(const char *name)
+{
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    if (strcasecmp(_stateMachines[i].name, name) == 0)
+      return &_stateMachines[i];
+  }
+  return nullptr;
+}
+
+/**
+ * Run to completion setting of machine: true for default step bound, or number of steps
+ * @return maximum number of transitions in one cycle
+ */
+unsigned int StateMachineController::_getMaxSteps(JsonVariant setting)
+{
+  long int steps = 1;
+
+  if (setting.is<bool>())
+    steps = setting.as<bool>() ? RUN_TO_COMPLETION_STEPS : 1;
+  else if (setting.is<long int>())
+    steps = setting.as<long int>();
+
+  if (steps < 1)
+    return 1;
+  return steps > MAX_RUN_TO_COMPLETION_STEPS ? MAX_RUN_TO_COMPLETION_STEPS : (unsigned int)steps;
+}
+
+const char *StateMachineController::_findState(STATE_MACHINE_SLOT *slot, const char *name)
+{
+  // return state name stored in definition, it lives as long as definition does
+
+  for (JsonPair state : slot->states_definition)
+  {
+    if (strcmp(state.key().c_str(), name) == 0)
+      return state.key().c_str();
+  }
+  return nullptr;
+}
+
 void StateMachineController::_switchState(STATE_MACHINE_SLOT *machineDefinition, const char *newState)
 {
   if (!newState[0])
@@ -348,6 +1667,8 @@ void StateMachineController::_switchState(STATE_MACHINE_SLOT *machineDefinition,
 
   // set new state
   machineDefinition->state = newState;
+  machineDefinition->enteredAt = timers.getTime();
+  machineDefinition->parked = false;
 
   // run initial state actions
   JsonVariant state_definition = machineDefinition->states_definition[newState];
@@ -355,70 +1676,244 @@ void StateMachineController::_switchState(STATE_MACHINE_SLOT *machineDefinition,
   if (!state_definition.is<JsonObject>())
     return;
   JsonVariant entryActions = state_definition[STATE_ENTRY_ACTIONS];
-  _runActions(entryActions);
+  STATE_ACTIONS *actions = _findActions(machineDefinition, newState);
+  _runActions(entryActions, 0, actions == nullptr ? nullptr : actions->entry);
 }
 
 void StateMachineController::_runStateMachines()
 {
+  unsigned long now = timers.getTime();
+
   for (int i = 0; i < _stateMachineCount; i++)
   {
+    STATE_MACHINE_SLOT *slot = &_stateMachines[_runOrder[i]];
+    _runningMachine = slot;
+
+    // machine waiting for asynchronous actions is not run, until they complete
+
+    if (!slot->tasks.empty() && !_resumeMachine(slot))
+      continue;
+
+    // machines with own period run only when due
+
+    if (slot->period > 0)
+    {
+      if ((long)(now - slot->nextRun) < 0)
+        continue;
+      slot->nextRun = _fixedRate ? _nextDeadline(slot->nextRun, slot->period, now, nullptr) : now + slot->period;
+    }
+
+    SM_DEBUG("Running state machine: " << slot->name << "\n");
 
-    SM_DEBUG("Running state machine: " << _stateMachines[i].name << "\n");
+    compute.setStateContext(&slot->enteredAt, &slot->seenVersion);
 
     // run initial actions for each cycle
 
-    _runActions(_stateMachines[i].machine[SM_BEFORE_CYCLE_ACTIONS]);
+    _runActions(slot->machine[SM_BEFORE_CYCLE_ACTIONS], 0, slot->beforeActions);
 
-    const char *state = _stateMachines[i].state;
-    JsonObject states_definition = _stateMachines[i].states_definition;
+    const char *state = slot->state;
+    bool evaluated = slot->tasks.empty();
+    const char *nextState = evaluated ? _stepStateMachine(slot) : nullptr;
+    if (nextState != nullptr && slot->maxSteps > 1)
+      _runToCompletion(slot, state, nextState);
 
-    // check if machine has defined states
+    compute.setStateContext(nullptr);
 
-    if (states_definition.isNull())
-      continue;
+    // parked machines have not evaluated rules, edges are kept for them
 
-    // get state definition
+    if (evaluated && !slot->parked)
+      slot->seenVersion = compute.store.getVersion();
+  }
 
-    JsonVariant state_definition = states_definition[state];
-    if (!state_definition.is<JsonObject>() || state_definition.isNull())
-      continue;
+  _runningMachine = nullptr;
+}
+
+/**
+ * Evaluate rules of machines which current state refers to variable
+ * @return number of machines evaluated
+ */
+size_t StateMachineController::_runTargeted(const char *name)
+{
+  size_t count = 0;
 
-    // get rules
+  std::map<const char *, std::vector<STATE_REF>, KeyCompare>::iterator targets = _eventTargets.find(name);
+  if (!name[0] || targets == _eventTargets.end())
+    return 0;
 
-    JsonVariant rules = state_definition.as<JsonObject>()[STATE_EXIT_RULES];
-    if (!rules.is<JsonArray>() || rules.isNull())
+  for (int i = 0; i < _stateMachineCount; i++)
+  {
+    STATE_MACHINE_SLOT *slot = &_stateMachines[_runOrder[i]];
+    if (slot->state == nullptr || !slot->tasks.empty())
       continue;
 
-    // check if any rule can be applied to get the next state
+    bool referenced = false;
+    for (size_t j = 0; j < targets->second.size() && !referenced; j++)
+      referenced = targets->second[j].machine == _runOrder[i] && strcmp(targets->second[j].state, slot->state) == 0;
+    if (!referenced)
+      continue;
 
-    const char *nextState = _getNextState(rules);
-    _yield();
+    count++;
+    _runningMachine = slot;
+    compute.setStateContext(&slot->enteredAt, &slot->seenVersion);
 
-    if (nextState == nullptr)
-      continue;
+    const char *state = slot->state;
+    const char *nextState = _stepStateMachine(slot);
+    if (nextState != nullptr && slot->maxSteps > 1)
+      _runToCompletion(slot, state, nextState);
+
+    compute.setStateContext(nullptr);
+    if (!slot->parked)
+      slot->seenVersion = compute.store.getVersion();
+    _runningMachine = nullptr;
+  }
+  return count;
+}
+
+/**
+ * Collect names used in rules, directly or by named expression
+ */
+void StateMachineController::_collectReferences(JsonVariant node, std::vector<const char *> *names, int depth)
+{
+  if (node.is<const char *>())
+  {
+    // text expression, compiled at load
+    JsonVariant compiled = compute.infix.find(node.as<const char *>());
+    if (compiled.isNull())
+      names->push_back(node.as<const char *>());
+    else
+      _collectReferences(compiled, names, depth);
+  }
+  else if (node.is<JsonArray>())
+  {
+    for (JsonVariant item : node.as<JsonArray>())
+      _collectReferences(item, names, depth);
+  }
+  else if (node.is<JsonObject>())
+  {
+    for (JsonPair item : node.as<JsonObject>())
+    {
+      if (strcmp(item.key().c_str(), "$") == 0 && item.value().is<const char *>() && depth < EXPRESSION_MAX_DEPTH)
+      {
+        std::map<const char *, EXPRESSION_SLOT *, KeyCompare>::iterator it = compute.expressions._expressionMap.find(item.value().as<const char *>());
+        if (it != compute.expressions._expressionMap.end())
+          _collectReferences(it->second->definition, names, depth + 1);
+      }
+      else
+        _collectReferences(item.value(), names, depth);
+    }
+  }
+}
+
+/**
+ * Keep following satisfied rules of the new states in the same cycle,
+ * stop when a state is entered again to not loop forever
+ */
+void StateMachineController::_runToCompletion(STATE_MACHINE_SLOT *slot, const char *state, const char *nextState)
+{
+
+  const char *visited[MAX_RUN_TO_COMPLETION_STEPS + 1]; // initial state and entered states
+  size_t visitedCount = 0;
+  visited[visitedCount++] = state;
+  visited[visitedCount++] = nextState;
+
+  for (unsigned int step = 1; step < slot->maxSteps && slot->tasks.empty() && (nextState = _stepStateMachine(slot)) != nullptr; step++)
+  {
+    bool loop = false;
+    for (size_t v = 0; v < visitedCount && !loop; v++)
+      loop = strcmp(visited[v], nextState) == 0;
+
+    if (loop)
+    {
+      SM_DEBUG("State " << nextState << " already entered in this cycle, stopping\n");
+      break;
+    }
+    visited[visitedCount++] = nextState;
+  }
+}
+
+/**
+ * Evaluate exit rules of the current state and switch to the next state if any rule is satisfied
+ * @return next state name or nullptr if state was not changed
+ */
+const char *StateMachineController::_stepStateMachine(STATE_MACHINE_SLOT *slot)
+{
+  const char *state = slot->state;
+  JsonObject states_definition = slot->states_definition;
+
+  // check if machine has defined states
+
+  if (states_definition.isNull() || state == nullptr)
+    return nullptr;
 
-    // switch state
-    _switchState(&_stateMachines[i], nextState);
+  // waiting for timers, nothing else can satisfy exit rules
+
+  if (slot->parked)
+  {
+    if ((long)(timers.getTime() - slot->parkedUntil) < 0)
+      return nullptr;
+    slot->parked = false;
+  }
+
+  // get state definition
+
+  JsonVariant state_definition = states_definition[state];
+  if (!state_definition.is<JsonObject>() || state_definition.isNull())
+    return nullptr;
+
+  // get rules
+
+  JsonVariant rules = state_definition.as<JsonObject>()[STATE_EXIT_RULES];
+  if (!rules.is<JsonArray>() || rules.isNull())
+    return nullptr;
+
+  // check if any rule can be applied to get the next state
+
+  const char *nextState = _getNextState(rules, _findRules(slot, state), _findActions(slot, state));
+  _yield();
+
+  if (nextState == nullptr || !nextState[0])
+  {
+    if (_isTimerState(slot, state))
+      _park(slot, rules.as<JsonArray>());
+    return nullptr;
   }
+
+  // switch state
+  _switchState(slot, nextState);
+  return nextState;
 }
 
-const char *StateMachineController::_getNextState(JsonArray rules)
+const char *StateMachineController::_getNextState(JsonArray rules, RuleTable *table, STATE_ACTIONS *actions)
 {
+  size_t index = 0, groupEnd = 0;
+  long int matched = -1;
+
   for (JsonVariant item : rules)
   {
+    size_t i = index++;
+
+    // compiled group of rules is evaluated at once, only the first satisfied rule is visited
+
+    if (table != nullptr)
+    {
+      RULE_GROUP *group = i >= groupEnd ? table->groupAt(i) : nullptr;
+      if (group != nullptr)
+      {
+        groupEnd = group->end;
+        matched = table->evalGroup(group, &compute.store);
+      }
+      if (i < groupEnd && (long int)i != matched)
+        continue;
+    }
+
     SM_DEBUG("Checking rule: " << item << "\n");
 
-    // validate rule
+    // validate rule, not needed if invalid rules were pruned
 
-    if (!item.is<JsonObject>() || item.isNull())
+    if (!_validated && !_isValidRule(item))
       continue;
 
     JsonObject rule = item.as<JsonObject>();
-    if (rule[STATE_RULE_IF].isNull() ||
-        rule[STATE_RULE_THEN].isNull() ||
-        !rule[STATE_RULE_THEN].is<char *>() ||
-        !rule[STATE_RULE_THEN].as<char *>()[0])
-      continue;
 
     // check rule
 
@@ -428,13 +1923,13 @@ const char *StateMachineController::_getNextState(JsonArray rules)
     SM_DEBUG("Evaluate condition: " << condition << "\n");
 
     // is rule satisfied ?
-    if (compute.evalCondition(rule[STATE_RULE_IF]))
+    if (i < groupEnd || compute.evalCondition(rule[STATE_RULE_IF]))
     {
       // run exit actions (if defined)
       if (!rule[STATE_RULE_EXIT_ACTIONS].isNull())
       {
         SM_DEBUG("Running exit actions\n");
-        _runActions(rule[STATE_RULE_EXIT_ACTIONS]);
+        _runActions(rule[STATE_RULE_EXIT_ACTIONS], 0, actions != nullptr && i < actions->exit.size() ? actions->exit[i] : nullptr);
       }
 
       // return next state name
@@ -15,12 +15,19 @@
 #define MAX_VAR_NAME_LEN 32     // maximum length of variable name ("device-id.var-name.type")
 #define MAX_VARIABLE_SPACE 1024 // maximum size of JSON storing local variables
 #define MAX_STATE_MACHINES 16
+#define RUN_TO_COMPLETION_STEPS 8      // transitions per cycle of machine with run to completion enabled
+#define MAX_RUN_TO_COMPLETION_STEPS 32 // upper bound of configured transitions per cycle
+#define FIXED_RATE_MAX_CATCH_UP 4      // missed deadlines run back to back, more are skipped
+#define CYCLE_JITTER_BUCKETS 8         // lateness histogram: 0, 1, 2-3, 4-7, ... ms
+#define EVENT_SLEEP_SLICE 1            // ms, sleep is split to slices to handle events while sleeping
 
 #define DEFINITION_INIT_ACTION "i"    // actions to run once before startin state machine
 #define DEFINITION_BEFORE_ACTION "b"  // actions to run before each state machines update cycle
 #define DEFINITION_AFTER_ACTION "a"   // actions to run after each statem machines update cycle
 #define DEFINITION_STATE_MACHINES "s" // definitions of all state machines
 #define DEFINITION_SLEEP_TIMEOUT "t"  // time to wait before running next update cycle
+#define DEFINITION_TABLES "l"         // named lookup and interpolation tables
+#define DEFINITION_EXPRESSIONS "e"    // named expressions, shared by conditions and math
 
 #define STATE_ENTRY_ACTIONS "a"     // actions to run when entering state
 #define STATE_EXIT_RULES "r"        // rules to check if any state exit conditions are met
@@ -32,9 +39,18 @@
 #define SM_INITIAL_ACTIONS "a"      // initial actios to run (executed only once)
 #define SM_BEFORE_CYCLE_ACTIONS "b" // actions to run before each specific state machine cycle
 #define SM_STATES "s"               // state definitios of state machine
+#define SM_RUN_TO_COMPLETION "c"    // follow satisfied rules of new states in the same cycle (true or max steps)
+#define SM_PERIOD "p"               // run state machine every "p" ms instead of every cycle
+#define SM_PRIORITY "o"             // order of running state machines, higher runs first (default 0)
 
 #define ASSIGNMENT_ACTION_ID ":="
 
+#define SNAPSHOT_MAGIC_0 'F'
+#define SNAPSHOT_MAGIC_1 'S'
+#define SNAPSHOT_MAGIC_2 'M'
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_HEADER_SIZE 8 // magic (3), version (1), total length including checksum (4)
+
 class StateMachineController; // forward declaration
 
 #include <map>
@@ -49,7 +65,14 @@ class StateMachineController; // forward declaration
 #include "compute/compute.h"
 #include "plugin/plugin.h"
 #include "actioncontext/actioncontext.h"
+#include "actionbinding/actionbinding.h"
+#include "actionparams/actionparams.h"
 #include "hooks/hooks.h"
+#include "binary/binary.h"
+#include "telemetry/telemetry.h"
+#include "rules/rules.h"
+#include "async/async.h"
+#include "events/events.h"
 
 #include "StateMachineDebug.h"
 
@@ -61,6 +84,8 @@ class StateMachineController; // forward declaration
  *  DEFINITION_STATE_MACHINES: { "machine1": machine},    // definitions of actual state machines
  *  DEFINITION_AFTER_ACTION:   ["action_name_3"],         // actions to execute after the cycle
  *  DEFINITION_SLEEP_TIMEOUT:  "ctrl.var_name_1"          // variable defining sleep between cycles, default 1000 (ms)
+ *  DEFINITION_TABLES:         { "table1": table }       // tables for "lut" and "interp" operations
+ *  DEFINITION_EXPRESSIONS:    { "expr1": expression }   // expressions referenced as {"$": "expr1"}
  * }
  * 
  * State Machines definition example with one machine "fan": 
@@ -103,6 +128,35 @@ class StateMachineController; // forward declaration
  *    }
  * }
  *  
+ * Machine with [SM_RUN_TO_COMPLETION]: true (or number of steps) continues with exit rules of the
+ * new state in the same cycle, so chains of immediately satisfied states (validate -> act -> done)
+ * do not wait for next cycles. Chain stops at the step bound or when a state repeats.
+ *
+ * Machines run every cycle by default. A machine with [SM_PERIOD]: 10000 runs only when due, and
+ * controller sleeps until the first such machine is due (or DEFINITION_SLEEP_TIMEOUT, if shorter).
+ * Machines are run by [SM_PRIORITY], higher first:
+ *   "interlock": { [SM_PERIOD]: 10, [SM_PRIORITY]: 10, ... },
+ *   "housekeeping": { [SM_PERIOD]: 10000, ... }
+ *
+ * Time in current state does not need a named timer, {"in_state": 5000} is satisfied
+ * 5000ms after machine entered its current state.
+ *
+ * States with exit rules of only {"in_state": <number>} or {"elapsed": [timer, <number>]} conditions
+ * (timers not used anywhere else) are not evaluated until the first of their timers elapses.
+ *
+ * Asynchronous actions (registerAsyncAction) can suspend and continue in later cycles. While
+ * any of them is pending, machine which started it does not run its actions and rules,
+ * other machines keep cycling. Remaining actions run once all of them complete.
+ *
+ * External events (postEvent, safe to call from interrupt handler) set variable of event name,
+ * and only machines which current state rules reference it are evaluated immediately.
+ * With enableEvents() controller handles events while sleeping. Given a wake function, sleep
+ * callback can block until time is up or wake function is called by postEvent (ex. wait for
+ * interrupt or semaphore); without it, controller falls back to sleeping in short slices.
+ *
+ * Definition can be replaced at run time with reload(): variables, timers and filters are kept,
+ * machines stay in their current states (if the state still exists), no init actions are run.
+ *
  * Condition structure example: 
  * {
  *   "and": [
@@ -115,6 +169,38 @@ class StateMachineController; // forward declaration
  *   ]
  * }
  *  
+ * Stateful filters keep their state under a unique name (first operand), similar to "elapsed" timers:
+ *   {"ema": ["temp-avg", "temp", 0.1]}               // exponential moving average, alpha 0.1
+ *   {"lowpass": ["temp-lp", "temp", 5000]}           // low-pass filter, time constant 5000ms
+ *   {"debounce": ["door", "door-sensor", 200]}       // condition stable for 200ms
+ *   {"hysteresis": ["heat", "temp", 22.5, 21.5]}     // on above 22.5, off below 21.5
+ *
+ * Tables are compiled when definition is set, lookup takes O(1) for dense keys, O(log n) otherwise:
+ *   "l": {
+ *     "mode-power": {"0": 0, "1": 250, "2": {"mul": ["boost", 100]}, "default": 0},
+ *     "fan-curve": [[20, 0], [25, 30], [30, 100]]
+ *   }
+ *   {"lut": ["mode-power", "mode"]}                  // or "switch", evaluates expression of key "mode"
+ *   {"interp": ["fan-curve", "temp"]}                // piecewise linear, clamped at the ends
+ *
+ * Named expressions are evaluated once and reused until one of their input variables is written,
+ * expressions depending on time or stateful operations are reused within the same cycle only:
+ *   "e": {
+ *     "overheat": {"or": [{"gt": ["temp", 80]}, {"gt": ["cpu.temp", 90]}]},
+ *     "heat-demand": {"sub": ["target", "temp"]}
+ *   }
+ *   {"$": "overheat"}                                // as condition
+ *   {"mul": [{"$": "heat-demand"}, 10]}              // as math
+ *
+ * Edge conditions detect value changes since the machine evaluating them was last run, including
+ * writes of machines running after it (outside of machines: since machines were run in the previous cycle):
+ *   {"changed": "mode"}, {"rising": "door"}, {"falling": "temp"}
+ *
+ * Operands of "sum", "mul", "min", "max", "avg" and "count" can be variable name patterns
+ * ("*" - any characters, "?" - single character), matching is case insensitive:
+ *   {"max": "*.temp"}                                // max of all temperatures
+ *   {"avg": ["zone3.*.power", "zone4.heater.power"]}
+ *
  * Variables are of the following structure:
  * { 
  *   "[scope.][plugin.]var-name": <value>
@@ -135,17 +221,90 @@ class StateMachineController; // forward declaration
  *     } 
  */
 
+#define FIXED_RATE_SKIP 0     // missed cycles are dropped, schedule continues at next future deadline
+#define FIXED_RATE_CATCH_UP 1 // missed cycles run without sleep, up to FIXED_RATE_MAX_CATCH_UP
+
+typedef struct cycle_stats
+{
+  unsigned long cycles;      // cycles started against a deadline
+  unsigned long overruns;    // cycles which ended after the next deadline
+  unsigned long skipped;     // deadlines dropped by FIXED_RATE_SKIP
+  unsigned long maxLateness; // ms between deadline and cycle start
+  unsigned long jitter[CYCLE_JITTER_BUCKETS];
+} CYCLE_STATS;
+
+/*
+ * Actions of a machine waiting for its asynchronous actions to complete
+ */
+typedef struct deferred_actions
+{
+  JsonArray actions;
+  size_t from;
+  ActionList *compiled; // parameters of actions, nullptr if not compiled
+} DEFERRED_ACTIONS;
+
+typedef struct reload_stats
+{
+  int machinesAdded;   // new machines, initialized as in init()
+  int machinesRemoved; // machines not present in new definition
+  int machinesKept;    // machines staying in their current state
+  int machinesReset;   // machines which state is gone, switched to initial state
+  int rulesReused;     // compiled rule tables of unchanged states
+  int rulesCompiled;   // rule tables compiled for new or changed states
+} RELOAD_STATS;
+
+/*
+ * Action registered with typed arguments (registerAction) called with wrong number of parameters
+ */
+typedef struct action_error
+{
+  const char *action; // action name in definition
+  int expected;       // parameters of registered action
+  int given;          // parameters in definition
+} ACTION_ERROR;
+
+/*
+ * Compiled action parameters of a state
+ */
+typedef struct state_actions
+{
+  ActionList *entry;              // entry actions, nullptr if there are none
+  std::vector<ActionList *> exit; // exit actions by rule index
+} STATE_ACTIONS;
+
 typedef struct state_machine_slot
 {
   const char *name;
   const char *state;
   JsonObject machine;
   JsonObject states_definition;
+  std::map<const char *, RuleTable *, KeyCompare> ruleTables; // compiled exit rules by state
+  std::map<const char *, STATE_ACTIONS *, KeyCompare> actions; // compiled action parameters by state
+  ActionList *initialActions;                                  // compiled parameters of machine initial actions
+  ActionList *beforeActions;                                   // compiled parameters of machine before cycle actions
+  unsigned int maxSteps;                                       // transitions per cycle, > 1 for run to completion
+  unsigned long period;                                        // ms between runs, 0 to run every cycle
+  int priority;                                                // higher priority machines run first
+  unsigned long nextRun;                                       // time when periodic machine is due
+  std::map<const char *, bool, KeyCompare> timerStates;        // states with only "elapsed" exit rules
+  unsigned long enteredAt;                                     // time when current state was entered
+  unsigned long seenVersion;                                   // store version when rules were last evaluated
+  bool parked;                                                 // waiting for timers of current state
+  unsigned long parkedUntil;                                   // time when the first timer elapses
+  std::vector<AsyncTask *> tasks;                              // pending asynchronous actions
+  std::vector<DEFERRED_ACTIONS> deferred;                      // actions to run when tasks complete
 } STATE_MACHINE_SLOT;
 
+typedef struct state_ref
+{
+  int machine;       // index of machine in _stateMachines
+  const char *state; // state which exit rules reference variable
+} STATE_REF;
+
 // callback declarations
 typedef void (*ActionFunction)(ActionContext *);
 typedef void (*SleepFunction)(unsigned long);
+typedef void (*WakeFunction)(void);
 typedef unsigned long (*GetTimeFunction)(void);
 
 class StateMachineController
@@ -154,22 +313,62 @@ public:
   Timers timers;
   Compute compute;
   unsigned long cycleNum = 0;
+  std::vector<ACTION_ERROR> actionErrors; // found when actions are compiled at load, calls are not run
 
   StateMachineController(const char *, SleepFunction, GetTimeFunction);
   void setActionRunner(ActionFunction);
   void registerAction(const char *, ActionFunction);
+
+  /**
+   * Register action with typed arguments, ex. void fan(long int speed, float target),
+   * parameters are evaluated and converted once per call. Supported argument types:
+   * long int, int, float, bool (condition), VarStruct, const char * (raw string) and ActionContext *.
+   * Register it before setDefinition, so calls with wrong number of parameters are found at load (actionErrors)
+   */
+  template <typename... Args>
+  void registerAction(const char *name, void (*action)(Args...))
+  {
+    delete _typedActionMap[name];
+    _typedActionMap[name] = new TypedActionBinding<Args...>(action);
+  }
+  void registerAsyncAction(const char *, AsyncActionFunction);
+#ifdef ASYNC_COROUTINES
+  void registerAsyncAction(const char *, CoroutineActionFunction);
+#endif
   void registerFunction(const char *, MathFunction);
   void registerFunction(const char *, BoolFunction);
   void registerPlugin(Plugin *);
+  bool hasAction(const char *);
+  int getActionArity(const char *);
   void setDefinition(JsonDocument *);
   void setDefinition(JsonVariant);
+  RELOAD_STATS reload(JsonDocument *);
+  RELOAD_STATS reload(JsonVariant);
   void init();
   void cycle();
   void setHooks(Hooks *);
+  void setChangeTracking(bool);
+  void enableEvents(unsigned long slice = EVENT_SLEEP_SLICE, WakeFunction wake = nullptr);
+  bool postEvent(const char *, const VarStruct &payload = 1l);
+  size_t processEvents();
+  void setFixedRate(bool, int policy = FIXED_RATE_SKIP);
+  const CYCLE_STATS *getCycleStats();
+  void resetCycleStats();
+  void attachGlobalMemory(JsonDocument *);
+  size_t refreshGlobalMemory();
+
+  void setJournal(JournalStorage *);
+  void setPersistent(const char *, bool persistent = true);
+
+  size_t snapshot(uint8_t *, size_t);
+  size_t snapshotSize();
+  bool restore(const uint8_t *, size_t);
 
   void setVar(const char *, const VarStruct &, bool isLocal = true);
   void setVar(const char *, float, bool isLocal = true);
   void setVar(const char *, long int, bool isLocal = true);
+  size_t setVars(JsonObject, const char *scope = nullptr);
+  size_t setVars(const char *, size_t, const char *scope = nullptr);
   float getVarFloat(const char *, float defaultValue = 0.0f);
   long int getVarInt(const char *, long int defaultValue = 0);
 
@@ -181,29 +380,92 @@ public:
   const char *_deviceId;
   Hooks *_hooks = nullptr;
 
-  JsonVariant _definition; // definition of the controller
+  JsonObject _definition; // definition of the controller
+  bool _validated = false;      // definition was pruned by analyzer, rules need no validity checks
+  size_t _definitionErrors = 0; // actionErrors of definition actions, the rest are of machine actions
+  ActionList *_initActions = nullptr;   // compiled parameters of definition actions
+  ActionList *_beforeActions = nullptr;
+  ActionList *_afterActions = nullptr;
 
   int _stateMachineCount = 0;
   STATE_MACHINE_SLOT _stateMachines[MAX_STATE_MACHINES];
+  int _runOrder[MAX_STATE_MACHINES]; // indexes of _stateMachines by priority
 
   std::map<const char *, ActionFunction, KeyCompare> _actionMap;
+  std::map<const char *, ActionBinding *, KeyCompare> _typedActionMap;
+  std::map<const char *, AsyncActionFunction, KeyCompare> _asyncActionMap;
+#ifdef ASYNC_COROUTINES
+  std::map<const char *, CoroutineActionFunction, KeyCompare> _coroutineActionMap;
+#endif
+  STATE_MACHINE_SLOT *_runningMachine = nullptr; // machine owning actions being run
+  std::vector<AsyncTask *> _detachedTasks;       // asynchronous actions started outside of machines
+
+  EventQueue _events;
+  unsigned long _eventSlice = 0;          // sleep slice when events are enabled
+  WakeFunction _wakeCallback = nullptr;   // ends sleep early when event is posted, slices are not needed then
+  std::map<const char *, std::vector<STATE_REF>, KeyCompare> _eventTargets; // variable name -> states which rules reference it
   std::map<const char *, Plugin *, KeyCompare> _pluginMap;
 
   SleepFunction _sleepCallback;
+  bool _fixedRate = false;
+  int _overrunPolicy = FIXED_RATE_SKIP;
+  bool _hasDeadline = false;
+  unsigned long _deadline = 0; // start time of the next cycle in fixed rate mode
+  CYCLE_STATS _cycleStats = CYCLE_STATS();
   void _yield();
   void _sleep(unsigned long);
+  void _recordLateness(unsigned long);
+  long _advanceDeadline(unsigned long, unsigned long);
+  unsigned long _nextDeadline(unsigned long, unsigned long, unsigned long, unsigned long *);
 
-  void _runAction(JsonVariant);
+  void _runAction(JsonVariant, ActionList *compiled = nullptr, size_t item = 0);
   void _runAction(const char *);
-  void _runActions(JsonVariant);
-  void _runActionWithParams(JsonObject);
-  void _runAssignmentAction(const char *, JsonVariant);
+  void _runActions(JsonVariant, size_t from = 0, ActionList *compiled = nullptr);
+  bool _runTypedAction(const char *);
+  bool _startAsyncAction(const char *);
+  void _addTask(AsyncTask *);
+  bool _resumeTasks(std::vector<AsyncTask *> *);
+  bool _resumeMachine(STATE_MACHINE_SLOT *);
+  void _clearTasks(STATE_MACHINE_SLOT *);
+  void _runActionWithParams(JsonObject, ActionList *compiled = nullptr, size_t item = 0);
+  void _runAssignmentAction(const char *, JsonVariant, ActionParams *compiled = nullptr);
   void _runPluginActions(const char *);
   void _runInitAction();
   void _initStateMachines();
+  void _initStateMachine(STATE_MACHINE_SLOT *);
+  void _loadStateMachines(std::vector<STATE_MACHINE_SLOT> *previous = nullptr, RELOAD_STATS *stats = nullptr);
+  STATE_MACHINE_SLOT *_findPrevious(std::vector<STATE_MACHINE_SLOT> *, const char *);
+  bool _sameDefinition(JsonVariant, JsonVariant);
+  STATE_MACHINE_SLOT *_findStateMachine(const char *);
+  const char *_findState(STATE_MACHINE_SLOT *, const char *);
+  void _writeSnapshot(BinaryWriter *);
+  void _compileRules(STATE_MACHINE_SLOT *, STATE_MACHINE_SLOT *previous = nullptr, RELOAD_STATS *stats = nullptr);
+  void _clearRules(STATE_MACHINE_SLOT *);
+  void _recompileRules();
+  void _prepareInfix();
+  void _compileActions();
+  void _compileActions(STATE_MACHINE_SLOT *);
+  void _clearActions(STATE_MACHINE_SLOT *);
+  ActionList *_compileActionList(JsonVariant);
+  void _checkArity(JsonArray);
+  STATE_ACTIONS *_findActions(STATE_MACHINE_SLOT *, const char *);
+  void _prepareInfixActions(JsonVariant);
+  RuleTable *_findRules(STATE_MACHINE_SLOT *, const char *);
+  bool _isValidRule(JsonVariant);
+  void _countTimers(JsonVariant, std::map<const char *, int, KeyCompare> *);
+  void _findTimerStates(STATE_MACHINE_SLOT *, std::map<const char *, int, KeyCompare> *);
+  void _indexReferences(int);
+  bool _isTimerState(STATE_MACHINE_SLOT *, const char *);
+  void _park(STATE_MACHINE_SLOT *, JsonArray);
+  unsigned int _getMaxSteps(JsonVariant);
   void _runStateMachines();
+  long _timeToNextMachine();
+  const char *_stepStateMachine(STATE_MACHINE_SLOT *);
+  void _runToCompletion(STATE_MACHINE_SLOT *, const char *, const char *);
+  size_t _runTargeted(const char *);
+  void _collectReferences(JsonVariant, std::vector<const char *> *, int depth = 0);
   void _switchState(STATE_MACHINE_SLOT *, const char *);
-  const char *_getNextState(JsonArray);
+  const char *_getNextState(JsonArray, RuleTable *table = nullptr, STATE_ACTIONS *actions = nullptr);
 
   ActionContext _actionContext;
 };
@@ -0,0 +1,18 @@
+#include "actionbinding.h"
+#include "../StateMachineDebug.h"
+
+/**
+ * Run action with parameters of context, parameter count has to match arguments
+ * @return false if action was not run
+ */
+bool ActionBinding::run(ActionContext *context)
+{
+    if (context->getCount() != arity())
+    {
+        SM_DEBUG("Action expects " << arity() << " parameters, got " << context->getCount() << "\n");
+        return false;
+    }
+
+    _call(context, context->getParams());
+    return true;
+}
@@ -0,0 +1,129 @@
+#ifndef actionbinding_h
+#define actionbinding_h
+
+#include <ArduinoJson.h>
+
+#include "../actioncontext/actioncontext.h"
+#include "../store/varStruct.h"
+
+/*
+ * Conversion of action parameter to argument type, parameter is evaluated once.
+ * Strings are passed as they are (ex. variable or timer names), bool parameters are conditions.
+ * Numeric parameters are taken by index, compiled parameters of context are used if available.
+ */
+template <typename T>
+struct ActionParam;
+
+template <>
+struct ActionParam<long int>
+{
+    static long int get(ActionContext *context, size_t index, JsonVariant) { return context->getParamInt(index); }
+};
+
+template <>
+struct ActionParam<int>
+{
+    static int get(ActionContext *context, size_t index, JsonVariant) { return context->getParamInt(index); }
+};
+
+template <>
+struct ActionParam<float>
+{
+    static float get(ActionContext *context, size_t index, JsonVariant) { return context->getParamFloat(index); }
+};
+
+template <>
+struct ActionParam<bool>
+{
+    static bool get(ActionContext *context, size_t, JsonVariant param) { return context->compute->evalCondition(param); }
+};
+
+template <>
+struct ActionParam<VarStruct>
+{
+    static VarStruct get(ActionContext *context, size_t index, JsonVariant) { return context->getParam(index, 0l); }
+};
+
+template <>
+struct ActionParam<const char *>
+{
+    static const char *get(ActionContext *, size_t, JsonVariant param) { return param.is<const char *>() ? param.as<const char *>() : ""; }
+};
+
+/*
+ * Binds parameters to arguments one by one. Numeric arguments are taken from context by index
+ * (compiled parameters if available), iterator follows the index for conditions and strings,
+ * which are read from parameters array. ActionContext * argument gets the context and takes no parameter.
+ */
+template <typename... Remaining>
+struct ActionBinder;
+
+template <>
+struct ActionBinder<>
+{
+    static const size_t arity = 0;
+
+    template <typename Function, typename... Bound>
+    static void call(Function action, ActionContext *, size_t, JsonArray::iterator, Bound... bound)
+    {
+        action(bound...);
+    }
+};
+
+template <typename... Rest>
+struct ActionBinder<ActionContext *, Rest...>
+{
+    static const size_t arity = ActionBinder<Rest...>::arity;
+
+    template <typename Function, typename... Bound>
+    static void call(Function action, ActionContext *context, size_t index, JsonArray::iterator param, Bound... bound)
+    {
+        ActionBinder<Rest...>::call(action, context, index, param, bound..., context);
+    }
+};
+
+template <typename First, typename... Rest>
+struct ActionBinder<First, Rest...>
+{
+    static const size_t arity = ActionBinder<Rest...>::arity + 1;
+
+    template <typename Function, typename... Bound>
+    static void call(Function action, ActionContext *context, size_t index, JsonArray::iterator param, Bound... bound)
+    {
+        First value = ActionParam<First>::get(context, index, *param);
+        ++param;
+        ActionBinder<Rest...>::call(action, context, index + 1, param, bound..., value);
+    }
+};
+
+/*
+ * Action with typed arguments, ex. void heater(long int power, float target)
+ */
+class ActionBinding
+{
+public:
+    virtual ~ActionBinding() {}
+
+    bool run(ActionContext *);
+    virtual size_t arity() = 0;
+
+protected:
+    virtual void _call(ActionContext *, JsonArray) = 0;
+};
+
+template <typename... Args>
+class TypedActionBinding : public ActionBinding
+{
+public:
+    TypedActionBinding(void (*action)(Args...)) { _action = action; }
+
+    size_t arity() { return ActionBinder<Args...>::arity; }
+
+protected:
+    void _call(ActionContext *context, JsonArray params) { ActionBinder<Args...>::call(_action, context, 0, params.begin()); }
+
+private:
+    void (*_action)(Args...);
+};
+
+#endif
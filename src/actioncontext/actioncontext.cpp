@@ -3,39 +3,61 @@
 ActionContext::ActionContext(Compute *compute)
 {
     this->compute = compute;
+    _params = nullptr;
+    _compiled = nullptr;
 }
 
 size_t ActionContext::getCount()
 {
+    if (_compiled != nullptr)
+        return _compiled->size();
     return _params == nullptr ? 0 : _params->size();
 }
 
 long int ActionContext::getParamInt(size_t paramPosition, long int defaultValue)
 {
-    return getCount() > paramPosition ? compute->evalMath(_params->getElement(paramPosition)).vInt : defaultValue;
+    return getCount() > paramPosition ? _evalParam(paramPosition).vInt : defaultValue;
 }
 
 float ActionContext::getParamFloat(size_t paramPosition, float defaultValue)
 {
-    return getCount() > paramPosition ? compute->evalMath(_params->getElement(paramPosition)).vFloat : defaultValue;
+    return getCount() > paramPosition ? _evalParam(paramPosition).vFloat : defaultValue;
 }
 
 VarStruct ActionContext::getParam(size_t paramPosition, long int defaultValue)
 {
-    return getCount() > paramPosition ? compute->evalMath(_params->getElement(paramPosition)) : defaultValue;
+    return getCount() > paramPosition ? _evalParam(paramPosition) : defaultValue;
 }
 
 VarStruct ActionContext::getParam(size_t paramPosition, float defaultValue)
 {
-    return getCount() > paramPosition ? compute->evalMath(_params->getElement(paramPosition)) : defaultValue;
+    return getCount() > paramPosition ? _evalParam(paramPosition) : defaultValue;
 }
 
-void ActionContext::setParams(JsonArray *params)
+/**
+ * Set parameters of action being run, compiled parameters (if any) have to be compiled from the same array
+ */
+void ActionContext::setParams(JsonArray *params, ActionParams *compiled)
 {
     _params = params;
+    _compiled = compiled;
+}
+
+JsonArray ActionContext::getParams()
+{
+    return _params == nullptr ? JsonArray() : *_params;
 }
 
 void ActionContext::resetParams()
 {
     _params = nullptr;
+    _compiled = nullptr;
+}
+
+/**
+ * Compiled parameter is taken by index, without walking the parameters array
+ */
+VarStruct ActionContext::_evalParam(size_t paramPosition)
+{
+    return _compiled != nullptr ? _compiled->get(paramPosition) : compute->evalMath(_params->getElement(paramPosition));
 }
@@ -5,6 +5,7 @@ class ActionContext; // forward ref
 
 #include <ArduinoJson.h>
 #include "../compute/compute.h"
+#include "../actionparams/actionparams.h"
 
 class ActionContext
 {
@@ -17,13 +18,17 @@ public:
     VarStruct getParam(size_t, long int defaultValue);
     VarStruct getParam(size_t, float defaultValue);
 
-    void setParams(JsonArray *);
+    void setParams(JsonArray *, ActionParams *compiled = nullptr);
+    JsonArray getParams();
     void resetParams();
 
     Compute *compute;
 
 private:
     JsonArray *_params;
+    ActionParams *_compiled; // parameters compiled at load, nullptr if not available
+
+    VarStruct _evalParam(size_t);
 };
 
 #endif
\ No newline at end of file
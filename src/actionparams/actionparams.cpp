@@ -0,0 +1,114 @@
+#include "actionparams.h"
+#include "../compute/compute.h"
+#include "../StateMachineDebug.h"
+
+ActionParams::ActionParams(JsonArray params, Compute *compute)
+{
+    _compute = compute;
+    _resolvedAt = (size_t)-1;
+
+    for (JsonVariant item : params)
+    {
+        ACTION_PARAM param = ACTION_PARAM();
+
+        if (item.isNull() || item.is<bool>() || item.is<int>() || item.is<float>())
+        {
+            param.type = PARAM_CONSTANT;
+            param.value = compute->evalMath(item);
+        }
+        else if (item.is<const char *>() && !Infix::isInfix(item.as<const char *>()))
+        {
+            param.type = PARAM_VARIABLE;
+            param.name = item.as<const char *>();
+        }
+        else
+        {
+            // same as evaluated by Compute::evalMath, with text expression compiled
+
+            param.type = PARAM_EXPRESSION;
+            param.expression = compute->infix.resolve(item);
+        }
+
+        _params.push_back(param);
+    }
+}
+
+size_t ActionParams::size()
+{
+    return _params.size();
+}
+
+/**
+ * @return PARAM_CONSTANT, PARAM_VARIABLE or PARAM_EXPRESSION, -1 if there is no such parameter
+ */
+int ActionParams::typeAt(size_t index)
+{
+    return index < _params.size() ? _params[index].type : -1;
+}
+
+/**
+ * Evaluate parameter, as Compute::evalMath of parameter in definition would do
+ */
+VarStruct ActionParams::get(size_t index)
+{
+    if (index >= _params.size())
+        return 0l;
+
+    ACTION_PARAM *param = &_params[index];
+
+    if (param->type == PARAM_CONSTANT)
+        return param->value;
+
+    if (param->type == PARAM_VARIABLE)
+    {
+        // variables were created since names were resolved, name can point to a new one
+
+        if (_resolvedAt != _compute->store.getVarCount())
+            _resolve();
+        return param->var == nullptr ? VarStruct(0l) : VarStruct(*param->var);
+    }
+
+    return _compute->evalMath(param->expression);
+}
+
+void ActionParams::_resolve()
+{
+    _resolvedAt = _compute->store.getVarCount();
+    for (size_t i = 0; i < _params.size(); i++)
+    {
+        if (_params[i].type == PARAM_VARIABLE)
+            _params[i].var = _compute->store.getVar(_params[i].name);
+    }
+}
+
+ActionList::ActionList(JsonArray actions, Compute *compute)
+{
+    for (JsonVariant action : actions)
+    {
+        _first.push_back(_params.size());
+        if (!action.is<JsonObject>())
+            continue;
+
+        for (JsonPair item : action.as<JsonObject>())
+            _params.push_back(item.value().is<JsonArray>() ? new ActionParams(item.value().as<JsonArray>(), compute) : nullptr);
+    }
+    _first.push_back(_params.size());
+
+    SM_DEBUG("Compiled parameters of " << _params.size() << " actions\n");
+}
+
+ActionList::~ActionList()
+{
+    for (size_t i = 0; i < _params.size(); i++)
+        delete _params[i];
+}
+
+/**
+ * @return parameters of action in list item, nullptr if action has no parameters array
+ */
+ActionParams *ActionList::get(size_t item, size_t action)
+{
+    if (item + 1 >= _first.size() || _first[item] + action >= _first[item + 1])
+        return nullptr;
+    return _params[_first[item] + action];
+}
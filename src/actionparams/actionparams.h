@@ -0,0 +1,64 @@
+#ifndef actionparams_h
+#define actionparams_h
+
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#include "../store/store.h"
+#include "../store/varStruct.h"
+
+class Compute; // forward ref
+
+#define PARAM_CONSTANT 0   // number or bool, evaluated at load
+#define PARAM_VARIABLE 1   // variable name, resolved to store slot
+#define PARAM_EXPRESSION 2 // operation or text expression, compiled at load
+
+typedef struct action_param
+{
+    int type;
+    VarStruct value;        // PARAM_CONSTANT
+    const char *name;       // PARAM_VARIABLE
+    VarStruct *var;         // resolved name, nullptr if variable does not exist
+    JsonVariant expression; // PARAM_EXPRESSION, text expressions in compiled form
+} ACTION_PARAM;
+
+/*
+ * Parameters of a single action, ex. {"heater": [100, "target", "target + 2"]},
+ * compiled once so evaluation at run time needs neither parsing nor variable lookup
+ */
+class ActionParams
+{
+public:
+    ActionParams(JsonArray, Compute *);
+
+    size_t size();
+    int typeAt(size_t);
+    VarStruct get(size_t);
+
+private:
+    Compute *_compute;
+    std::vector<ACTION_PARAM> _params;
+    size_t _resolvedAt; // store variable count when variables were resolved
+
+    void _resolve();
+};
+
+/*
+ * Compiled parameters of all actions in an action list, found by
+ * position of action in list and position of action in action object
+ */
+class ActionList
+{
+public:
+    ActionList(JsonArray, Compute *);
+    ~ActionList();
+
+    ActionParams *get(size_t, size_t);
+
+private:
+    std::vector<ActionParams *> _params; // nullptr for actions without parameters array
+    std::vector<size_t> _first;          // index of the first action of list item in _params
+};
+
+#endif
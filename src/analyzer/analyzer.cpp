@@ -0,0 +1,396 @@
+#include <string.h>
+
+#include "analyzer.h"
+
+Analyzer::Analyzer(StateMachineController *sm)
+{
+    _sm = sm;
+    _prune = false;
+    pruned = 0;
+}
+
+/**
+ * Check definition of the controller: unreachable states, shadowed and invalid rules,
+ * unknown actions and functions, missing target states. Collects memory footprint of machines.
+ * @param prune remove invalid and shadowed rules, unreachable states and unknown actions from definition
+ * @return number of issues found
+ */
+size_t Analyzer::analyze(bool prune)
+{
+    issues.clear();
+    footprints.clear();
+    pruned = 0;
+    _prune = prune;
+
+    JsonObject definition = _sm->_definition;
+    if (definition.isNull())
+        return 0;
+
+    _analyzeActions(nullptr, nullptr, -1, definition[DEFINITION_INIT_ACTION]);
+    _analyzeActions(nullptr, nullptr, -1, definition[DEFINITION_BEFORE_ACTION]);
+    _analyzeActions(nullptr, nullptr, -1, definition[DEFINITION_AFTER_ACTION]);
+
+    JsonVariant expressions = definition[DEFINITION_EXPRESSIONS];
+    if (expressions.is<JsonObject>())
+        for (JsonPair expression : expressions.as<JsonObject>())
+            _analyzeOperations(nullptr, nullptr, -1, expression.value());
+
+    JsonVariant item = definition[DEFINITION_STATE_MACHINES];
+    JsonObject machines = item.is<JsonObject>() ? item.as<JsonObject>() : JsonObject();
+    std::vector<const char *> invalid;
+
+    for (JsonPair machine : machines)
+    {
+        JsonVariant states = machine.value()[SM_STATES];
+        if (!machine.value().is<JsonObject>() || !(states.is<JsonObject>() || states.isNull()))
+        {
+            _report(ISSUE_INVALID_MACHINE, machine.key().c_str(), nullptr, -1, nullptr);
+            invalid.push_back(machine.key().c_str());
+            continue;
+        }
+        _analyzeMachine(machine.key().c_str(), machine.value().as<JsonObject>());
+    }
+
+    if (_prune)
+    {
+        for (size_t i = 0; i < invalid.size(); i++)
+            machines.remove(invalid[i]);
+        pruned += invalid.size();
+
+        // compiled rules refer to rule indexes, build them again for pruned definition
+
+        _sm->_validated = true;
+        _sm->_recompileRules();
+    }
+
+    // footprint of remaining machines
+
+    for (std::vector<MACHINE_FOOTPRINT>::iterator it = footprints.begin(); it != footprints.end(); ++it)
+    {
+        JsonObject machine = machines[it->machine].as<JsonObject>();
+        JsonObject states = machine[SM_STATES].as<JsonObject>();
+
+        it->states = states.size();
+        it->rules = 0;
+        for (JsonPair state : states)
+            it->rules += state.value()[STATE_EXIT_RULES].size();
+
+        it->bytes = strlen(it->machine) + 1 + _jsonSize(machine);
+
+        STATE_MACHINE_SLOT *slot = _sm->_findStateMachine(it->machine);
+        if (slot != nullptr)
+            for (std::map<const char *, RuleTable *, KeyCompare>::iterator table = slot->ruleTables.begin(); table != slot->ruleTables.end(); ++table)
+                if (table->second != nullptr)
+                    it->bytes += table->second->memoryUsage();
+    }
+
+    return issues.size();
+}
+
+/**
+ * @return number of issues of given type
+ */
+size_t Analyzer::count(int type)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < issues.size(); i++)
+        if (issues[i].type == type)
+            total++;
+    return total;
+}
+
+void Analyzer::_analyzeMachine(const char *name, JsonObject machine)
+{
+    _analyzeActions(name, nullptr, -1, machine[SM_INITIAL_ACTIONS]);
+    _analyzeActions(name, nullptr, -1, machine[SM_BEFORE_CYCLE_ACTIONS]);
+
+    JsonObject states = machine[SM_STATES].as<JsonObject>();
+
+    for (JsonPair state : states)
+    {
+        const char *stateName = state.key().c_str();
+        JsonVariant rules = state.value()[STATE_EXIT_RULES];
+
+        _analyzeActions(name, stateName, -1, state.value()[STATE_ENTRY_ACTIONS]);
+        if (rules.is<JsonArray>())
+            _analyzeRules(name, stateName, states, rules.as<JsonArray>());
+    }
+
+    // states reachable from initial state, and from current state if machine is already running
+
+    std::vector<const char *> reachable;
+    const char *initial = machine[SM_INITIAL_STATE].is<const char *>() ? machine[SM_INITIAL_STATE].as<const char *>() : nullptr;
+
+    if (initial == nullptr || !states.containsKey(initial))
+        _report(ISSUE_MISSING_TARGET, name, nullptr, -1, initial);
+    else
+        _markReachable(states, initial, &reachable);
+
+    STATE_MACHINE_SLOT *slot = _sm->_findStateMachine(name);
+    if (slot != nullptr && slot->state != nullptr && states.containsKey(slot->state))
+        _markReachable(states, slot->state, &reachable);
+
+    std::vector<const char *> unreachable;
+    for (JsonPair state : states)
+    {
+        if (_contains(&reachable, state.key().c_str()))
+            continue;
+        _report(ISSUE_UNREACHABLE_STATE, name, state.key().c_str(), -1, state.key().c_str());
+        unreachable.push_back(state.key().c_str());
+    }
+
+    // without known entry point everything is unreachable, keep states then
+
+    if (_prune && !reachable.empty())
+    {
+        for (size_t i = 0; i < unreachable.size(); i++)
+            states.remove(unreachable[i]);
+        pruned += unreachable.size();
+    }
+
+    MACHINE_FOOTPRINT footprint = {name, 0, (int)reachable.size(), 0, 0};
+    footprints.push_back(footprint);
+}
+
+/**
+ * Check exit rules of a state. Rules following always true rule are shadowed.
+ */
+void Analyzer::_analyzeRules(const char *machine, const char *state, JsonObject states, JsonArray rules)
+{
+    bool shadowed = false;
+    int index = 0;
+    size_t i = 0;
+
+    while (i < rules.size())
+    {
+        JsonVariant rule = rules[i];
+        int type = shadowed ? ISSUE_SHADOWED_RULE : !_sm->_isValidRule(rule) ? ISSUE_INVALID_RULE
+                                                                              : -1;
+        if (type >= 0)
+        {
+            _report(type, machine, state, index++, nullptr);
+            if (_prune)
+            {
+                rules.remove(i);
+                pruned++;
+            }
+            else
+            {
+                i++;
+            }
+            continue;
+        }
+
+        const char *target = rule[STATE_RULE_THEN].as<const char *>();
+        if (!states.containsKey(target))
+            _report(ISSUE_MISSING_TARGET, machine, state, index, target);
+
+        _analyzeOperations(machine, state, index, rule[STATE_RULE_IF]);
+        _analyzeActions(machine, state, index, rule[STATE_RULE_EXIT_ACTIONS]);
+
+        shadowed = _isAlwaysTrue(rule[STATE_RULE_IF]);
+        index++;
+        i++;
+    }
+}
+
+/**
+ * Report actions which are not registered, action list is like [ "action", {"action": [params]} ]
+ */
+void Analyzer::_analyzeActions(const char *machine, const char *state, int rule, JsonVariant actions)
+{
+    if (!actions.is<JsonArray>())
+        return;
+
+    JsonArray list = actions.as<JsonArray>();
+    size_t i = 0;
+
+    while (i < list.size())
+    {
+        JsonVariant action = list[i];
+        bool unknown = false;
+        bool named = action.is<const char *>();
+
+        if (named)
+        {
+            const char *name = action.as<const char *>();
+            if (name[0] && !_sm->hasAction(name))
+            {
+                _report(ISSUE_UNKNOWN_ACTION, machine, state, rule, name);
+                unknown = true;
+            }
+            else if (_sm->getActionArity(name) > 0)
+            {
+                _report(ISSUE_ACTION_ARITY, machine, state, rule, name);
+            }
+        }
+        else if (action.is<JsonObject>())
+        {
+            JsonObject object = action.as<JsonObject>();
+            std::vector<const char *> names;
+
+            for (JsonPair pair : object)
+            {
+                const char *name = pair.key().c_str();
+                if (strcasecmp(name, ASSIGNMENT_ACTION_ID) == 0)
+                {
+                    _analyzeOperations(machine, state, rule, pair.value()[1]);
+                }
+                else if (!_sm->hasAction(name))
+                {
+                    _report(ISSUE_UNKNOWN_ACTION, machine, state, rule, name);
+                    names.push_back(name);
+                }
+                else if (_sm->getActionArity(name) >= 0 && _sm->getActionArity(name) != (int)pair.value().size())
+                {
+                    _report(ISSUE_ACTION_ARITY, machine, state, rule, name);
+                }
+            }
+
+            if (_prune)
+            {
+                for (size_t n = 0; n < names.size(); n++)
+                    object.remove(names[n]);
+                pruned += names.size();
+            }
+            unknown = !names.empty() && object.size() == 0;
+        }
+
+        if (_prune && unknown)
+        {
+            list.remove(i);
+            pruned += named ? 1 : 0;
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/**
+ * Report operations of conditions and math expressions which are neither built in nor registered,
+ * and name patterns outside of aggregates (ex. "a*b", which is not a multiplication without spaces)
+ */
+void Analyzer::_analyzeOperations(const char *machine, const char *state, int rule, JsonVariant node, bool patterns)
+{
+    if (node.is<const char *>() && Infix::isInfix(node.as<const char *>()))
+    {
+        JsonVariant compiled = _sm->compute.infix.compile(node.as<const char *>());
+        if (compiled.isNull())
+            _report(ISSUE_SYNTAX_ERROR, machine, state, rule, node.as<const char *>());
+        _analyzeOperations(machine, state, rule, compiled, patterns);
+    }
+    else if (node.is<const char *>())
+    {
+        if (!patterns && Store::isPattern(node.as<const char *>()))
+            _report(ISSUE_SYNTAX_ERROR, machine, state, rule, node.as<const char *>());
+    }
+    else if (node.is<JsonArray>())
+    {
+        for (JsonVariant item : node.as<JsonArray>())
+            _analyzeOperations(machine, state, rule, item, patterns);
+    }
+    else if (node.is<JsonObject>())
+    {
+        for (JsonPair pair : node.as<JsonObject>())
+        {
+            if (!_sm->compute.isOperation(pair.key().c_str()))
+                _report(ISSUE_UNKNOWN_FUNCTION, machine, state, rule, pair.key().c_str());
+
+            // names of timers, filters and tables are not expressions
+
+            int names = Infix::nameOperands(pair.key().c_str());
+            size_t index = 0;
+            if (names == 0)
+                _analyzeOperations(machine, state, rule, pair.value(), _sm->compute.isAggregate(pair.key().c_str()));
+            else if (names == 1 && pair.value().is<JsonArray>())
+                for (JsonVariant operand : pair.value().as<JsonArray>())
+                    if (index++ > 0)
+                        _analyzeOperations(machine, state, rule, operand);
+        }
+    }
+}
+
+/**
+ * Collect states reachable from given state (breadth first)
+ */
+void Analyzer::_markReachable(JsonObject states, const char *from, std::vector<const char *> *reachable)
+{
+    if (_contains(reachable, from))
+        return;
+
+    size_t i = reachable->size();
+    reachable->push_back(from);
+
+    for (; i < reachable->size(); i++)
+    {
+        JsonVariant rules = states[(*reachable)[i]][STATE_EXIT_RULES];
+        if (!rules.is<JsonArray>())
+            continue;
+
+        for (JsonVariant rule : rules.as<JsonArray>())
+        {
+            if (!_sm->_isValidRule(rule))
+                continue;
+
+            const char *target = rule[STATE_RULE_THEN].as<const char *>();
+            if (states.containsKey(target) && !_contains(reachable, target))
+                reachable->push_back(target);
+
+            if (_isAlwaysTrue(rule[STATE_RULE_IF]))
+                break;
+        }
+    }
+}
+
+/**
+ * @return true for constant conditions which are always satisfied, ex. true or 1
+ */
+bool Analyzer::_isAlwaysTrue(JsonVariant condition)
+{
+    if (condition.is<bool>())
+        return condition.as<bool>();
+    if (condition.is<int>() || condition.is<float>())
+        return condition.as<float>() != 0.0;
+    return false;
+}
+
+bool Analyzer::_contains(std::vector<const char *> *names, const char *name)
+{
+    for (size_t i = 0; i < names->size(); i++)
+        if (strcmp((*names)[i], name) == 0)
+            return true;
+    return false;
+}
+
+/**
+ * @return estimated bytes of JSON value in document
+ */
+size_t Analyzer::_jsonSize(JsonVariant value)
+{
+    size_t size = ANALYZER_VALUE_SIZE;
+
+    if (value.is<const char *>())
+    {
+        size += strlen(value.as<const char *>()) + 1;
+    }
+    else if (value.is<JsonArray>())
+    {
+        for (JsonVariant item : value.as<JsonArray>())
+            size += _jsonSize(item);
+    }
+    else if (value.is<JsonObject>())
+    {
+        for (JsonPair pair : value.as<JsonObject>())
+            size += strlen(pair.key().c_str()) + 1 + _jsonSize(pair.value());
+    }
+
+    return size;
+}
+
+void Analyzer::_report(int type, const char *machine, const char *state, int rule, const char *name)
+{
+    DEFINITION_ISSUE issue = {type, machine, state, rule, name};
+    issues.push_back(issue);
+}
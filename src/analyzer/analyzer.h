@@ -0,0 +1,74 @@
+#ifndef analyzer_h
+#define analyzer_h
+
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#include "../StateMachine.h"
+
+#define ANALYZER_VALUE_SIZE 16 // estimated bytes of single JSON value in document pool
+
+#define ISSUE_INVALID_MACHINE 0    // machine is not an object or its states are not an object
+#define ISSUE_INVALID_RULE 1       // rule without condition or target state
+#define ISSUE_SHADOWED_RULE 2      // rule after always true rule, never evaluated
+#define ISSUE_MISSING_TARGET 3     // initial or target state not defined
+#define ISSUE_UNREACHABLE_STATE 4  // no path from initial state
+#define ISSUE_UNKNOWN_ACTION 5     // action not registered
+#define ISSUE_UNKNOWN_FUNCTION 6   // operation is not built in nor registered function
+#define ISSUE_SYNTAX_ERROR 7       // text expression can't be compiled
+#define ISSUE_ACTION_ARITY 8       // parameter count differs from arguments of typed action
+
+typedef struct definition_issue
+{
+    int type;
+    const char *machine; // nullptr for global actions and expressions
+    const char *state;   // nullptr if not related to a state
+    int rule;            // index of rule in state definition, -1 if not related to a rule
+    const char *name;    // action, function or state name
+} DEFINITION_ISSUE;
+
+typedef struct machine_footprint
+{
+    const char *machine;
+    int states;
+    int reachableStates;
+    int rules;
+    size_t bytes; // estimated size of definition and compiled rules
+} MACHINE_FOOTPRINT;
+
+/*
+ * Load-time analysis of controller definition. Run after actions, functions and plugins are registered.
+ * With pruning, dead entries are removed from the definition and the controller skips rule validation
+ * on each cycle. States entered only from code (ex. async waitState) are unreachable for analyzer,
+ * do not prune such definitions.
+ */
+class Analyzer
+{
+public:
+    Analyzer(StateMachineController *);
+
+    size_t analyze(bool prune = false);
+    size_t count(int);
+
+    std::vector<DEFINITION_ISSUE> issues;
+    std::vector<MACHINE_FOOTPRINT> footprints;
+    size_t pruned; // entries removed from definition
+
+private:
+    StateMachineController *_sm;
+    bool _prune;
+
+    void _analyzeMachine(const char *, JsonObject);
+    void _analyzeRules(const char *, const char *, JsonObject, JsonArray);
+    void _analyzeActions(const char *, const char *, int, JsonVariant);
+    void _analyzeOperations(const char *, const char *, int, JsonVariant, bool patterns = false);
+    void _markReachable(JsonObject, const char *, std::vector<const char *> *);
+
+    bool _isAlwaysTrue(JsonVariant);
+    bool _contains(std::vector<const char *> *, const char *);
+    size_t _jsonSize(JsonVariant);
+    void _report(int, const char *, const char *, int, const char *);
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "async.h"
+
+AsyncTask::AsyncTask(AsyncActionFunction function, JsonArray params, Timers *timers)
+    : _params(params)
+{
+    _function = function;
+    _timers = timers;
+    step = 0;
+    data = nullptr;
+    startedAt = timers->getTime();
+    waitMachine = nullptr;
+    waitMachineState = nullptr;
+    _resumeAt = 0;
+    _sleeping = false;
+}
+
+#ifdef ASYNC_COROUTINES
+
+/**
+ * Coroutine is created suspended, it starts running on the first resume()
+ */
+AsyncTask::AsyncTask(CoroutineActionFunction function, JsonArray params, Timers *timers, ActionContext *context)
+    : AsyncTask((AsyncActionFunction) nullptr, params, timers)
+{
+    context->setParams(&_params);
+    _coroutine = function(context, this).handle;
+    context->resetParams();
+}
+
+#endif
+
+AsyncTask::~AsyncTask()
+{
+#ifdef ASYNC_COROUTINES
+    if (_coroutine)
+        _coroutine.destroy();
+#endif
+}
+
+/**
+ * Resume action not earlier than in ms milliseconds
+ * @return ASYNC_PENDING
+ */
+int AsyncTask::sleep(unsigned long ms)
+{
+    _resumeAt = _timers->getTime() + ms;
+    _sleeping = true;
+    return ASYNC_PENDING;
+}
+
+/**
+ * Resume action when state machine gets into the state
+ * @return ASYNC_PENDING
+ */
+int AsyncTask::waitState(const char *machine, const char *state)
+{
+    waitMachine = machine;
+    waitMachineState = state;
+    return ASYNC_PENDING;
+}
+
+ASYNC_WAIT AsyncTask::delay(unsigned long ms)
+{
+    sleep(ms);
+    return {false};
+}
+
+ASYNC_WAIT AsyncTask::state(const char *machine, const char *state)
+{
+    waitState(machine, state);
+    return {false};
+}
+
+/**
+ * Resume in the next cycle, for polling readiness of I/O
+ */
+ASYNC_WAIT AsyncTask::next()
+{
+    return {false};
+}
+
+bool AsyncTask::isTimeReady()
+{
+    return !_sleeping || (long)(_timers->getTime() - _resumeAt) >= 0;
+}
+
+/**
+ * Run action until it suspends again, wait conditions have to be checked by caller
+ * @return ASYNC_DONE or ASYNC_PENDING
+ */
+int AsyncTask::resume(ActionContext *context)
+{
+    _sleeping = false;
+    waitMachine = nullptr;
+    waitMachineState = nullptr;
+
+    context->setParams(&_params);
+
+#ifdef ASYNC_COROUTINES
+    if (_coroutine)
+    {
+        _coroutine.resume();
+        context->resetParams();
+        return _coroutine.done() ? ASYNC_DONE : ASYNC_PENDING;
+    }
+#endif
+
+    int result = _function == nullptr ? ASYNC_DONE : _function(context, this);
+    context->resetParams();
+    return result;
+}
@@ -0,0 +1,126 @@
+#ifndef async_h
+#define async_h
+
+#include <ArduinoJson.h>
+
+#include "../timers/timers.h"
+#include "../actioncontext/actioncontext.h"
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define ASYNC_COROUTINES
+#endif
+
+#define ASYNC_DONE 0
+#define ASYNC_PENDING 1
+
+class AsyncTask; // forward ref
+
+/*
+ * Asynchronous action is called again in later cycles, until it returns ASYNC_DONE.
+ * Resume point is kept in task->step, ex.
+ *
+ * int readSensor(ActionContext *ctx, AsyncTask *task)
+ * {
+ *     switch (task->step++)
+ *     {
+ *     case 0:
+ *         startConversion();
+ *         return task->sleep(750);
+ *     case 1:
+ *         ctx->compute->setVar("temp", readConversion());
+ *     }
+ *     return ASYNC_DONE;
+ * }
+ */
+typedef int (*AsyncActionFunction)(ActionContext *, AsyncTask *);
+
+/*
+ * Result of wait request, can be awaited in coroutine actions
+ */
+typedef struct async_wait
+{
+    bool ready;
+
+#ifdef ASYNC_COROUTINES
+    bool await_ready() { return ready; }
+    void await_suspend(std::coroutine_handle<>) {}
+    void await_resume() {}
+#endif
+} ASYNC_WAIT;
+
+#ifdef ASYNC_COROUTINES
+
+/*
+ * Coroutine action, ex.
+ *
+ * AsyncCoroutine readSensor(ActionContext *ctx, AsyncTask *task)
+ * {
+ *     startConversion();
+ *     co_await task->delay(750);
+ *     while (!busReady())
+ *         co_await task->next();
+ *     ctx->compute->setVar("temp", readConversion());
+ * }
+ */
+class AsyncCoroutine
+{
+public:
+    struct promise_type
+    {
+        AsyncCoroutine get_return_object() { return AsyncCoroutine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+
+    explicit AsyncCoroutine(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+typedef AsyncCoroutine (*CoroutineActionFunction)(ActionContext *, AsyncTask *);
+
+#endif
+
+/*
+ * Suspended asynchronous action, it is resumed every cycle once its wait condition is met
+ */
+class AsyncTask
+{
+public:
+    AsyncTask(AsyncActionFunction, JsonArray, Timers *);
+#ifdef ASYNC_COROUTINES
+    AsyncTask(CoroutineActionFunction, JsonArray, Timers *, ActionContext *);
+#endif
+    ~AsyncTask();
+
+    int step;                // resume point of action
+    void *data;              // action data, action has to release it before returning ASYNC_DONE
+    unsigned long startedAt; // time when action was started
+
+    int sleep(unsigned long);
+    int waitState(const char *, const char *);
+    ASYNC_WAIT delay(unsigned long);
+    ASYNC_WAIT state(const char *, const char *);
+    ASYNC_WAIT next();
+
+    bool isTimeReady();
+    const char *waitMachine; // machine and state the task is waiting for, nullptr if none
+    const char *waitMachineState;
+
+    int resume(ActionContext *);
+
+private:
+    AsyncActionFunction _function;
+    JsonArray _params;
+    Timers *_timers;
+    unsigned long _resumeAt;
+    bool _sleeping;
+#ifdef ASYNC_COROUTINES
+    std::coroutine_handle<AsyncCoroutine::promise_type> _coroutine;
+#endif
+};
+
+#endif
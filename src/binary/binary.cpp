@@ -0,0 +1,236 @@
+#include <string.h>
+
+#include "binary.h"
+
+BinaryWriter::BinaryWriter(uint8_t *buffer, size_t capacity)
+{
+    _buffer = buffer;
+    _capacity = buffer == nullptr ? 0 : capacity;
+    _position = 0;
+}
+
+void BinaryWriter::writeByte(uint8_t value)
+{
+    if (_position < _capacity)
+        _buffer[_position] = value;
+    _position++;
+}
+
+void BinaryWriter::writeUInt16(uint16_t value)
+{
+    writeByte(value & 0xff);
+    writeByte(value >> 8);
+}
+
+void BinaryWriter::writeUInt32(uint32_t value)
+{
+    writeUInt16(value & 0xffff);
+    writeUInt16(value >> 16);
+}
+
+/**
+ * Write unsigned integer using 7 bits per byte, highest bit signals continuation
+ */
+void BinaryWriter::writeVarUInt(unsigned long value)
+{
+    while (value >= 0x80)
+    {
+        writeByte((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    writeByte(value);
+}
+
+/**
+ * Write signed integer using zig-zag encoding, so small negative values stay short
+ */
+void BinaryWriter::writeVarInt(long int value)
+{
+    writeVarUInt(((unsigned long)value << 1) ^ (unsigned long)(value < 0 ? -1l : 0l));
+}
+
+void BinaryWriter::writeFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeUInt32(bits);
+}
+
+/**
+ * Write string prefixed by length byte, strings longer than 255 are truncated
+ */
+void BinaryWriter::writeString(const char *value)
+{
+    size_t len = value == nullptr ? 0 : strlen(value);
+    if (len > 0xff)
+        len = 0xff;
+    writeByte(len);
+    writeBytes((const uint8_t *)value, len);
+}
+
+void BinaryWriter::writeBytes(const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        writeByte(data[i]);
+}
+
+void BinaryWriter::writeVar(const VarStruct &value)
+{
+    writeByte(value.type);
+    switch (value.type)
+    {
+    case VAR_TYPE_LONG:
+        writeVarInt(value.vInt);
+        break;
+    case VAR_TYPE_FLOAT:
+        writeFloat(value.vFloat);
+        break;
+    }
+}
+
+void BinaryWriter::patchUInt32(size_t position, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++, value >>= 8)
+        if (position + i < _capacity)
+            _buffer[position + i] = value & 0xff;
+}
+
+size_t BinaryWriter::size()
+{
+    return _position;
+}
+
+bool BinaryWriter::overflowed()
+{
+    return _position > _capacity;
+}
+
+uint8_t *BinaryWriter::buffer()
+{
+    return _buffer;
+}
+
+BinaryReader::BinaryReader(const uint8_t *buffer, size_t size)
+{
+    _buffer = buffer;
+    _size = buffer == nullptr ? 0 : size;
+    _position = 0;
+    _failed = false;
+}
+
+uint8_t BinaryReader::readByte()
+{
+    if (_position >= _size)
+    {
+        _failed = true;
+        return 0;
+    }
+    return _buffer[_position++];
+}
+
+uint16_t BinaryReader::readUInt16()
+{
+    uint16_t low = readByte();
+    return low | ((uint16_t)readByte() << 8);
+}
+
+uint32_t BinaryReader::readUInt32()
+{
+    uint32_t low = readUInt16();
+    return low | ((uint32_t)readUInt16() << 16);
+}
+
+unsigned long BinaryReader::readVarUInt()
+{
+    unsigned long value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    do
+    {
+        byte = readByte();
+        if (shift < sizeof(unsigned long) * 8)
+            value |= (unsigned long)(byte & 0x7f) << shift;
+        shift += 7;
+    } while ((byte & 0x80) && !_failed);
+
+    return value;
+}
+
+long int BinaryReader::readVarInt()
+{
+    unsigned long value = readVarUInt();
+    return (long int)(value >> 1) ^ -(long int)(value & 1);
+}
+
+float BinaryReader::readFloat()
+{
+    uint32_t bits = readUInt32();
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * Read length prefixed string into zero terminated buffer
+ * @return false if string does not fit into buffer or data is truncated
+ */
+bool BinaryReader::readString(char *buffer, size_t size)
+{
+    size_t len = readByte();
+    if (_failed || len >= size || _position + len > _size)
+    {
+        _failed = true;
+        return false;
+    }
+    memcpy(buffer, _buffer + _position, len);
+    buffer[len] = 0;
+    _position += len;
+    return true;
+}
+
+VarStruct BinaryReader::readVar()
+{
+    switch (readByte())
+    {
+    case VAR_TYPE_LONG:
+        return VarStruct(readVarInt());
+    case VAR_TYPE_FLOAT:
+        return VarStruct(readFloat());
+    case VAR_TYPE_NAN:
+        return VarStruct::NaN();
+    default:
+        _failed = true;
+        return VarStruct::NaN();
+    }
+}
+
+size_t BinaryReader::position()
+{
+    return _position;
+}
+
+size_t BinaryReader::remaining()
+{
+    return _size - _position;
+}
+
+bool BinaryReader::failed()
+{
+    return _failed;
+}
+
+/**
+ * CRC-32 (IEEE 802.3), bitwise implementation - no lookup table to save memory
+ */
+uint32_t binaryCrc32(const uint8_t *data, size_t size, uint32_t crc)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
@@ -0,0 +1,70 @@
+#ifndef binary_h
+#define binary_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../store/varStruct.h"
+
+#define MAX_BINARY_STRING_LEN 256 // strings are length prefixed by a single byte
+
+/*
+ * Little-endian encoder for compact binary formats (snapshots, journals, telemetry).
+ * Writing past the end of buffer does not fail immediately: bytes are counted,
+ * but not stored, so the same code can be used to measure required size
+ * (pass nullptr buffer).
+ */
+class BinaryWriter
+{
+public:
+    BinaryWriter(uint8_t *, size_t);
+
+    void writeByte(uint8_t);
+    void writeUInt16(uint16_t);
+    void writeUInt32(uint32_t);
+    void writeVarUInt(unsigned long);
+    void writeVarInt(long int);
+    void writeFloat(float);
+    void writeString(const char *);
+    void writeBytes(const uint8_t *, size_t);
+    void writeVar(const VarStruct &);
+    void patchUInt32(size_t, uint32_t);
+
+    size_t size();
+    bool overflowed();
+    uint8_t *buffer();
+
+private:
+    uint8_t *_buffer;
+    size_t _capacity;
+    size_t _position;
+};
+
+class BinaryReader
+{
+public:
+    BinaryReader(const uint8_t *, size_t);
+
+    uint8_t readByte();
+    uint16_t readUInt16();
+    uint32_t readUInt32();
+    unsigned long readVarUInt();
+    long int readVarInt();
+    float readFloat();
+    bool readString(char *, size_t);
+    VarStruct readVar();
+
+    size_t position();
+    size_t remaining();
+    bool failed();
+
+private:
+    const uint8_t *_buffer;
+    size_t _size;
+    size_t _position;
+    bool _failed;
+};
+
+uint32_t binaryCrc32(const uint8_t *, size_t, uint32_t crc = 0);
+
+#endif
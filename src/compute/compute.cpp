@@ -9,11 +9,21 @@
 #include "../StateMachineDebug.h"
 
 Compute::Compute(const char *deviceId, Timers *timers)
-    : store(deviceId), _mathFunctionMap(), _boolFunctionMap()
+    : store(deviceId), filters(timers), expressions(this, &store), _mathFunctionMap(), _boolFunctionMap()
 {
     _timers = timers;
 }
 
+/**
+ * Set entry time of the current state of machine being evaluated (for "in_state") and store version
+ * the machine has seen (for edge conditions), nullptr outside of machines
+ */
+void Compute::setStateContext(const unsigned long *enteredAt, const unsigned long *seenVersion)
+{
+    _stateEnteredAt = enteredAt;
+    _seenVersion = seenVersion;
+}
+
 void Compute::registerFunction(const char *name, MathFunction func)
 {
     _mathFunctionMap[name] = func;
@@ -24,6 +34,24 @@ void Compute::registerFunction(const char *name, BoolFunction func)
     _boolFunctionMap[name] = func;
 }
 
+/**
+ * @return true if name is a built-in operation or registered function
+ */
+bool Compute::isOperation(const char *name)
+{
+    return _decodeMathOp(name) != M_UNKNOWN || _decodeConditionOp(name) != C_UNKNOWN ||
+           _mathFunctionMap.count(name) || _boolFunctionMap.count(name);
+}
+
+/**
+ * @return true if operands of operation can be variable name patterns, ex. {"max": "*.temp"}
+ */
+bool Compute::isAggregate(const char *name)
+{
+    int op = _decodeMathOp(name);
+    return op > M_MULTI && op < M_FILTER;
+}
+
 void Compute::setVar(const char *varName, const VarStruct &value, bool isLocal)
 {
     store.setVar(varName, value, isLocal);
@@ -69,7 +97,10 @@ bool Compute::evalCondition(JsonVariant condition)
         return condition.as<float>() != 0.0;
     if (condition.is<char *>())
     {
-        return ((char *)condition.as<char *>())[0] ? store.getVarInt(condition) : false;
+        const char *text = condition.as<char *>();
+        if (Infix::isInfix(text))
+            return evalCondition(infix.compile(text)); // ex. "door && temp > 30"
+        return text[0] ? store.getVarInt(condition) : false;
     }
     if (!condition.is<JsonObject>())
         return false;
@@ -112,6 +143,53 @@ bool Compute::switchCondition(const char *operation, JsonVariant operands)
         }
     }
 
+    // time in current state of machine, ex. {"in_state": 5000}
+
+    if (op == C_IN_STATE)
+    {
+        if (_stateEnteredAt == nullptr || _timers == nullptr)
+            return false;
+
+        JsonVariant operand = operands.is<JsonArray>() ? operands[0] : operands;
+        return _timers->elapsed(*_stateEnteredAt) >= (unsigned long)evalMath(operand).vInt;
+    }
+
+    // named expression, ex. {"$": "overheat"}
+
+    if (op == C_EXPRESSION)
+    {
+        JsonVariant operand = operands.is<JsonArray>() ? operands[0] : operands;
+        return operand.is<const char *>() ? expressions.evalCondition(operand.as<const char *>()) : false;
+    }
+
+    // edge detection takes single variable name, ex. {"rising": "door"}
+
+    if (op > C_EDGE && op < C_REF)
+    {
+        JsonVariant operand = operands.is<JsonArray>() ? operands[0] : operands;
+        if (!operand.is<const char *>())
+            return false;
+
+        // machines compare to version they have seen, so writes of machines running after them are not missed
+
+        VarSlot *var = store.getSlot(operand.as<const char *>());
+        if (var == nullptr || !(_seenVersion != nullptr ? store.isChanged(var, *_seenVersion) : store.isChanged(var)))
+            return false;
+
+        VarStruct previous = _seenVersion != nullptr ? store.getPrevious(var, *_seenVersion) : store.getPrevious(var);
+
+        switch (op)
+        {
+        case C_RISING:
+            return *var > previous;
+        case C_FALLING:
+            return *var < previous;
+        case C_CHANGED:
+        default:
+            return true;
+        }
+    }
+
     // non unary operations requires array of operands, check that
 
     if (!operands.is<JsonArray>())
@@ -181,6 +259,28 @@ bool Compute::switchCondition(const char *operation, JsonVariant operands)
 
         return _timers->validateTimer(timerName, timeout);
     }
+    else if (op > C_FILTER && op < C_EDGE)
+    {
+        // stateful filters, first operand is a unique filter name
+
+        if (!arr[0].is<const char *>() || !arr[0].as<const char *>()[0])
+            return false;
+
+        const char *filterName = arr[0].as<const char *>();
+
+        switch (op)
+        {
+        case C_DEBOUNCE:
+            if (arr.size() < 3)
+                return evalCondition(arr[1]);
+            return filters.debounce(filterName, evalCondition(arr[1]), evalMath(arr[2]).vInt);
+
+        case C_HYSTERESIS:
+            if (arr.size() < 4)
+                return false;
+            return filters.hysteresis(filterName, evalMath(arr[1]), evalMath(arr[2]), evalMath(arr[3]));
+        }
+    }
 
     if (_boolFunctionMap.count(operation))
         return _execBoolFunction(operation, operands);
@@ -205,6 +305,8 @@ VarStruct Compute::evalMath(JsonVariant object)
     {
         // if type is string, we should look for variable of that name
         const char *varName = (char *)object.as<char *>();
+        if (Infix::isInfix(varName))
+            return evalMath(infix.compile(varName)); // ex. "(temp - 32) * 5 / 9"
         SM_DEBUG("Operand " << varName << " is a string. Evaluating it as var\n");
         VarStruct *var = store.getVar(varName);
         return var == nullptr ? VarStruct(0l) : VarStruct(*var);
@@ -366,68 +468,143 @@ VarStruct Compute::evalMath(JsonVariant object)
             return evalMath(evalCondition(arr[0]) ? arr[1] : arr[2]);
         }
     }
-    else if (op > M_MULTI)
+    else if (op > M_MULTI && op < M_FILTER)
+    {
+
+        // multi operand operations, variable name patterns are expanded to all matching variables
+        // ex. {"max": ["*.temp", "outside.temp"]}, {"sum": "zone3.*.power"}
+
+        VarStruct res;
+        unsigned long cnt = 0;
+
+        if (operands.is<JsonArray>())
+        {
+            for (JsonVariant operand : operands.as<JsonArray>())
+                _aggregate(op, operand, &res, &cnt);
+        }
+        else if (!operands.isNull())
+        {
+            _aggregate(op, operands, &res, &cnt);
+        }
+
+        if (op == M_COUNT)
+            return (long int)cnt;
+        if (cnt == 0)
+            return 0l;
+        if (op == M_AVG)
+            return res.type == VAR_TYPE_NAN ? res : VarStruct((float)(res.vFloat / cnt));
+
+        return res;
+    }
+
+    else if (op > M_FILTER && op < M_TABLE)
     {
+        // stateful filters, first operand is a unique filter name
+        // ex. {"ema": ["temp-filter", "temp", 0.1]}
 
-        // multi operand operations
+        if (!operands.is<JsonArray>())
+            return evalMath(operands);
 
         JsonArray arr = operands.as<JsonArray>();
-        if (arr.size() == 0)
+
+        if (arr.size() < 2)
             return 0l;
+        if (!arr[0].is<const char *>() || !arr[0].as<const char *>()[0] || arr.size() < 3)
+            return evalMath(arr[1]);
 
-        VarStruct res;
+        const char *filterName = arr[0].as<const char *>();
 
         switch (op)
         {
+        case M_EMA:
+            return filters.ema(filterName, evalMath(arr[1]), evalMath(arr[2]).vFloat);
 
-        case M_SUM:
+        case M_LOWPASS:
+        default:
+            return filters.lowpass(filterName, evalMath(arr[1]), (unsigned long)evalMath(arr[2]).vInt);
+        }
+    }
 
-            res = 0l;
-            for (JsonVariant operand : arr)
-                res = res + evalMath(operand);
-            return res;
+    else if (op > M_TABLE && op < M_REF)
+    {
+        // named tables (definition section "l"), first operand is a table name
+        // ex. {"lut": ["mode-power", "mode"]}, {"interp": ["fan-curve", "temp"]}
 
-        case M_MUL:
+        if (!operands.is<JsonArray>() || operands.size() < 2 || !operands[0].is<const char *>())
+            return 0l;
 
-            res = 1l;
-            for (JsonVariant operand : arr)
-                res = res * evalMath(operand);
-            return res;
+        const char *tableName = operands[0].as<const char *>();
+        VarStruct key = evalMath(operands[1]);
 
-        case M_MIN:
+        switch (op)
         {
-
-            unsigned cnt = 0;
-            for (JsonVariant operand : arr)
-            {
-                VarStruct val = evalMath(operand);
-                if (cnt++ == 0 || res > val)
-                    res = val;
-            }
-            return res;
+        case M_LUT:
+        {
+            JsonVariant value = tables.lookup(tableName, key);
+            return value.isNull() ? 0l : evalMath(value);
         }
 
-        case M_MAX:
+        case M_INTERP:
         default:
-        {
-            unsigned cnt = 0;
-            for (JsonVariant operand : arr)
-            {
-                VarStruct val = evalMath(operand);
-                if (cnt++ == 0 || res < val)
-                    res = val;
-            }
-            return res;
-        }
+            return tables.interpolate(tableName, key);
         }
     }
 
+    else if (op == M_EXPRESSION)
+    {
+        // named expression, ex. {"$": "heat-demand"}
+
+        JsonVariant operand = operands.is<JsonArray>() ? operands[0] : operands;
+        return operand.is<const char *>() ? expressions.evalMath(operand.as<const char *>()) : VarStruct(0l);
+    }
+
     if (_mathFunctionMap.count(operation))
         return _execMathFunction(operation, operands);
 
     return 0l;
 }
 
+void Compute::_aggregate(int op, JsonVariant operand, VarStruct *res, unsigned long *cnt)
+{
+    if (operand.is<const char *>() && Store::isPattern(operand.as<const char *>()))
+    {
+        VAR_QUERY *query = store.query(operand.as<const char *>());
+        for (std::vector<VarStruct *>::iterator it = query->vars.begin(); it != query->vars.end(); ++it)
+            _accumulate(op, **it, res, cnt);
+        return;
+    }
+
+    _accumulate(op, evalMath(operand), res, cnt);
+}
+
+void Compute::_accumulate(int op, const VarStruct &val, VarStruct *res, unsigned long *cnt)
+{
+    if ((*cnt)++ == 0)
+    {
+        *res = val;
+        return;
+    }
+
+    switch (op)
+    {
+    case M_SUM:
+    case M_AVG:
+        *res = *res + val;
+        break;
+    case M_MUL:
+        *res = *res * val;
+        break;
+    case M_MIN:
+        if (*res > val)
+            *res = val;
+        break;
+    case M_MAX:
+        if (*res < val)
+            *res = val;
+        break;
+    }
+}
+
 int Compute::_decodeMathOp(const char *op)
 {
     if (strcasecmp(op, "sqrt") == 0)
@@ -456,12 +633,26 @@ int Compute::_decodeMathOp(const char *op)
         return M_MIN;
     if (strcasecmp(op, "max") == 0)
         return M_MAX;
+    if (strcasecmp(op, "avg") == 0)
+        return M_AVG;
+    if (strcasecmp(op, "count") == 0)
+        return M_COUNT;
     if (strcasecmp(op, "?") == 0)
         return M_IF;
     if (strcasecmp(op, "ticks") == 0) // current time in OS units (provided by _getTimeCallback)
         return M_TICKS;
     if (strcasecmp(op, "diff") == 0) // time difference in OS units, for short periods (timer overflow safe)
         return M_DIFF;
+    if (strcasecmp(op, "ema") == 0) // exponential moving average
+        return M_EMA;
+    if (strcasecmp(op, "lowpass") == 0) // time based first order low-pass filter
+        return M_LOWPASS;
+    if (strcasecmp(op, "lut") == 0 || strcasecmp(op, "switch") == 0) // lookup table, integer key => expression
+        return M_LUT;
+    if (strcasecmp(op, "interp") == 0) // piecewise linear interpolation
+        return M_INTERP;
+    if (strcmp(op, "$") == 0) // named expression, cached until its inputs change
+        return M_EXPRESSION;
 
     return M_UNKNOWN;
 }
@@ -488,6 +679,20 @@ int Compute::_decodeConditionOp(const char *op)
         return C_NE;
     if (strcasecmp(op, "elapsed") == 0)
         return C_ELAPSED;
+    if (strcasecmp(op, "in_state") == 0) // time since machine entered its current state
+        return C_IN_STATE;
+    if (strcasecmp(op, "debounce") == 0)
+        return C_DEBOUNCE;
+    if (strcasecmp(op, "hysteresis") == 0)
+        return C_HYSTERESIS;
+    if (strcasecmp(op, "changed") == 0) // variable value changed since previous cycle
+        return C_CHANGED;
+    if (strcasecmp(op, "rising") == 0)
+        return C_RISING;
+    if (strcasecmp(op, "falling") == 0)
+        return C_FALLING;
+    if (strcmp(op, "$") == 0) // named expression, cached until its inputs change
+        return C_EXPRESSION;
 
     return C_UNKNOWN;
 }
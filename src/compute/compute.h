@@ -9,6 +9,10 @@ class Compute; // forward ref
 
 #include "../store/store.h"
 #include "../timers/timers.h"
+#include "../filters/filters.h"
+#include "../tables/tables.h"
+#include "../expressions/expressions.h"
+#include "../infix/infix.h"
 #include "../hooks/hooks.h"
 #include "../actioncontext/actioncontext.h"
 #include "../keycompare/keycompare.h"
@@ -40,6 +44,19 @@ class Compute; // forward ref
 #define M_MUL 402
 #define M_MIN 403
 #define M_MAX 404
+#define M_AVG 405
+#define M_COUNT 406
+
+#define M_FILTER 500
+#define M_EMA 501
+#define M_LOWPASS 502
+
+#define M_TABLE 600
+#define M_LUT 601
+#define M_INTERP 602
+
+#define M_REF 700
+#define M_EXPRESSION 701
 
 #define C_UNKNOWN -1
 
@@ -58,6 +75,19 @@ class Compute; // forward ref
 
 #define C_SYSTEM 1000
 #define C_ELAPSED 1001
+#define C_IN_STATE 1002
+
+#define C_FILTER 1100
+#define C_DEBOUNCE 1101
+#define C_HYSTERESIS 1102
+
+#define C_EDGE 1200
+#define C_CHANGED 1201
+#define C_RISING 1202
+#define C_FALLING 1203
+
+#define C_REF 1300
+#define C_EXPRESSION 1301
 
 typedef VarStruct (*MathFunction)(ActionContext *);
 typedef bool (*BoolFunction)(ActionContext *);
@@ -68,9 +98,15 @@ public:
     Compute(const char *, Timers *);
 
     Store store;
+    Filters filters;
+    Tables tables;
+    Expressions expressions;
+    Infix infix;
 
     void registerFunction(const char *, MathFunction);
     void registerFunction(const char *, BoolFunction);
+    bool isOperation(const char *);
+    bool isAggregate(const char *);
 
     bool evalCondition(JsonVariant);
     bool switchCondition(const char *, JsonVariant);
@@ -83,15 +119,21 @@ public:
     long int getVarInt(const char *, long int defaultValue = 0);
 
     void setHooks(Hooks *hooks);
+    void setStateContext(const unsigned long *, const unsigned long *seenVersion = nullptr);
 
 private:
     Timers *_timers;
+    const unsigned long *_stateEnteredAt = nullptr; // entry time of state of machine being evaluated
+    const unsigned long *_seenVersion = nullptr;    // store version machine being evaluated has seen
     int _decodeMathOp(const char *);
     int _decodeConditionOp(const char *);
 
     std::map<const char *, MathFunction, KeyCompare> _mathFunctionMap;
     std::map<const char *, BoolFunction, KeyCompare> _boolFunctionMap;
 
+    void _aggregate(int, JsonVariant, VarStruct *, unsigned long *);
+    void _accumulate(int, const VarStruct &, VarStruct *, unsigned long *);
+
     VarStruct _execMathFunction(const char *, JsonVariant);
     bool _execBoolFunction(const char *, JsonVariant);
 };
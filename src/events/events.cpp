@@ -0,0 +1,54 @@
+#include <string.h>
+
+#include "events.h"
+
+EventQueue::EventQueue()
+    : _head(0), _tail(0)
+{
+    dropped = 0;
+}
+
+/**
+ * Add event, called by producer
+ * @return false if queue is full or name is too long
+ */
+bool EventQueue::push(const char *name, const VarStruct &payload)
+{
+    unsigned int tail = _tail;
+    unsigned int next = (tail + 1) % EVENT_QUEUE_SIZE;
+
+    if (next == (unsigned int)_head || strlen(name) >= EVENT_NAME_LEN)
+    {
+        dropped++;
+        return false;
+    }
+
+    strcpy(_slots[tail].name, name);
+    _slots[tail].payload = payload;
+
+    // publish slot only after it is filled
+    _tail = next;
+    return true;
+}
+
+/**
+ * Take the oldest event, called by consumer
+ * @return false if queue is empty
+ */
+bool EventQueue::pop(EVENT_SLOT *event)
+{
+    unsigned int head = _head;
+    if (head == (unsigned int)_tail)
+        return false;
+
+    strcpy(event->name, _slots[head].name);
+    event->payload = _slots[head].payload;
+
+    _head = (head + 1) % EVENT_QUEUE_SIZE;
+    return true;
+}
+
+bool EventQueue::isEmpty()
+{
+    return (unsigned int)_head == (unsigned int)_tail;
+}
@@ -0,0 +1,51 @@
+#ifndef events_h
+#define events_h
+
+#include <stddef.h>
+
+#include "../store/varStruct.h"
+
+#if defined(__has_include)
+#if __has_include(<atomic>)
+#include <atomic>
+#define EVENTS_ATOMIC
+#endif
+#endif
+
+#define EVENT_QUEUE_SIZE 16 // pending events, power of two
+#define EVENT_NAME_LEN 32   // maximum length of event (variable) name, including terminator
+
+typedef struct event_slot
+{
+    char name[EVENT_NAME_LEN];
+    VarStruct payload;
+} EVENT_SLOT;
+
+#ifdef EVENTS_ATOMIC
+typedef std::atomic<unsigned int> EVENT_INDEX;
+#else
+typedef volatile unsigned char EVENT_INDEX; // single byte access is atomic on 8 bit MCUs
+#endif
+
+/*
+ * Bounded single producer, single consumer queue. Producer can be an interrupt handler
+ * or another thread, consumer is the controller. No locks, no allocations.
+ */
+class EventQueue
+{
+public:
+    EventQueue();
+
+    bool push(const char *, const VarStruct &);
+    bool pop(EVENT_SLOT *);
+    bool isEmpty();
+
+    unsigned long dropped; // events lost because queue was full
+
+private:
+    EVENT_SLOT _slots[EVENT_QUEUE_SIZE];
+    EVENT_INDEX _head; // next slot to read, written by consumer only
+    EVENT_INDEX _tail; // next slot to write, written by producer only
+};
+
+#endif
@@ -0,0 +1,229 @@
+#include <string.h>
+
+#include "expressions.h"
+#include "../compute/compute.h"
+#include "../StateMachineDebug.h"
+
+Expressions::Expressions(Compute *compute, Store *store)
+    : _expressionMap()
+{
+    _compute = compute;
+    _store = store;
+    _cycle = 0;
+}
+
+Expressions::~Expressions()
+{
+    clear();
+}
+
+/**
+ * Compile expressions of definition section: find their input variables,
+ * definition has to live as long as expressions do
+ */
+void Expressions::load(JsonVariant definition)
+{
+    clear();
+
+    if (!definition.is<JsonObject>())
+        return;
+
+    for (JsonPair item : definition.as<JsonObject>())
+    {
+        EXPRESSION_SLOT *slot = new EXPRESSION_SLOT();
+        slot->definition = item.value();
+        _expressionMap[item.key().c_str()] = slot;
+    }
+
+    for (std::map<const char *, EXPRESSION_SLOT *, KeyCompare>::iterator it = _expressionMap.begin(); it != _expressionMap.end(); ++it)
+    {
+        EXPRESSION_SLOT *slot = it->second;
+        slot->isVolatile = false;
+        slot->isContextual = false;
+        slot->evaluating = false;
+        _collectInputs(slot, slot->definition, 0);
+        _invalidate(slot);
+
+        SM_DEBUG("Expression [" << it->first << "] inputs: " << slot->inputNames.size() << (slot->isVolatile ? ", volatile\n" : "\n"));
+    }
+}
+
+void Expressions::clear()
+{
+    for (std::map<const char *, EXPRESSION_SLOT *, KeyCompare>::iterator it = _expressionMap.begin(); it != _expressionMap.end(); ++it)
+        delete it->second;
+    _expressionMap.clear();
+}
+
+/**
+ * Values of volatile expressions are dropped on the next cycle
+ */
+void Expressions::nextCycle()
+{
+    _cycle++;
+}
+
+VarStruct Expressions::evalMath(const char *name)
+{
+    EXPRESSION_SLOT *slot = _find(name);
+    if (slot == nullptr || slot->evaluating)
+        return 0l;
+
+    if (slot->mathValid && _isValid(slot))
+        return slot->mathValue;
+
+    unsigned long version = _store->getVersion();
+
+    slot->evaluating = true;
+    VarStruct value = _compute->evalMath(slot->definition);
+    slot->evaluating = false;
+
+    if (slot->version != version || slot->cycle != _cycle)
+        _invalidate(slot);
+
+    slot->mathValue = value;
+    slot->mathValid = true;
+    slot->version = version;
+    slot->cycle = _cycle;
+
+    return value;
+}
+
+bool Expressions::evalCondition(const char *name)
+{
+    EXPRESSION_SLOT *slot = _find(name);
+    if (slot == nullptr || slot->evaluating)
+        return false;
+
+    if (slot->conditionValid && _isValid(slot))
+        return slot->conditionValue;
+
+    unsigned long version = _store->getVersion();
+
+    slot->evaluating = true;
+    bool value = _compute->evalCondition(slot->definition);
+    slot->evaluating = false;
+
+    if (slot->version != version || slot->cycle != _cycle)
+        _invalidate(slot);
+
+    slot->conditionValue = value;
+    slot->conditionValid = true;
+    slot->version = version;
+    slot->cycle = _cycle;
+
+    return value;
+}
+
+EXPRESSION_SLOT *Expressions::_find(const char *name)
+{
+    std::map<const char *, EXPRESSION_SLOT *, KeyCompare>::iterator it = _expressionMap.find(name);
+    return it == _expressionMap.end() ? nullptr : it->second;
+}
+
+/**
+ * Check if cached values can be used: no input variable was written since they were computed
+ */
+bool Expressions::_isValid(EXPRESSION_SLOT *slot)
+{
+    if (slot->isContextual || (slot->isVolatile && slot->cycle != _cycle))
+        return false;
+
+    unsigned long version = _store->getVersion();
+    if (slot->version == version)
+        return true;
+
+    // variables were created since inputs were resolved, input name can point to a new one
+
+    size_t count = _store->getVarCount();
+    if (slot->resolvedAt != count)
+    {
+        slot->resolvedAt = count;
+        for (size_t i = 0; i < slot->inputNames.size(); i++)
+            slot->inputs[i] = _store->getSlot(slot->inputNames[i]);
+    }
+
+    for (size_t i = 0; i < slot->inputs.size(); i++)
+    {
+        if (slot->inputs[i] != nullptr && _store->getVersion(slot->inputs[i]) > slot->version)
+            return false;
+    }
+
+    slot->version = version;
+    return true;
+}
+
+void Expressions::_invalidate(EXPRESSION_SLOT *slot)
+{
+    slot->mathValid = false;
+    slot->conditionValid = false;
+    slot->resolvedAt = (size_t)-1;
+    slot->inputs.assign(slot->inputNames.size(), nullptr);
+}
+
+/**
+ * Every string in expression can be a variable name, nested expressions add their inputs
+ */
+void Expressions::_collectInputs(EXPRESSION_SLOT *slot, JsonVariant node, int depth)
+{
+    if (depth > EXPRESSION_MAX_DEPTH)
+    {
+        slot->isVolatile = true;
+        return;
+    }
+
+    if (node.is<const char *>())
+    {
+        const char *name = node.as<const char *>();
+        if (Infix::isInfix(name))
+            _collectInputs(slot, _compute->infix.compile(name), depth);
+        else if (Store::isPattern(name))
+            slot->isVolatile = true; // set of matching variables can grow
+        else if (name[0])
+            slot->inputNames.push_back(name);
+    }
+    else if (node.is<JsonArray>())
+    {
+        for (JsonVariant item : node.as<JsonArray>())
+            _collectInputs(slot, item, depth);
+    }
+    else if (node.is<JsonObject>())
+    {
+        for (JsonPair item : node.as<JsonObject>())
+        {
+            const char *op = item.key().c_str();
+
+            if (strcmp(op, "$") == 0 && item.value().is<const char *>())
+            {
+                EXPRESSION_SLOT *nested = _find(item.value().as<const char *>());
+                if (nested != nullptr)
+                    _collectInputs(slot, nested->definition, depth + 1);
+                continue;
+            }
+
+            if (!_isPure(op))
+                slot->isVolatile = true;
+            if (strcasecmp(op, "in_state") == 0)
+                slot->isContextual = true;
+
+            _collectInputs(slot, item.value(), depth);
+        }
+    }
+}
+
+/**
+ * @return true if result of operation depends on its operands only,
+ * "lut" is not: table entries are expressions with inputs of their own
+ */
+bool Expressions::_isPure(const char *op)
+{
+    static const char *pure[] = {
+        "sqrt", "exp", "ln", "log", "abs", "neg", "sub", "div", "pow", "sum", "mul", "min", "max", "avg", "count",
+        "?", "interp", "not", "and", "or", "gt", "gte", "lt", "lte", "eq", "ne"};
+
+    for (size_t i = 0; i < sizeof(pure) / sizeof(pure[0]); i++)
+        if (strcasecmp(op, pure[i]) == 0)
+            return true;
+
+    return false;
+}
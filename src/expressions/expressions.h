@@ -0,0 +1,67 @@
+#ifndef expressions_h
+#define expressions_h
+
+#include <map>
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#include "../keycompare/keycompare.h"
+#include "../store/store.h"
+#include "../store/varStruct.h"
+
+class Compute; // forward ref
+
+#define EXPRESSION_MAX_DEPTH 8 // nesting of expressions referring to other expressions
+
+typedef struct expression_slot
+{
+    JsonVariant definition;
+    std::vector<const char *> inputNames; // variables expression depends on
+    std::vector<VarSlot *> inputs;        // resolved inputNames, nullptr if variable does not exist
+    size_t resolvedAt;                    // store variable count when inputs were resolved
+    bool isVolatile;                      // depends on time or state (timers, filters, functions)
+    bool isContextual;                    // depends on machine being evaluated ("in_state"), never cached
+
+    VarStruct mathValue;
+    bool conditionValue;
+    bool mathValid;
+    bool conditionValid;
+    unsigned long version; // store version when cached values were verified
+    unsigned long cycle;   // cycle of cached values
+    bool evaluating;       // recursion guard
+} EXPRESSION_SLOT;
+
+/*
+ * Named expressions, referenced from conditions or math as {"$": "name"}.
+ * Results are cached and reused until one of input variables is written.
+ * Expressions using time or stateful operations are cached within a cycle only.
+ */
+class Expressions
+{
+public:
+    Expressions(Compute *, Store *);
+    ~Expressions();
+
+    void load(JsonVariant);
+    void clear();
+    void nextCycle();
+
+    VarStruct evalMath(const char *);
+    bool evalCondition(const char *);
+
+    std::map<const char *, EXPRESSION_SLOT *, KeyCompare> _expressionMap;
+
+private:
+    Compute *_compute;
+    Store *_store;
+    unsigned long _cycle;
+
+    EXPRESSION_SLOT *_find(const char *);
+    bool _isValid(EXPRESSION_SLOT *);
+    void _invalidate(EXPRESSION_SLOT *);
+    void _collectInputs(EXPRESSION_SLOT *, JsonVariant, int);
+    static bool _isPure(const char *);
+};
+
+#endif
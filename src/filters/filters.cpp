@@ -0,0 +1,200 @@
+#include <map>
+
+#include "../keycompare/keycompare.h"
+#include "../keycreate/keycreate.h"
+#include "filters.h"
+
+Filters::Filters(Timers *timers) : _filterMap()
+{
+    _timers = timers;
+}
+
+/**
+ * Exponential moving average: value += alpha * (input - value)
+ * @param filterName unique filter name
+ * @param input current sample
+ * @param alpha smoothing factor in (0..1], 1 means no smoothing
+ * @return filtered value
+ */
+VarStruct Filters::ema(const char *filterName, const VarStruct &input, float alpha)
+{
+    bool created;
+    FILTER_SLOT *slot = _getSlot(filterName, &created);
+
+    // NaN samples are ignored, they would poison the average forever
+    if (input.type == VAR_TYPE_NAN)
+        return created ? input : slot->value;
+
+    if (created || slot->value.type == VAR_TYPE_NAN)
+    {
+        slot->value = VarStruct(input.vFloat);
+        return slot->value;
+    }
+
+    if (alpha > 1.0f)
+        alpha = 1.0f;
+    if (alpha < 0.0f)
+        alpha = 0.0f;
+
+    slot->value = VarStruct(slot->value.vFloat + alpha * (input.vFloat - slot->value.vFloat));
+    return slot->value;
+}
+
+/**
+ * First order low-pass filter, alpha is derived from time passed since last sample,
+ * so result does not depend on cycle period
+ * @param filterName unique filter name
+ * @param input current sample
+ * @param timeConstant filter time constant in ms (ticks)
+ * @return filtered value
+ */
+VarStruct Filters::lowpass(const char *filterName, const VarStruct &input, unsigned long timeConstant)
+{
+    bool created;
+    FILTER_SLOT *slot = _getSlot(filterName, &created);
+    unsigned long now = _timers ? _timers->getTime() : 0;
+
+    if (input.type == VAR_TYPE_NAN)
+        return created ? input : slot->value;
+
+    if (created || slot->value.type == VAR_TYPE_NAN)
+    {
+        slot->value = VarStruct(input.vFloat);
+        slot->time = now;
+        return slot->value;
+    }
+
+    unsigned long dt = _timers ? _timers->diff(slot->time, now) : 0;
+    slot->time = now;
+
+    float alpha = timeConstant + dt > 0 ? (float)dt / (float)(timeConstant + dt) : 1.0f;
+    slot->value = VarStruct(slot->value.vFloat + alpha * (input.vFloat - slot->value.vFloat));
+    return slot->value;
+}
+
+/**
+ * Debounce boolean input: output follows input only after input
+ * has been different from output for at least timeout ms
+ * @param filterName unique filter name
+ * @param input current input state
+ * @param timeout milliseconds input should be stable
+ * @return debounced state
+ */
+bool Filters::debounce(const char *filterName, bool input, unsigned long timeout)
+{
+    bool created;
+    FILTER_SLOT *slot = _getSlot(filterName, &created);
+
+    if (created)
+    {
+        slot->state = input;
+        return input;
+    }
+
+    if (input == slot->state)
+    {
+        slot->pending = false;
+        return slot->state;
+    }
+
+    if (!slot->pending)
+    {
+        slot->pending = true;
+        slot->time = _timers ? _timers->getTime() : 0;
+    }
+
+    if (!_timers || _timers->elapsed(slot->time) >= timeout)
+    {
+        slot->state = input;
+        slot->pending = false;
+    }
+
+    return slot->state;
+}
+
+/**
+ * Comparator with hysteresis: turns on when value > on, turns off when value < off
+ * @param filterName unique filter name
+ * @param value compared value
+ * @param on threshold for switching on
+ * @param off threshold for switching off
+ * @return current comparator state
+ */
+bool Filters::hysteresis(const char *filterName, const VarStruct &value, const VarStruct &on, const VarStruct &off)
+{
+    bool created;
+    FILTER_SLOT *slot = _getSlot(filterName, &created);
+    VarStruct val = value;
+
+    if (slot->state)
+    {
+        if (val < off)
+            slot->state = false;
+    }
+    else
+    {
+        if (val > on)
+            slot->state = true;
+    }
+
+    return slot->state;
+}
+
+void Filters::reset()
+{
+    for (std::map<const char *, FILTER_SLOT, KeyCompare>::iterator it = _filterMap.begin(); it != _filterMap.end(); ++it)
+        delete[] it->first;
+    _filterMap.clear();
+}
+
+void Filters::writeSnapshot(BinaryWriter *writer)
+{
+    writer->writeVarUInt(_filterMap.size());
+    for (std::map<const char *, FILTER_SLOT, KeyCompare>::iterator it = _filterMap.begin(); it != _filterMap.end(); ++it)
+    {
+        writer->writeString(it->first);
+        writer->writeVar(it->second.value);
+        writer->writeByte(it->second.state | (it->second.pending << 1));
+        writer->writeVarUInt(_timers ? _timers->elapsed(it->second.time) : 0);
+    }
+}
+
+bool Filters::readSnapshot(BinaryReader *reader)
+{
+    char name[MAX_BINARY_STRING_LEN];
+    KeyCreate keyCreator;
+    unsigned long count = reader->readVarUInt();
+    unsigned long now = _timers ? _timers->getTime() : 0;
+
+    for (unsigned long i = 0; i < count && !reader->failed(); i++)
+    {
+        if (!reader->readString(name, MAX_BINARY_STRING_LEN))
+            return false;
+        VarStruct value = reader->readVar();
+        uint8_t flags = reader->readByte();
+        unsigned long elapsedTime = reader->readVarUInt();
+        if (reader->failed())
+            return false;
+
+        FILTER_SLOT slot = {value, (bool)(flags & 1), now - elapsedTime, (bool)(flags & 2)};
+        if (_filterMap.count(name))
+            _filterMap[name] = slot;
+        else
+            _filterMap[keyCreator.createKey(name)] = slot;
+    }
+
+    return !reader->failed();
+}
+
+FILTER_SLOT *Filters::_getSlot(const char *filterName, bool *created)
+{
+    std::map<const char *, FILTER_SLOT, KeyCompare>::iterator it = _filterMap.find(filterName);
+    *created = it == _filterMap.end();
+    if (*created)
+    {
+        // name can point into definition or compiled expression, which may not live as long as filter
+        KeyCreate keyCreator;
+        it = _filterMap.insert(std::make_pair(keyCreator.createKey(filterName), FILTER_SLOT{VarStruct::NaN(), false, 0, false})).first;
+    }
+    return &it->second;
+}
@@ -0,0 +1,40 @@
+#ifndef smfilters_h
+#define smfilters_h
+
+#include <map>
+#include "../keycompare/keycompare.h"
+#include "../timers/timers.h"
+#include "../store/varStruct.h"
+#include "../binary/binary.h"
+
+typedef struct filter_slot
+{
+    VarStruct value;           // filtered output (ema, lowpass)
+    bool state;                // filtered output (debounce, hysteresis)
+    unsigned long time;        // time of last update (lowpass) or of first differing input (debounce)
+    bool pending;              // debounce input differs from output and is waiting for timeout
+} FILTER_SLOT;
+
+class Filters
+{
+public:
+    Filters(Timers *);
+
+    VarStruct ema(const char *, const VarStruct &, float);
+    VarStruct lowpass(const char *, const VarStruct &, unsigned long);
+    bool debounce(const char *, bool, unsigned long);
+    bool hysteresis(const char *, const VarStruct &, const VarStruct &, const VarStruct &);
+
+    void reset();
+
+    void writeSnapshot(BinaryWriter *);
+    bool readSnapshot(BinaryReader *);
+
+    std::map<const char *, FILTER_SLOT, KeyCompare> _filterMap;
+
+private:
+    Timers *_timers;
+    FILTER_SLOT *_getSlot(const char *, bool *);
+};
+
+#endif
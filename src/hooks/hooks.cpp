@@ -1,5 +1,14 @@
 #include "hooks.h"
-#include <Arduino.h>
 
 void Hooks::onVarUpdate(const char *name, VarStruct *value) {}
+
+/**
+ * Bulk writes and per-cycle change sets are delivered here, by default as single updates
+ */
+void Hooks::onVarsUpdate(const VAR_CHANGE *changes, size_t count, unsigned long cycleNum)
+{
+    for (size_t i = 0; i < count; i++)
+        onVarUpdate(changes[i].name, changes[i].value);
+}
+
 void Hooks::afterCycle(unsigned long cycleNum) {}
\ No newline at end of file
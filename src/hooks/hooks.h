@@ -1,12 +1,27 @@
 #ifndef hooks_h
 #define hooks_h
 
+#include <stddef.h>
 #include "../store/varStruct.h"
 
+/*
+ * Single entry of per-cycle change set, multiple writes to the same variable
+ * within a cycle are coalesced into one entry
+ */
+typedef struct var_change
+{
+    const char *name;   // full (scoped) variable name
+    VarStruct *value;   // current value
+    VarStruct previous; // value before the first write in this cycle
+    bool created;       // variable did not exist before this cycle
+    bool removed;       // global variable is missing from refreshed global memory
+} VAR_CHANGE;
+
 class Hooks
 {
 public:
     virtual void onVarUpdate(const char *, VarStruct *);
+    virtual void onVarsUpdate(const VAR_CHANGE *, size_t, unsigned long);
     virtual void afterCycle(unsigned long);
 };
 
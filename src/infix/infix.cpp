@@ -0,0 +1,589 @@
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "infix.h"
+#include "../StateMachineDebug.h"
+
+Infix::Infix()
+    : _compiled()
+{
+    _text = _p = _error = nullptr;
+    _errorAt = 0;
+    _depth = 0;
+}
+
+Infix::~Infix()
+{
+    clear();
+}
+
+/**
+ * Operator characters resolved to a lookup table once, so operands are scanned
+ * at the same cost whatever the number of operator characters is
+ */
+static const bool *operatorTable()
+{
+    static bool table[256] = {false};
+    static bool ready = false;
+
+    if (!ready)
+    {
+        for (const char *op = INFIX_OPERATORS; *op; op++)
+            table[(unsigned char)*op] = true;
+        ready = true;
+    }
+    return table;
+}
+
+/**
+ * @return true if string is an expression, variable names have no spaces nor operators
+ */
+bool Infix::isInfix(const char *text)
+{
+    if (text[0] == '-')
+        return true; // unary minus, names do not start with "-"
+
+    const bool *table = operatorTable();
+    for (const char *c = text; *c; c++)
+    {
+        if (table[(unsigned char)*c])
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Compile expressions found in condition or math, so they are not parsed on first evaluation.
+ * Strings have to live as long as compiled expressions do (until clear).
+ */
+void Infix::prepare(JsonVariant node)
+{
+    if (node.is<const char *>())
+    {
+        const char *text = node.as<const char *>();
+        if (isInfix(text) && !_compiled.count(text))
+            _compile(text);
+    }
+    else if (node.is<JsonArray>())
+    {
+        for (JsonVariant item : node.as<JsonArray>())
+            prepare(item);
+    }
+    else if (node.is<JsonObject>())
+    {
+        for (JsonPair item : node.as<JsonObject>())
+        {
+            // names of timers, filters, tables, variables and expressions are not expressions
+
+            int names = nameOperands(item.key().c_str());
+            if (names == 0)
+            {
+                prepare(item.value());
+            }
+            else if (names == 1 && item.value().is<JsonArray>())
+            {
+                size_t index = 0;
+                for (JsonVariant operand : item.value().as<JsonArray>())
+                    if (index++ > 0)
+                        prepare(operand);
+            }
+        }
+    }
+}
+
+void Infix::clear()
+{
+    for (std::map<const char *, JsonDocument *, KeyCompare>::iterator it = _compiled.begin(); it != _compiled.end(); ++it)
+        delete it->second;
+    _compiled.clear();
+
+    for (size_t i = 0; i < _keys.size(); i++)
+        delete[] _keys[i];
+    _keys.clear();
+
+    errors.clear();
+}
+
+/**
+ * Compiled form of expression, parsed on first use
+ * @return compiled expression, null if expression has errors (see errors)
+ */
+JsonVariant Infix::compile(const char *text)
+{
+    std::map<const char *, JsonDocument *, KeyCompare>::iterator it = _compiled.find(text);
+    if (it != _compiled.end())
+        return it->second == nullptr ? JsonVariant() : it->second->as<JsonArray>().getElement(0);
+
+    // string may not live as long as compiled expression, keep a copy
+
+    char *key = new char[strlen(text) + 1];
+    strcpy(key, text);
+    _keys.push_back(key);
+
+    return _compile(key);
+}
+
+/**
+ * @return compiled expression, null if it was not compiled (yet)
+ */
+JsonVariant Infix::find(const char *text)
+{
+    std::map<const char *, JsonDocument *, KeyCompare>::iterator it = _compiled.find(text);
+    return it == _compiled.end() || it->second == nullptr ? JsonVariant() : it->second->as<JsonArray>().getElement(0);
+}
+
+/**
+ * @return compiled expression if node is an expression string, node otherwise
+ */
+JsonVariant Infix::resolve(JsonVariant node)
+{
+    return node.is<const char *>() && isInfix(node.as<const char *>()) ? compile(node.as<const char *>()) : node;
+}
+
+JsonVariant Infix::_compile(const char *text)
+{
+    _nodes.clear();
+    _text = _p = text;
+    _error = nullptr;
+    _errorAt = 0;
+    _depth = 0;
+
+    int root = _parseTernary();
+    _match("");
+    if (root >= 0 && *_p)
+        root = _fail("unexpected character");
+
+    if (root < 0)
+    {
+        INFIX_ERROR error = {text, _errorAt, _error};
+        errors.push_back(error);
+        _compiled[text] = nullptr;
+        _nodes.clear();
+        SM_DEBUG("Expression [" << text << "] error at " << _errorAt << ": " << _error << "\n");
+        return JsonVariant();
+    }
+
+    // a slot per value and per operation key, strings are copied
+
+    DynamicJsonDocument *doc = new DynamicJsonDocument(JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(2 * _nodes.size()) + strlen(text) + _nodes.size());
+    JsonArray compiled = doc->to<JsonArray>();
+    _emit(root, compiled);
+    doc->shrinkToFit();
+
+    _compiled[text] = doc;
+    _nodes.clear();
+    return doc->as<JsonArray>().getElement(0);
+}
+
+/**
+ * @return 1 if first operand of operation is a name, 2 if all are, 0 if none
+ */
+int Infix::nameOperands(const char *op)
+{
+    const char *first[] = {"elapsed", "debounce", "hysteresis", "ema", "lowpass", "lut", "switch", "interp"};
+    const char *all[] = {"changed", "rising", "falling", "$"};
+
+    for (size_t i = 0; i < sizeof(first) / sizeof(first[0]); i++)
+        if (strcasecmp(op, first[i]) == 0)
+            return 1;
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        if (strcasecmp(op, all[i]) == 0)
+            return 2;
+    return 0;
+}
+
+// condition ? value : value
+
+int Infix::_parseTernary()
+{
+    int condition = _parseOr();
+    if (condition < 0 || !_match("?"))
+        return condition;
+
+    int then = _parseTernary();
+    if (then < 0)
+        return then;
+    if (!_match(":"))
+        return _fail("expected ':'");
+    int otherwise = _parseTernary();
+    if (otherwise < 0)
+        return otherwise;
+
+    int node = _operation("?", condition, then);
+    _nodes[node].args.push_back(otherwise);
+    return node;
+}
+
+int Infix::_parseOr()
+{
+    int left = _parseAnd();
+    int node = -1;
+
+    while (left >= 0 && _match("||"))
+    {
+        int right = _parseAnd();
+        if (right < 0)
+            return right;
+        if (node < 0)
+            left = node = _operation("or", left, right);
+        else
+            _nodes[node].args.push_back(right);
+    }
+    return left;
+}
+
+int Infix::_parseAnd()
+{
+    int left = _parseCompare();
+    int node = -1;
+
+    while (left >= 0 && _match("&&"))
+    {
+        int right = _parseCompare();
+        if (right < 0)
+            return right;
+        if (node < 0)
+            left = node = _operation("and", left, right);
+        else
+            _nodes[node].args.push_back(right);
+    }
+    return left;
+}
+
+int Infix::_parseCompare()
+{
+    const char *tokens[] = {">=", "<=", "==", "!=", ">", "<"};
+    const char *ops[] = {"gte", "lte", "eq", "ne", "gt", "lt"};
+
+    int left = _parseSum();
+    if (left < 0)
+        return left;
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (!_match(tokens[i]))
+            continue;
+
+        int right = _parseSum();
+        return right < 0 ? right : _operation(ops[i], left, right);
+    }
+    return left;
+}
+
+int Infix::_parseSum()
+{
+    int left = _parseProduct();
+    int sum = -1;
+
+    while (left >= 0)
+    {
+        bool add = _match("+");
+        if (!add && !_match("-"))
+            break;
+
+        int right = _parseProduct();
+        if (right < 0)
+            return right;
+
+        if (add && left == sum)
+            _nodes[sum].args.push_back(right);
+        else if (add)
+            left = sum = _operation("sum", left, right);
+        else
+            left = _operation("sub", left, right);
+    }
+    return left;
+}
+
+int Infix::_parseProduct()
+{
+    int left = _parseUnary();
+    int product = -1;
+
+    while (left >= 0)
+    {
+        bool multiply = _match("*");
+        if (!multiply && !_match("/"))
+            break;
+
+        int right = _parseUnary();
+        if (right < 0)
+            return right;
+
+        if (multiply && left == product)
+            _nodes[product].args.push_back(right);
+        else if (multiply)
+            left = product = _operation("mul", left, right);
+        else
+            left = _operation("div", left, right);
+    }
+    return left;
+}
+
+int Infix::_parseUnary()
+{
+    if (++_depth > INFIX_MAX_DEPTH)
+        return _fail("expression is nested too deep");
+
+    int node;
+    _match("");
+
+    if (_p[0] == '!' && _p[1] != '=')
+    {
+        _p++;
+        int operand = _parseUnary();
+        node = operand < 0 ? operand : _operation("not", operand, -1);
+    }
+    else if (_p[0] == '-' && !isdigit(_p[1]) && _p[1] != '.')
+    {
+        _p++;
+        int operand = _parseUnary();
+        node = operand < 0 ? operand : _operation("neg", operand, -1);
+    }
+    else
+    {
+        node = _parsePower();
+    }
+
+    _depth--;
+    return node;
+}
+
+int Infix::_parsePower()
+{
+    int base = _parsePrimary();
+    if (base < 0 || !_match("^"))
+        return base;
+
+    int exponent = _parseUnary();
+    return exponent < 0 ? exponent : _operation("pow", base, exponent);
+}
+
+int Infix::_parsePrimary()
+{
+    _match("");
+    const char *start = _p;
+
+    // parentheses
+
+    if (*_p == '(')
+    {
+        _p++;
+        int node = _parseTernary();
+        if (node >= 0 && !_match(")"))
+            return _fail("expected ')'");
+        return node;
+    }
+
+    // quoted string, ex. timer name in elapsed('door-timer', 500)
+
+    if (*_p == '\'')
+    {
+        const char *end = strchr(++_p, '\'');
+        if (end == nullptr)
+            return _fail("unterminated string");
+
+        int node = _node(INFIX_NAME, nullptr);
+        _nodes[node].text = _p;
+        _nodes[node].length = end - _p;
+        _p = end + 1;
+        return node;
+    }
+
+    // number, sign is part of literal
+
+    if (isdigit(*_p) || *_p == '.' || *_p == '-')
+    {
+        char *integerEnd, *realEnd;
+        long int value = strtol(_p, &integerEnd, 10);
+        float real = strtod(_p, &realEnd);
+
+        if (realEnd == _p)
+            return _fail("invalid number");
+
+        int node = _node(realEnd > integerEnd ? INFIX_FLOAT : INFIX_INT, nullptr);
+        _nodes[node].vInt = value;
+        _nodes[node].vFloat = real;
+        _p = realEnd;
+        return node;
+    }
+
+    // named expression, ex. $heat-demand
+
+    bool expression = *_p == '$';
+    if (expression)
+        _p++;
+
+    if (!isalpha(*_p) && *_p != '_')
+        return _fail(*_p ? "unexpected character" : "unexpected end of expression");
+
+    while (_isNameChar(*_p))
+        _p++;
+
+    int name = _node(INFIX_NAME, nullptr);
+    _nodes[name].text = expression ? start + 1 : start;
+    _nodes[name].length = _p - _nodes[name].text;
+
+    if (expression)
+        return _operation("$", name, -1);
+
+    if (_p - start == 4 && strncasecmp(start, "true", 4) == 0)
+        _nodes[name].type = INFIX_BOOL, _nodes[name].vInt = 1;
+    if (_p - start == 5 && strncasecmp(start, "false", 5) == 0)
+        _nodes[name].type = INFIX_BOOL, _nodes[name].vInt = 0;
+
+    if (_nodes[name].type != INFIX_NAME || !_match("("))
+        return name;
+
+    // function call, ex. max(a, b), name node becomes call node
+
+    INFIX_NODE *call = &_nodes[name];
+    call->type = INFIX_OPERATION;
+    if (call->length == 8 && strncasecmp(call->text, "in_state", 8) == 0)
+        call->op = "in_state";
+
+    if (_match(")"))
+        return name;
+
+    do
+    {
+        int arg = _parseTernary();
+        if (arg < 0)
+            return arg;
+        _nodes[name].args.push_back(arg);
+    } while (_match(","));
+
+    if (!_match(")"))
+        return _fail("expected ',' or ')'");
+
+    // functions get parameters as array, except of "in_state" condition
+
+    _nodes[name].scalar = _nodes[name].op != nullptr && _nodes[name].args.size() == 1;
+    return name;
+}
+
+int Infix::_node(int type, const char *op)
+{
+    INFIX_NODE node = {type, op, _p, 0, 0, 0.0f, false, std::vector<int>()};
+    _nodes.push_back(node);
+    return _nodes.size() - 1;
+}
+
+/**
+ * Create operation node with two operands, or with single operand stored as value (right is -1)
+ */
+int Infix::_operation(const char *op, int left, int right)
+{
+    int node = _node(INFIX_OPERATION, op);
+    _nodes[node].args.push_back(left);
+    if (right >= 0)
+        _nodes[node].args.push_back(right);
+    else
+        _nodes[node].scalar = true;
+    return node;
+}
+
+int Infix::_fail(const char *message)
+{
+    if (_error == nullptr)
+    {
+        _error = message;
+        _errorAt = _p - _text;
+    }
+    return -1;
+}
+
+/**
+ * Skip spaces and consume token if it follows
+ */
+bool Infix::_match(const char *token)
+{
+    while (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n')
+        _p++;
+
+    size_t length = strlen(token);
+    if (strncmp(_p, token, length) != 0)
+        return false;
+
+    _p += length;
+    return true;
+}
+
+bool Infix::_isNameChar(char c)
+{
+    return isalnum(c) || c == '_' || c == '-' || c == '.';
+}
+
+void Infix::_emit(int index, JsonArray parent)
+{
+    INFIX_NODE *node = &_nodes[index];
+
+    switch (node->type)
+    {
+    case INFIX_INT:
+        parent.add(node->vInt);
+        break;
+    case INFIX_FLOAT:
+        parent.add(node->vFloat);
+        break;
+    case INFIX_BOOL:
+        parent.add((bool)node->vInt);
+        break;
+    case INFIX_NAME:
+    {
+        // non const string is copied to document
+        char name[node->length + 1];
+        strncpy(name, node->text, node->length);
+        name[node->length] = 0;
+        parent.add((char *)name);
+        break;
+    }
+    default:
+        _emitOperation(index, parent.createNestedObject());
+    }
+}
+
+void Infix::_emitOperation(int index, JsonObject object)
+{
+    INFIX_NODE *node = &_nodes[index];
+
+    // operations with single operand are stored as value, ex. {"not": "door"}
+
+    if (node->scalar)
+    {
+        INFIX_NODE *operand = &_nodes[node->args[0]];
+        char name[operand->length + 1];
+
+        switch (operand->type)
+        {
+        case INFIX_INT:
+            object[node->op] = operand->vInt;
+            break;
+        case INFIX_FLOAT:
+            object[node->op] = operand->vFloat;
+            break;
+        case INFIX_BOOL:
+            object[node->op] = (bool)operand->vInt;
+            break;
+        case INFIX_NAME:
+            strncpy(name, operand->text, operand->length);
+            name[operand->length] = 0;
+            object[node->op] = (char *)name;
+            break;
+        default:
+            _emitOperation(node->args[0], object.createNestedObject(node->op));
+        }
+        return;
+    }
+
+    // function names are copied, operations are constants
+
+    char function[node->length + 1];
+    strncpy(function, node->text, node->length);
+    function[node->length] = 0;
+
+    JsonArray operands = node->op != nullptr ? object.createNestedArray(node->op) : object.createNestedArray((char *)function);
+    for (size_t i = 0; i < node->args.size(); i++)
+        _emit(node->args[i], operands);
+}
@@ -0,0 +1,100 @@
+#ifndef infix_h
+#define infix_h
+
+#include <map>
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#include "../keycompare/keycompare.h"
+
+#define INFIX_MAX_DEPTH 16            // nesting of parentheses, function calls and unary operators
+#define INFIX_OPERATORS " ()<>=!&|+^'$/:" // string with any of these (or leading "-") is an expression, not a variable name
+
+#define INFIX_INT 0
+#define INFIX_FLOAT 1
+#define INFIX_BOOL 2
+#define INFIX_NAME 3      // variable name or quoted string
+#define INFIX_OPERATION 4 // operation or function call
+
+typedef struct infix_node
+{
+    int type;
+    const char *op;     // JSON operation, nullptr for function call (name is in text)
+    const char *text;   // name, string or function name in source expression
+    size_t length;      // of text
+    long int vInt;      // INFIX_INT and INFIX_BOOL
+    float vFloat;       // INFIX_FLOAT
+    bool scalar;        // single operand stored without array, ex. {"in_state": 5000}
+    std::vector<int> args;
+} INFIX_NODE;
+
+typedef struct infix_error
+{
+    const char *text;    // expression
+    size_t position;     // offset of error in expression
+    const char *message;
+} INFIX_ERROR;
+
+/*
+ * Compact expression syntax, ex. "garage.humidity > 30 && fan-off-time > ctrl.fan-min-off",
+ * compiled to the JSON form: {"and": [{"gt": ["garage.humidity", 30]}, {"gt": ["fan-off-time", "ctrl.fan-min-off"]}]}
+ *
+ *   ?:  ||  &&  > >= < <= == !=  + -  * /  ^  ! -  (...)  f(a, b)  $name  'string'
+ *
+ * Variable names may contain "-" and ".", so binary minus needs spaces around it. "*" and "?" are
+ * name pattern characters, so "*" needs spaces around it too (analyzer reports such names outside of
+ * aggregates). Expressions are compiled once (at definition load) into documents of their own,
+ * definition is not modified.
+ */
+class Infix
+{
+public:
+    Infix();
+    ~Infix();
+
+    static bool isInfix(const char *);
+    static int nameOperands(const char *);
+
+    void prepare(JsonVariant);
+    void clear();
+    JsonVariant compile(const char *);
+    JsonVariant find(const char *);
+    JsonVariant resolve(JsonVariant);
+
+    std::vector<INFIX_ERROR> errors;
+
+private:
+    std::map<const char *, JsonDocument *, KeyCompare> _compiled; // nullptr for expressions with errors
+    std::vector<char *> _keys;                                     // copies of keys compiled on demand
+    std::vector<INFIX_NODE> _nodes;
+
+    const char *_text;
+    const char *_p;
+    const char *_error;
+    size_t _errorAt;
+    int _depth;
+
+    JsonVariant _compile(const char *);
+
+    int _parseTernary();
+    int _parseOr();
+    int _parseAnd();
+    int _parseCompare();
+    int _parseSum();
+    int _parseProduct();
+    int _parsePower();
+    int _parseUnary();
+    int _parsePrimary();
+
+    int _node(int, const char *);
+    int _operation(const char *, int, int);
+    int _fail(const char *);
+    bool _match(const char *);
+    static bool _isNameChar(char);
+
+    void _emit(int, JsonArray);
+    void _emitOperation(int, JsonObject);
+};
+
+#endif
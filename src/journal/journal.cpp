@@ -0,0 +1,303 @@
+#include <string.h>
+
+#include "journal.h"
+#include "../StateMachineDebug.h"
+
+Journal::Journal()
+{
+    _storage = nullptr;
+    _buffered = 0;
+    _logSize = 0;
+    _seq = 0;
+    _snapshotFile = JOURNAL_FILE_SNAPSHOT_B;
+    _compactionFile = JOURNAL_FILE_SNAPSHOT_A;
+    _needsCompaction = false;
+    _failed = false;
+    _rejected = false;
+    syncCount = 0;
+    rejected = 0;
+}
+
+void Journal::attach(JournalStorage *storage)
+{
+    _storage = storage;
+}
+
+bool Journal::isAttached()
+{
+    return _storage != nullptr;
+}
+
+/**
+ * Load latest valid snapshot and log records written after it
+ * @param callback called for every restored variable
+ * @return false if journal is not attached
+ */
+bool Journal::replay(JournalReplayFunction callback, void *context)
+{
+    if (!_storage)
+        return false;
+
+    // pick the newest complete snapshot
+
+    unsigned long seqA = 0, seqB = 0, snapshotSeq = 0;
+    bool validA = _scanSnapshot(JOURNAL_FILE_SNAPSHOT_A, &seqA, nullptr, nullptr);
+    bool validB = _scanSnapshot(JOURNAL_FILE_SNAPSHOT_B, &seqB, nullptr, nullptr);
+
+    if (validA && (!validB || seqA >= seqB))
+        _snapshotFile = JOURNAL_FILE_SNAPSHOT_A;
+    else
+        _snapshotFile = JOURNAL_FILE_SNAPSHOT_B;
+
+    if (validA || validB)
+        _scanSnapshot(_snapshotFile, &snapshotSeq, callback, context);
+
+    _seq = snapshotSeq;
+
+    // apply log records newer than snapshot
+
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    char name[MAX_BINARY_STRING_LEN];
+    size_t offset = 0, size;
+    bool torn = false;
+
+    while (_readRecord(JOURNAL_FILE_LOG, &offset, payload, &size, &torn))
+    {
+        BinaryReader reader(payload, size);
+        if (reader.readByte() != JOURNAL_RECORD_VAR)
+            continue;
+
+        unsigned long seq = reader.readVarUInt();
+        reader.readString(name, MAX_BINARY_STRING_LEN);
+        VarStruct value = reader.readVar();
+        if (reader.failed())
+            continue;
+
+        if (seq > snapshotSeq)
+            callback(context, name, value);
+        if (seq > _seq)
+            _seq = seq;
+    }
+
+    // records appended after a torn one would be lost on next replay,
+    // so start from a fresh snapshot and empty log
+
+    _logSize = offset;
+    _needsCompaction = torn;
+
+    SM_DEBUG("Journal replayed, seq: " << _seq << (torn ? ", log is damaged\n" : "\n"));
+
+    return true;
+}
+
+/**
+ * Queue variable value, it is written to storage on commit()
+ */
+void Journal::append(const char *name, const VarStruct &value)
+{
+    if (!_storage)
+        return;
+
+    _appendVar(JOURNAL_FILE_LOG, name, value);
+}
+
+/**
+ * Write queued records to log and make them durable with a single sync
+ * @return false if storage reported failure or a value was rejected since last commit
+ */
+bool Journal::commit()
+{
+    if (!_storage)
+        return false;
+
+    bool pending = _buffered > 0;
+    bool ok = _flush(JOURNAL_FILE_LOG);
+
+    if (pending || _failed)
+        ok = _sync(JOURNAL_FILE_LOG) && ok;
+
+    ok = ok && !_failed && !_rejected;
+    _failed = false;
+    _rejected = false;
+
+    if (_logSize > JOURNAL_COMPACT_SIZE)
+        _needsCompaction = true;
+
+    return ok;
+}
+
+bool Journal::needsCompaction()
+{
+    return _storage && _needsCompaction;
+}
+
+/**
+ * Start writing snapshot of all persistent variables into the inactive snapshot file
+ * @param count number of variables to follow (compactVar calls)
+ */
+void Journal::beginCompaction(unsigned long count)
+{
+    _flush(JOURNAL_FILE_LOG);
+
+    _compactionFile = _snapshotFile == JOURNAL_FILE_SNAPSHOT_A ? JOURNAL_FILE_SNAPSHOT_B : JOURNAL_FILE_SNAPSHOT_A;
+    _failed = !_storage->truncate(_compactionFile);
+
+    uint8_t payload[24];
+    BinaryWriter writer(payload, sizeof(payload));
+    writer.writeByte(JOURNAL_RECORD_SNAPSHOT);
+    writer.writeVarUInt(_seq);
+    writer.writeVarUInt(count);
+    _appendRecord(_compactionFile, payload, writer.size());
+}
+
+void Journal::compactVar(const char *name, const VarStruct &value)
+{
+    _appendVar(_compactionFile, name, value);
+}
+
+/**
+ * Make snapshot durable, then drop the log it replaces
+ */
+bool Journal::endCompaction()
+{
+    bool ok = _flush(_compactionFile) && _sync(_compactionFile) && !_failed;
+    _failed = false;
+
+    if (!ok)
+        return false;
+
+    _snapshotFile = _compactionFile;
+    _needsCompaction = false;
+    _logSize = 0;
+
+    return _storage->truncate(JOURNAL_FILE_LOG) && _sync(JOURNAL_FILE_LOG);
+}
+
+void Journal::_appendVar(uint8_t file, const char *name, const VarStruct &value)
+{
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    BinaryWriter writer(payload, sizeof(payload));
+
+    writer.writeByte(JOURNAL_RECORD_VAR);
+    writer.writeVarUInt(file == JOURNAL_FILE_LOG ? _seq + 1 : _seq);
+    writer.writeString(name);
+    writer.writeVar(value);
+
+    // name is too long, truncated name would restore another variable
+
+    if (writer.overflowed())
+    {
+        SM_DEBUG("Journal record of " << name << " is too long\n");
+        rejected++;
+        _rejected = true;
+        return;
+    }
+
+    if (file == JOURNAL_FILE_LOG)
+        _seq++;
+    _appendRecord(file, payload, writer.size());
+}
+
+void Journal::_appendRecord(uint8_t file, const uint8_t *payload, size_t size)
+{
+    if (_buffered + size + 3 > JOURNAL_BUFFER_SIZE)
+        _flush(file);
+
+    uint16_t crc = binaryCrc32(payload, size) & 0xffff;
+
+    _buffer[_buffered++] = size;
+    memcpy(_buffer + _buffered, payload, size);
+    _buffered += size;
+    _buffer[_buffered++] = crc & 0xff;
+    _buffer[_buffered++] = crc >> 8;
+}
+
+bool Journal::_flush(uint8_t file)
+{
+    if (!_buffered)
+        return true;
+
+    bool ok = _storage->append(file, _buffer, _buffered);
+    if (file == JOURNAL_FILE_LOG)
+        _logSize += _buffered;
+    _buffered = 0;
+
+    if (!ok)
+        _failed = true;
+
+    return ok;
+}
+
+bool Journal::_sync(uint8_t file)
+{
+    syncCount++;
+    return _storage->sync(file);
+}
+
+/**
+ * Read single record at offset and advance offset past it
+ * @param torn set to true if data at offset is not a valid record
+ * @return false at the end of file or on damaged record
+ */
+bool Journal::_readRecord(uint8_t file, size_t *offset, uint8_t *payload, size_t *size, bool *torn)
+{
+    uint8_t header, crc[2];
+
+    if (_storage->read(file, *offset, &header, 1) != 1)
+        return false;
+
+    if (_storage->read(file, *offset + 1, payload, header) != header ||
+        _storage->read(file, *offset + 1 + header, crc, 2) != 2 ||
+        (uint16_t)(binaryCrc32(payload, header) & 0xffff) != (uint16_t)(crc[0] | (crc[1] << 8)))
+    {
+        *torn = true;
+        return false;
+    }
+
+    *size = header;
+    *offset += header + 3;
+    return true;
+}
+
+/**
+ * Validate snapshot file, optionally replaying its variables
+ * @return true if snapshot is complete
+ */
+bool Journal::_scanSnapshot(uint8_t file, unsigned long *seq, JournalReplayFunction callback, void *context)
+{
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    char name[MAX_BINARY_STRING_LEN];
+    size_t offset = 0, size;
+    bool torn = false;
+
+    if (!_readRecord(file, &offset, payload, &size, &torn))
+        return false;
+
+    BinaryReader header(payload, size);
+    if (header.readByte() != JOURNAL_RECORD_SNAPSHOT)
+        return false;
+
+    *seq = header.readVarUInt();
+    unsigned long count = header.readVarUInt();
+    if (header.failed())
+        return false;
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (!_readRecord(file, &offset, payload, &size, &torn))
+            return false;
+
+        if (callback == nullptr)
+            continue;
+
+        BinaryReader reader(payload, size);
+        reader.readByte();
+        reader.readVarUInt();
+        reader.readString(name, MAX_BINARY_STRING_LEN);
+        VarStruct value = reader.readVar();
+        if (!reader.failed())
+            callback(context, name, value);
+    }
+
+    return true;
+}
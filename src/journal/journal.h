@@ -0,0 +1,82 @@
+#ifndef journal_h
+#define journal_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../store/varStruct.h"
+#include "../binary/binary.h"
+
+#define JOURNAL_FILE_LOG 0        // write-ahead log, records appended once per cycle
+#define JOURNAL_FILE_SNAPSHOT_A 1 // compacted log, written alternately with B,
+#define JOURNAL_FILE_SNAPSHOT_B 2 // so a crash during compaction never destroys last good snapshot
+
+#define JOURNAL_MAX_PAYLOAD 0xff                     // record length is stored in a single byte
+#define JOURNAL_BUFFER_SIZE (JOURNAL_MAX_PAYLOAD + 3) // records are collected in memory and written in one append
+#define JOURNAL_COMPACT_SIZE 4096 // compact log into snapshot when it grows above this size
+
+#define JOURNAL_RECORD_VAR 'V'      // variable value record
+#define JOURNAL_RECORD_SNAPSHOT 'S' // snapshot header record
+
+/*
+ * Persistent storage used by Journal. Implement it on top of a file system
+ * (POSIX files with fsync, LittleFS, SPIFFS) or raw flash/EEPROM pages.
+ * Storage provides three append-only files, identified by JOURNAL_FILE_* ids.
+ */
+class JournalStorage
+{
+public:
+    virtual size_t read(uint8_t file, size_t offset, uint8_t *buffer, size_t size) = 0;
+    virtual bool append(uint8_t file, const uint8_t *data, size_t size) = 0;
+    virtual bool sync(uint8_t file) = 0;     // make appended data durable (fsync)
+    virtual bool truncate(uint8_t file) = 0; // remove file content
+};
+
+typedef void (*JournalReplayFunction)(void *, const char *, const VarStruct &);
+
+/*
+ * Write-ahead log of variable values.
+ * Every record is framed as [payload length][payload][crc16] and carries a sequence number,
+ * so torn writes are detected on replay and records already compacted into snapshot are skipped.
+ */
+class Journal
+{
+public:
+    Journal();
+
+    void attach(JournalStorage *);
+    bool isAttached();
+    bool replay(JournalReplayFunction, void *);
+
+    void append(const char *, const VarStruct &);
+    bool commit();
+
+    bool needsCompaction();
+    void beginCompaction(unsigned long);
+    void compactVar(const char *, const VarStruct &);
+    bool endCompaction();
+
+    unsigned long syncCount; // number of sync calls, for diagnostics
+    unsigned long rejected;  // values not written, variable name does not fit into a record
+
+private:
+    JournalStorage *_storage;
+    uint8_t _buffer[JOURNAL_BUFFER_SIZE];
+    size_t _buffered;
+    size_t _logSize;
+    unsigned long _seq;
+    uint8_t _snapshotFile;
+    uint8_t _compactionFile;
+    bool _needsCompaction;
+    bool _failed;
+    bool _rejected; // value was rejected since last commit
+
+    void _appendRecord(uint8_t, const uint8_t *, size_t);
+    void _appendVar(uint8_t, const char *, const VarStruct &);
+    bool _flush(uint8_t);
+    bool _sync(uint8_t);
+    bool _readRecord(uint8_t, size_t *, uint8_t *, size_t *, bool *);
+    bool _scanSnapshot(uint8_t, unsigned long *, JournalReplayFunction, void *);
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include <string.h>
+
+#include "loader.h"
+
+/**
+ * FNV-1a of raw string bytes
+ */
+static uint32_t hashString(const char *str, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+DefinitionLoader::DefinitionLoader()
+{
+    _reset();
+}
+
+/**
+ * Measure capacity needed to parse JSON text, without parsing it
+ * @return required capacity, 0 if text is malformed
+ */
+size_t DefinitionLoader::measure(const char *json, size_t length)
+{
+    _reset();
+    stats.inputBytes = length;
+
+    char stack[LOADER_MAX_DEPTH]; // '{' or '[' of enclosing containers
+    int depth = 0;
+    bool expectKey = false;
+    const char *end = json + length;
+
+    for (const char *p = json; p < end; p++)
+    {
+        char c = *p;
+        bool inArray = depth > 0 && stack[depth - 1] == '[';
+
+        switch (c)
+        {
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+        case ':':
+            break;
+
+        case '{':
+        case '[':
+            if (depth >= LOADER_MAX_DEPTH)
+                return 0;
+            if (inArray)
+                stats.slots++;
+            stack[depth++] = c;
+            expectKey = c == '{';
+            break;
+
+        case '}':
+        case ']':
+            if (depth == 0 || stack[depth - 1] != (c == '}' ? '{' : '['))
+                return 0;
+            depth--;
+            expectKey = false;
+            break;
+
+        case ',':
+            expectKey = depth > 0 && stack[depth - 1] == '{';
+            break;
+
+        case '"':
+        {
+            // decoded length, escaped unicode takes up to 3 bytes in UTF-8
+
+            const char *start = ++p;
+            size_t decoded = 0;
+            for (; p < end && *p != '"'; p++, decoded++)
+            {
+                if (*p != '\\')
+                    continue;
+                if (++p < end && *p == 'u')
+                {
+                    p += 4;
+                    decoded += 2;
+                }
+            }
+            if (p >= end)
+                return 0;
+
+            if (expectKey || inArray)
+                stats.slots++;
+            expectKey = false;
+            _addString(start, p - start, decoded);
+            break;
+        }
+
+        default:
+            // number or literal
+
+            while (p + 1 < end && !strchr(" \t\r\n,]}", p[1]))
+                p++;
+            if (inArray)
+                stats.slots++;
+            break;
+        }
+    }
+
+    if (depth)
+        return 0;
+
+    return stats.capacity = _capacity();
+}
+
+/**
+ * Measure capacity needed to copy a JSON value to a new document
+ * @return required capacity
+ */
+size_t DefinitionLoader::measure(JsonVariant value)
+{
+    _reset();
+    _walk(value);
+    return stats.capacity = _capacity();
+}
+
+/**
+ * Parse definition into a document of measured capacity
+ * @param previousCapacity capacity used before, to report savings
+ * @return new document, nullptr on error (see error)
+ */
+DynamicJsonDocument *DefinitionLoader::load(const char *json, size_t length, size_t previousCapacity)
+{
+    if (!measure(json, length))
+    {
+        error = DeserializationError::InvalidInput;
+        return nullptr;
+    }
+
+    DynamicJsonDocument *doc = new DynamicJsonDocument(stats.capacity);
+    error = deserializeJson(*doc, json, length);
+    if (error)
+    {
+        delete doc;
+        return nullptr;
+    }
+
+    doc->shrinkToFit();
+    stats.saved = previousCapacity > doc->capacity() ? previousCapacity - doc->capacity() : 0;
+    return doc;
+}
+
+DynamicJsonDocument *DefinitionLoader::load(const char *json, size_t previousCapacity)
+{
+    return load(json, json ? strlen(json) : 0, previousCapacity);
+}
+
+/**
+ * Copy definition from (over-sized) document to a document of measured capacity.
+ * Source document can be released afterwards.
+ * @return new document, nullptr on error
+ */
+DynamicJsonDocument *DefinitionLoader::compact(JsonDocument *source)
+{
+    measure(source->as<JsonVariant>());
+
+    DynamicJsonDocument *doc = new DynamicJsonDocument(stats.capacity);
+    if (!doc->set(source->as<JsonVariant>()) || doc->overflowed())
+    {
+        error = DeserializationError::NoMemory;
+        delete doc;
+        return nullptr;
+    }
+
+    error = DeserializationError::Ok;
+    doc->shrinkToFit();
+    stats.saved = source->capacity() > doc->capacity() ? source->capacity() - doc->capacity() : 0;
+    return doc;
+}
+
+void DefinitionLoader::_reset()
+{
+    stats = LOADER_STATS();
+    error = DeserializationError::Ok;
+    _strings.clear();
+    _lengths.clear();
+    _hashes.clear();
+    _buckets.clear();
+}
+
+/**
+ * Count string, duplicates are compared by their raw (encoded) form and found by hash
+ */
+void DefinitionLoader::_addString(const char *raw, size_t length, size_t decoded)
+{
+    stats.strings++;
+    stats.stringBytes += decoded + 1;
+    if (decoded + 1 > stats.longestString)
+        stats.longestString = decoded + 1;
+
+    // keep table at most half full, so probe sequences stay short
+
+    if ((_strings.size() + 1) * 2 > _buckets.size())
+        _rehash(_buckets.empty() ? LOADER_MIN_BUCKETS : _buckets.size() * 2);
+
+    uint32_t hash = hashString(raw, length);
+    size_t mask = _buckets.size() - 1;
+    size_t bucket = hash & mask;
+
+    for (; _buckets[bucket] != 0; bucket = (bucket + 1) & mask)
+    {
+        size_t i = _buckets[bucket] - 1;
+        if (_hashes[i] == hash && _lengths[i] == length && memcmp(_strings[i], raw, length) == 0)
+            return;
+    }
+
+    _buckets[bucket] = _strings.size() + 1;
+    _strings.push_back(raw);
+    _lengths.push_back(length);
+    _hashes.push_back(hash);
+    stats.uniqueStrings++;
+    stats.internedBytes += decoded + 1;
+}
+
+void DefinitionLoader::_rehash(size_t size)
+{
+    _buckets.assign(size, 0);
+
+    size_t mask = size - 1;
+    for (size_t i = 0; i < _hashes.size(); i++)
+    {
+        size_t bucket = _hashes[i] & mask;
+        while (_buckets[bucket] != 0)
+            bucket = (bucket + 1) & mask;
+        _buckets[bucket] = i + 1;
+    }
+}
+
+void DefinitionLoader::_walk(JsonVariant value)
+{
+    if (value.is<const char *>())
+    {
+        const char *str = value.as<const char *>();
+        _addString(str, strlen(str), strlen(str));
+    }
+    else if (value.is<JsonArray>())
+    {
+        for (JsonVariant item : value.as<JsonArray>())
+        {
+            stats.slots++;
+            _walk(item);
+        }
+    }
+    else if (value.is<JsonObject>())
+    {
+        for (JsonPair pair : value.as<JsonObject>())
+        {
+            const char *key = pair.key().c_str();
+            stats.slots++;
+            _addString(key, strlen(key), strlen(key));
+            _walk(pair.value());
+        }
+    }
+}
+
+size_t DefinitionLoader::_capacity()
+{
+    // object members and array elements take the same slot, JSON_OBJECT_SIZE(1) == JSON_ARRAY_SIZE(1),
+    // duplicate of the longest string needs room while it is parsed, document is shrunk afterwards
+    return JSON_OBJECT_SIZE(stats.slots) + stats.internedBytes + stats.longestString;
+}
@@ -0,0 +1,61 @@
+#ifndef loader_h
+#define loader_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#define LOADER_MAX_DEPTH 32    // maximum nesting of definition objects and arrays
+#define LOADER_MIN_BUCKETS 16  // initial size of string hash table, power of two
+
+typedef struct loader_stats
+{
+    size_t inputBytes;    // size of JSON text, 0 when compacting a document
+    size_t slots;         // object members and array elements
+    size_t strings;       // keys and string values
+    size_t uniqueStrings; // strings left after duplicates are merged
+    size_t stringBytes;   // bytes of all strings, including terminators
+    size_t internedBytes; // bytes of unique strings
+    size_t longestString; // bytes of the longest string, including terminator
+    size_t capacity;      // document capacity required by definition
+    size_t saved;         // bytes saved compared to the previous (hand-sized) capacity
+} LOADER_STATS;
+
+/*
+ * Loads definitions into documents of exactly the required capacity. Capacity is measured
+ * before parsing: a slot per object member or array element, plus strings which ArduinoJson
+ * stores once (string deduplication is on by default since ArduinoJson 6.15). Parser copies
+ * every string before it finds a duplicate, so there is room for the longest string on top.
+ * Returned documents are owned by the caller and must outlive the controller using them.
+ */
+class DefinitionLoader
+{
+public:
+    DefinitionLoader();
+
+    size_t measure(const char *, size_t);
+    size_t measure(JsonVariant);
+
+    DynamicJsonDocument *load(const char *, size_t, size_t);
+    DynamicJsonDocument *load(const char *, size_t previousCapacity = 0);
+    DynamicJsonDocument *compact(JsonDocument *);
+
+    LOADER_STATS stats;
+    DeserializationError error;
+
+private:
+    std::vector<const char *> _strings; // interned strings, pointers to input
+    std::vector<size_t> _lengths;
+    std::vector<uint32_t> _hashes;
+    std::vector<size_t> _buckets; // open addressing table, index into _strings + 1, 0 if empty
+
+    void _reset();
+    void _addString(const char *, size_t, size_t);
+    void _rehash(size_t);
+    void _walk(JsonVariant);
+    size_t _capacity();
+};
+
+#endif
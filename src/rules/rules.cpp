@@ -0,0 +1,340 @@
+#include <string.h>
+#include <algorithm>
+
+#include "rules.h"
+#include "../compute/compute.h"
+#include "../StateMachineDebug.h"
+
+#define NO_RULE ((size_t)-1)
+
+static bool compareThresholds(const RULE_THRESHOLD &a, const RULE_THRESHOLD &b)
+{
+    // integer groups are sorted by vInt, float values of integers keep the same order
+    if (a.value.type == VAR_TYPE_LONG && b.value.type == VAR_TYPE_LONG)
+        return a.value.vInt < b.value.vInt;
+    return a.value.vFloat < b.value.vFloat;
+}
+
+RuleTable::RuleTable()
+    : groups(), _group(nullptr), _groupIndex()
+{
+}
+
+RuleTable::~RuleTable()
+{
+    for (std::vector<RULE_GROUP *>::iterator it = groups.begin(); it != groups.end(); ++it)
+        delete *it;
+    delete _group;
+}
+
+/**
+ * Add condition of the next rule, rules has to be added in order starting with index 0.
+ * Pass null condition for rules which can't be part of a group (ex. invalid ones).
+ */
+void RuleTable::addRule(size_t index, JsonVariant condition, Compute *compute)
+{
+    const char *varName = nullptr;
+    VarStruct value;
+    int op = condition.isNull() ? -1 : _parseCondition(condition, compute, &varName, &value);
+    bool integer = value.type == VAR_TYPE_LONG;
+
+    // "eq" is indexed only for integers which are exact in float, so float variables compare the same way
+
+    if (op == RULE_EQ && (!integer || value.vInt >= RULE_EXACT_FLOAT || value.vInt <= -RULE_EXACT_FLOAT))
+        op = -1;
+
+    if (op < 0 || _group == nullptr || strcmp(varName, _group->varName) != 0 || integer != _group->integer)
+    {
+        _closeGroup();
+
+        if (op < 0)
+            return;
+
+        _group = new RULE_GROUP();
+        _group->first = index;
+        _group->varName = varName;
+        _group->integer = integer;
+        _group->jumpBase = 0;
+    }
+
+    RULE_THRESHOLD threshold = {value, index};
+    _group->thresholds[op].push_back(threshold);
+    _group->end = index + 1;
+}
+
+/**
+ * Finish compilation
+ * @return true if there is at least one group of rules
+ */
+bool RuleTable::finish()
+{
+    _closeGroup();
+
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        if (_groupIndex.size() < groups[i]->end)
+            _groupIndex.resize(groups[i]->end, -1);
+        _groupIndex[groups[i]->first] = i;
+    }
+
+    return !groups.empty();
+}
+
+/**
+ * @return group starting at rule index, nullptr if rule is evaluated on its own
+ */
+RULE_GROUP *RuleTable::groupAt(size_t index)
+{
+    if (index >= _groupIndex.size() || _groupIndex[index] < 0)
+        return nullptr;
+    return groups[_groupIndex[index]];
+}
+
+/**
+ * @return approximate heap size of compiled table in bytes
+ */
+size_t RuleTable::memoryUsage()
+{
+    size_t size = sizeof(RuleTable) + _groupIndex.capacity() * sizeof(int) + groups.capacity() * sizeof(RULE_GROUP *);
+
+    for (std::vector<RULE_GROUP *>::iterator it = groups.begin(); it != groups.end(); ++it)
+    {
+        size += sizeof(RULE_GROUP) + (*it)->jumps.capacity() * sizeof(size_t);
+        for (int op = 0; op <= RULE_EQ; op++)
+            size += (*it)->thresholds[op].capacity() * sizeof(RULE_THRESHOLD) + (*it)->best[op].capacity() * sizeof(size_t);
+    }
+    return size;
+}
+
+/**
+ * Point compiled group starting at rule to variable name of an equal condition of another definition,
+ * so table can be kept when definition is reloaded and the old one is released
+ */
+void RuleTable::rebind(size_t index, JsonVariant condition, Compute *compute)
+{
+    RULE_GROUP *group = groupAt(index);
+    if (group == nullptr)
+        return;
+
+    const char *varName = nullptr;
+    VarStruct value;
+    if (_parseCondition(condition, compute, &varName, &value) >= 0 && varName != nullptr)
+        group->varName = varName;
+}
+
+/**
+ * Find the first rule of the group, which is satisfied by current variable value
+ * @return rule index, -1 if none of group rules is satisfied
+ */
+long int RuleTable::evalGroup(RULE_GROUP *group, Store *store)
+{
+    VarStruct *var = store->getVar(group->varName);
+    VarStruct value = var == nullptr ? VarStruct(0l) : VarStruct(*var);
+
+    // comparisons with NaN are never true
+    if (value.type == VAR_TYPE_NAN)
+        return -1;
+
+    bool integer = group->integer && value.type == VAR_TYPE_LONG;
+    size_t rule = NO_RULE, pos;
+
+    // "gte": threshold <= value, "gt": threshold < value => prefix of sorted thresholds
+
+    pos = _countLessOrEqual(group->thresholds[RULE_GTE], value, integer);
+    if (pos > 0)
+        rule = std::min(rule, group->best[RULE_GTE][pos - 1]);
+
+    pos = _countLess(group->thresholds[RULE_GT], value, integer);
+    if (pos > 0)
+        rule = std::min(rule, group->best[RULE_GT][pos - 1]);
+
+    // "lte": threshold >= value, "lt": threshold > value => suffix of sorted thresholds
+
+    pos = _countLess(group->thresholds[RULE_LTE], value, integer);
+    if (pos < group->best[RULE_LTE].size())
+        rule = std::min(rule, group->best[RULE_LTE][pos]);
+
+    pos = _countLessOrEqual(group->thresholds[RULE_LT], value, integer);
+    if (pos < group->best[RULE_LT].size())
+        rule = std::min(rule, group->best[RULE_LT][pos]);
+
+    // "eq": jump table or binary search over integers
+
+    std::vector<RULE_THRESHOLD> &eq = group->thresholds[RULE_EQ];
+    if (!eq.empty())
+    {
+        long int key = value.vInt;
+        bool exact = value.type == VAR_TYPE_LONG ||
+                     (value.vFloat < RULE_EXACT_FLOAT && value.vFloat > -RULE_EXACT_FLOAT && value.vFloat == (float)value.vInt);
+
+        if (exact && !group->jumps.empty())
+        {
+            if (key >= group->jumpBase && (unsigned long)(key - group->jumpBase) < group->jumps.size() &&
+                group->jumps[key - group->jumpBase] > 0)
+                rule = std::min(rule, group->jumps[key - group->jumpBase] - 1);
+        }
+        else if (exact)
+        {
+            VarStruct probe(key);
+            pos = _countLess(eq, probe, true);
+            if (pos < eq.size() && eq[pos].value.vInt == key)
+                rule = std::min(rule, eq[pos].rule); // equal values are in rule order
+        }
+    }
+
+    return rule == NO_RULE ? -1 : (long int)rule;
+}
+
+void RuleTable::_closeGroup()
+{
+    if (_group == nullptr)
+        return;
+
+    RULE_GROUP *group = _group;
+    _group = nullptr;
+
+    if (group->end - group->first < RULE_TABLE_MIN_RULES)
+    {
+        delete group;
+        return;
+    }
+
+    for (int op = RULE_GT; op <= RULE_EQ; op++)
+    {
+        std::vector<RULE_THRESHOLD> &thresholds = group->thresholds[op];
+        std::stable_sort(thresholds.begin(), thresholds.end(), compareThresholds);
+
+        if (op == RULE_EQ)
+            break;
+
+        // first rule for every prefix (gt, gte) or suffix (lt, lte)
+
+        std::vector<size_t> &best = group->best[op];
+        best.resize(thresholds.size());
+        size_t count = thresholds.size();
+
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t j = op == RULE_GT || op == RULE_GTE ? i : count - 1 - i;
+            size_t previous = i == 0 ? NO_RULE : best[op == RULE_GT || op == RULE_GTE ? j - 1 : j + 1];
+            best[j] = std::min(previous, thresholds[j].rule);
+        }
+    }
+
+    // dense integer "eq" rules get a jump table
+
+    std::vector<RULE_THRESHOLD> &eq = group->thresholds[RULE_EQ];
+    if (!eq.empty())
+    {
+        long int low = eq.front().value.vInt, high = eq.back().value.vInt;
+        if ((unsigned long)(high - low) < eq.size() + RULE_JUMP_TABLE_SLACK)
+        {
+            group->jumpBase = low;
+            group->jumps.resize(high - low + 1, 0);
+            for (std::vector<RULE_THRESHOLD>::reverse_iterator it = eq.rbegin(); it != eq.rend(); ++it)
+                group->jumps[it->value.vInt - low] = it->rule + 1;
+        }
+    }
+
+    SM_DEBUG("Rules " << group->first << "-" << group->end << " of [" << group->varName << "] compiled\n");
+
+    groups.push_back(group);
+}
+
+/**
+ * Recognize comparison of variable with constant, ex. {"gte": ["level", 10]} or {"lt": [5, "level"]}
+ * @return RULE_* operation (normalized to variable on the left side), -1 if not recognized
+ */
+int RuleTable::_parseCondition(JsonVariant condition, Compute *compute, const char **varName, VarStruct *value)
+{
+    JsonVariant compiled = compute->infix.resolve(condition);
+    if (!compiled.is<JsonObject>())
+        return -1;
+
+    JsonObject object = compiled.as<JsonObject>();
+    if (!object.size())
+        return -1;
+
+    JsonObject::iterator it = object.begin();
+    const char *operation = it->key().c_str();
+    JsonVariant operands = it->value();
+
+    if (!operands.is<JsonArray>() || operands.size() < 2)
+        return -1;
+
+    int op;
+    if (strcasecmp(operation, "gt") == 0)
+        op = RULE_GT;
+    else if (strcasecmp(operation, "gte") == 0)
+        op = RULE_GTE;
+    else if (strcasecmp(operation, "lt") == 0)
+        op = RULE_LT;
+    else if (strcasecmp(operation, "lte") == 0)
+        op = RULE_LTE;
+    else if (strcasecmp(operation, "eq") == 0)
+        op = RULE_EQ;
+    else
+        return -1;
+
+    // variable can be on either side, JsonVariant can't be rebound, so pick by index
+    int side = operands[0].is<const char *>() ? 0 : 1;
+    JsonVariant left = operands[side];
+    JsonVariant right = operands[1 - side];
+    bool swapped = side == 1;
+
+    // text expression operand (ex. "level + 1") is not a variable name
+
+    if (!left.is<const char *>() || !left.as<const char *>()[0] || Infix::isInfix(left.as<const char *>()) ||
+        right.is<const char *>() || (!right.is<int>() && !right.is<float>()))
+        return -1;
+
+    *varName = left.as<const char *>();
+    *value = compute->evalMath(right); // same conversion as rule by rule evaluation
+
+    if (swapped)
+    {
+        const int mirror[] = {RULE_LT, RULE_LTE, RULE_GT, RULE_GTE, RULE_EQ};
+        op = mirror[op];
+    }
+
+    return op;
+}
+
+bool RuleTable::_lessOrEqual(const VarStruct &a, const VarStruct &b, bool integer)
+{
+    return integer ? a.vInt <= b.vInt : a.vFloat <= b.vFloat;
+}
+
+/**
+ * @return number of thresholds <= value
+ */
+size_t RuleTable::_countLessOrEqual(std::vector<RULE_THRESHOLD> &thresholds, const VarStruct &value, bool integer)
+{
+    size_t low = 0, high = thresholds.size();
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (_lessOrEqual(thresholds[mid].value, value, integer))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/**
+ * @return number of thresholds < value
+ */
+size_t RuleTable::_countLess(std::vector<RULE_THRESHOLD> &thresholds, const VarStruct &value, bool integer)
+{
+    size_t low = 0, high = thresholds.size();
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (!_lessOrEqual(value, thresholds[mid].value, integer))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
@@ -0,0 +1,80 @@
+#ifndef rules_h
+#define rules_h
+
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#include "../store/store.h"
+#include "../store/varStruct.h"
+
+class Compute; // forward ref
+
+#define RULE_TABLE_MIN_RULES 4     // shorter runs of comparisons are evaluated rule by rule
+#define RULE_JUMP_TABLE_SLACK 16   // "eq" jump table may be this much larger than number of rules
+#define RULE_EXACT_FLOAT 16777216l // integers below this are exact in float
+
+#define RULE_GT 0
+#define RULE_GTE 1
+#define RULE_LT 2
+#define RULE_LTE 3
+#define RULE_EQ 4
+
+typedef struct rule_threshold
+{
+    VarStruct value; // constant of comparison
+    size_t rule;     // index of rule in state rules
+} RULE_THRESHOLD;
+
+/*
+ * Run of consecutive rules comparing the same variable with constants of the same type, ex.
+ *   {"i": {"gte": ["level", 10]}, "t": "high"}, {"i": {"lt": ["level", 2]}, "t": "low"}, ...
+ * Thresholds of every comparison kind are sorted, with index of the first rule
+ * precomputed for every prefix (gt, gte) or suffix (lt, lte) of sorted thresholds,
+ * so the first satisfied rule is found by binary search.
+ */
+typedef struct rule_group
+{
+    size_t first; // index of the first rule in group
+    size_t end;   // index after the last rule in group
+    const char *varName;
+    bool integer; // all constants are integers
+
+    std::vector<RULE_THRESHOLD> thresholds[RULE_EQ + 1]; // sorted by value
+    std::vector<size_t> best[RULE_EQ + 1];               // first rule of prefix (gt, gte) or suffix (lt, lte)
+
+    long int jumpBase;          // "eq" jump table, value - jumpBase => first rule + 1 (0 - no rule)
+    std::vector<size_t> jumps;
+} RULE_GROUP;
+
+/*
+ * Exit rules of a single state, compiled when definition is loaded
+ */
+class RuleTable
+{
+public:
+    RuleTable();
+    ~RuleTable();
+
+    void addRule(size_t, JsonVariant, Compute *);
+    bool finish();
+    void rebind(size_t, JsonVariant, Compute *);
+
+    RULE_GROUP *groupAt(size_t);
+    long int evalGroup(RULE_GROUP *, Store *);
+    size_t memoryUsage();
+
+    std::vector<RULE_GROUP *> groups;
+
+private:
+    RULE_GROUP *_group;            // group being built
+    std::vector<int> _groupIndex; // rule index => group starting at that rule (-1 if none)
+
+    void _closeGroup();
+    static int _parseCondition(JsonVariant, Compute *, const char **, VarStruct *);
+    static bool _lessOrEqual(const VarStruct &, const VarStruct &, bool);
+    static size_t _countLessOrEqual(std::vector<RULE_THRESHOLD> &, const VarStruct &, bool);
+    static size_t _countLess(std::vector<RULE_THRESHOLD> &, const VarStruct &, bool);
+};
+
+#endif
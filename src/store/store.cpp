@@ -1,12 +1,28 @@
 #include <math.h>
+#include <ctype.h>
+#include <string.h>
 #include <ArduinoJson.h>
 
 #include "store.h"
 #include "../StateMachineDebug.h"
 #include "../keycreate/keycreate.h"
 
+static bool jsonToVar(JsonVariant json, VarStruct *value)
+{
+    if (json.is<bool>())
+        *value = VarStruct((long int)json.as<bool>());
+    else if (json.is<long int>())
+        *value = VarStruct(json.as<long int>());
+    else if (json.is<float>())
+        *value = VarStruct(json.as<float>());
+    else
+        return false; // only numbers can be variables
+
+    return true;
+}
+
 Store::Store(const char *deviceId)
-    : _localMemory(), _keyCreator()
+    : _localMemory(), _globalSlots(), _keyCreator(), _journal(), _journalQueue(), _queries(), _changes()
 {
     _deviceId = deviceId;
     _globalMemory = nullptr;
@@ -17,52 +33,109 @@ void Store::setHooks(Hooks *hooks)
     _hooks = hooks;
 }
 
+/**
+ * Bind global variables to a document populated by server. Globals are read
+ * when variable is not found in local memory. Call refreshGlobalMemory()
+ * every time the document content is replaced.
+ */
 void Store::attachGlobalMemory(JsonDocument *memory)
 {
     _globalMemory = memory;
+    refreshGlobalMemory();
 }
 
-void Store::setVar(const char *varName, long int value, bool isLocal)
+/**
+ * Update cached global values from attached document in a single pass.
+ * Changes are reported to hooks once, as with setVars (or collected into the change set).
+ * Globals missing from the document are removed: getVar does not find them and
+ * they are reported as changed, until they appear in the document again.
+ * @return number of globals which changed, appeared or were removed
+ */
+size_t Store::refreshGlobalMemory()
 {
-    // for local variables we need to add scope id
-    char *varNameWithScope = isLocal ? _withScope(varName) : (char *)varName;
-    VarStruct *var;
+    if (_globalMemory == nullptr)
+        return 0;
 
-    SM_DEBUG("Set int var [" << varNameWithScope << "]: " << value << "\n");
-    if (_localMemory.count(varNameWithScope))
+    size_t changed = 0;
+    JsonObject globals = _globalMemory->as<JsonObject>();
+    bool batch = _beginBatch();
+
+    for (JsonObject::iterator it = globals.begin(); it != globals.end(); ++it)
     {
-        var = _localMemory[varNameWithScope];
-        *var = value;
+        VarStruct value;
+        if (!jsonToVar(it->value(), &value))
+            continue;
+
+        char *name = (char *)it->key().c_str();
+        VarSlot *var;
+
+        std::map<char *, VarSlot *, KeyCompare>::iterator slot = _globalSlots.lower_bound(name);
+        if (slot == _globalSlots.end() || KeyCompare()(name, slot->first))
+        {
+            var = new VarSlot(value);
+            var->name = _keyCreator.createKey(name);
+            _globalSlots.insert(slot, std::make_pair((char *)var->name, var));
+            _onCreate(var);
+            _beforeWrite(var, value, true);
+        }
+        else if (slot->second->flags & VAR_FLAG_REMOVED)
+        {
+            // removed global is back, report it as created
+            var = slot->second;
+            var->flags &= ~VAR_FLAG_REMOVED;
+            _onCreate(var);
+            _beforeWrite(var, value, true);
+            *var = value;
+        }
+        else
+        {
+            var = slot->second;
+            var->flags |= VAR_FLAG_SEEN;
+            if (var->isSame(value))
+                continue;
+            _beforeWrite(var, value, false);
+            *var = value;
+        }
+
+        var->flags |= VAR_FLAG_SEEN;
+        changed++;
     }
-    else
+
+    // globals not seen in this pass are gone from the document
+
+    for (std::map<char *, VarSlot *, KeyCompare>::iterator it = _globalSlots.begin(); it != _globalSlots.end(); ++it)
     {
-        var = new VarStruct(value);
-        _localMemory[(char *)_keyCreator.createKey(varNameWithScope)] = var;
+        VarSlot *var = it->second;
+        if (var->flags & (VAR_FLAG_SEEN | VAR_FLAG_REMOVED))
+        {
+            var->flags &= ~VAR_FLAG_SEEN;
+            continue;
+        }
+
+        _beforeWrite(var, *var, false);
+        var->flags |= VAR_FLAG_REMOVED;
+        _onRemove(var);
+        _globalRemovals++;
+        changed++;
     }
 
-    if (_hooks)
-        _hooks->onVarUpdate(varName, var);
+    _endBatch(batch, 0);
+
+    SM_DEBUG("Global memory refreshed, changed: " << changed << "\n");
+
+    return changed;
 }
 
-void Store::setVar(const char *varName, const VarStruct &value, bool isLocal)
+void Store::setVar(const char *varName, long int value, bool isLocal)
 {
-    // for local variables we need to add scope id
-    char *varNameWithScope = isLocal ? _withScope(varName) : (char *)varName;
-    VarStruct *var;
-
-    SM_DEBUG("Set int var [" << varNameWithScope << "]: " << value.vFloat << "\n");
-    if (_localMemory.count(varNameWithScope))
-    {
-        var = _localMemory[varNameWithScope];
-        *var = value;
-    }
-    else
-    {
-        _localMemory[(char *)_keyCreator.createKey(varNameWithScope)] = new VarStruct(value);
-    }
+    SM_DEBUG("Set int var [" << varName << "]: " << value << "\n");
+    _setVar(varName, VarStruct(value), isLocal);
+}
 
-    if (_hooks)
-        _hooks->onVarUpdate(varName, var);
+void Store::setVar(const char *varName, const VarStruct &value, bool isLocal)
+{
+    SM_DEBUG("Set var [" << varName << "]: " << value.vFloat << "\n");
+    _setVar(varName, value, isLocal);
 }
 
 void Store::setVar(const char *var_name, int value, bool isLocal)
@@ -72,24 +145,118 @@ void Store::setVar(const char *var_name, int value, bool isLocal)
 
 void Store::setVar(const char *varName, float value, bool isLocal)
 {
-    // for local variables we need to add scope id
-    char *varNameWithScope = isLocal ? _withScope(varName) : (char *)varName;
-    VarStruct *var;
+    SM_DEBUG("Set float var [" << varName << "]: " << value << "\n");
+    _setVar(varName, VarStruct(value), isLocal);
+}
 
-    SM_DEBUG("Set float var [" << varNameWithScope << "]: " << value << "\n");
-    if (_localMemory.count(varNameWithScope) > 0)
+/**
+ * Apply all numeric name/value pairs of an object in a single pass.
+ * Changes are reported to hooks once, with Hooks::onVarsUpdate
+ * (or collected into the change set when change tracking is on).
+ * @param scope prefix of all names, nullptr for device id (as local setVar), "" to use names as they are
+ * @return number of applied values
+ */
+size_t Store::setVars(JsonObject values, const char *scope, unsigned long cycleNum)
+{
+    char name[MAX_VAR_NAME_LEN];
+    size_t prefix = 0;
+
+    // scope is copied once, only names are copied for each value
+
+    if (scope == nullptr)
+        scope = _deviceId;
+    while (scope[prefix] && prefix < MAX_VAR_NAME_LEN - 2)
+        name[prefix] = scope[prefix], prefix++;
+    if (prefix > 0)
+        name[prefix++] = '.';
+
+    bool batch = _beginBatch();
+
+    size_t applied = 0;
+    for (JsonObject::iterator it = values.begin(); it != values.end(); ++it)
     {
-        var = _localMemory[varNameWithScope];
-        *var = value;
+        VarStruct value;
+        if (!jsonToVar(it->value(), &value))
+            continue;
+
+        const char *key = it->key().c_str();
+        size_t len = prefix;
+        while (*key && len < MAX_VAR_NAME_LEN - 1)
+            name[len++] = *key++;
+        name[len] = 0;
+
+        VarSlot *var;
+        std::map<char *, VarSlot *, KeyCompare>::iterator slot = _localMemory.lower_bound(name);
+        if (slot == _localMemory.end() || KeyCompare()(name, slot->first))
+        {
+            var = new VarSlot(value);
+            var->name = _keyCreator.createKey(name);
+            _localMemory.insert(slot, std::make_pair((char *)var->name, var));
+            _onCreate(var);
+            _beforeWrite(var, value, true);
+        }
+        else
+        {
+            var = slot->second;
+            _beforeWrite(var, value, false);
+            *var = value;
+        }
+
+        _onWrite(var);
+        applied++;
     }
-    else
+
+    _endBatch(batch, cycleNum);
+
+    SM_DEBUG("Set " << applied << " vars\n");
+
+    return applied;
+}
+
+/**
+ * Parse serialized object (JSON or MessagePack) and apply its values, see setVars(JsonObject)
+ * @return number of applied values, 0 if payload is malformed
+ */
+size_t Store::setVars(const char *payload, size_t length, const char *scope, unsigned long cycleNum)
+{
+    if (payload == nullptr || length == 0)
+        return 0;
+
+    // compact payloads (MessagePack especially) need more than the typical size, it is doubled until payload fits
+
+    size_t maxCapacity = maxPayloadCapacity(length);
+    for (size_t capacity = length * SET_VARS_SPACE_FACTOR;; capacity *= 2)
     {
-        var = new VarStruct(value);
-        _localMemory[(char *)_keyCreator.createKey(varNameWithScope)] = var;
+        if (capacity > maxCapacity)
+            capacity = maxCapacity;
+        DynamicJsonDocument doc(capacity);
+
+        // MessagePack maps start with a byte >= 0x80, JSON is text
+        DeserializationError error = (uint8_t)payload[0] >= 0x80
+                                         ? deserializeMsgPack(doc, payload, length)
+                                         : deserializeJson(doc, payload, length);
+
+        if (error == DeserializationError::NoMemory && capacity < maxCapacity && doc.capacity() == capacity)
+            continue;
+
+        if (error || !doc.is<JsonObject>())
+        {
+            SM_DEBUG("Invalid payload: " << error.c_str() << "\n");
+            return 0;
+        }
+
+        return setVars(doc.as<JsonObject>(), scope, cycleNum);
     }
+}
 
-    if (_hooks)
-        _hooks->onVarUpdate(varName, var);
+/**
+ * Document capacity enough for any payload: every value takes at least a byte of payload,
+ * strings (with terminators) take at most the payload length
+ * @return capacity in bytes
+ */
+size_t Store::maxPayloadCapacity(size_t length)
+{
+    return JSON_OBJECT_SIZE(length) + length;
 }
 
 long int Store::getVarInt(const char *name, int defaultValue)
@@ -113,6 +280,14 @@ float Store::getVarFloat(const char *name, float defaultValue)
 }
 
 VarStruct *Store::getVar(const char *varName)
+{
+    return getSlot(varName);
+}
+
+/**
+ * Same lookup as getVar, for consumers of slot bookkeeping data (versions, previous values)
+ */
+VarSlot *Store::getSlot(const char *varName)
 {
     if (varName == nullptr || !varName[0])
         return nullptr;
@@ -140,29 +315,29 @@ VarStruct *Store::getVar(const char *varName)
 
     SM_DEBUG("Var " << varNameWithScope << " not found\n");
 
+    // finally check globals populated from server
+
+    std::map<char *, VarSlot *, KeyCompare>::iterator global = _globalSlots.find((char *)varName);
+    if (global != _globalSlots.end() && !(global->second->flags & VAR_FLAG_REMOVED))
+        return global->second;
+
     return nullptr;
 }
 
 VarStruct *Store::updateVar(VarStruct *var, const char *varName, long int value, bool onlyOnValueChange)
 {
-    VarStruct *variable = var == nullptr ? var : getVar(varName);
+    VarStruct *variable = var != nullptr ? var : getVar(varName);
     if (variable == nullptr)
-    {
-        setVar(varName, value);
-        variable = getVar(varName);
-
-        if (_hooks)
-            _hooks->onVarUpdate(varName, variable);
-
-        return variable;
-    };
+        return _setVar(varName, VarStruct(value), true);
 
     if (onlyOnValueChange && variable->vInt == value)
         return variable;
 
+    _beforeWrite((VarSlot *)variable, VarStruct(value), false);
     *variable = value;
+    _onWrite((VarSlot *)variable);
 
-    if (_hooks)
+    if (_hooks && !_trackChanges)
         _hooks->onVarUpdate(varName, variable);
 
     return variable;
@@ -175,30 +350,505 @@ VarStruct *Store::updateVar(VarStruct *var, const char *varName, int value, bool
 
 VarStruct *Store::updateVar(VarStruct *var, const char *varName, float value, bool onlyOnValueChange)
 {
-    VarStruct *variable = var == nullptr ? var : getVar(varName);
-
+    VarStruct *variable = var != nullptr ? var : getVar(varName);
     if (variable == nullptr)
-    {
-        setVar(varName, value);
-        variable = getVar(varName);
-
-        if (_hooks)
-            _hooks->onVarUpdate(varName, variable);
-
-        return variable;
-    };
+        return _setVar(varName, VarStruct(value), true);
 
     if (onlyOnValueChange && variable->vFloat == value)
         return variable;
 
+    _beforeWrite((VarSlot *)variable, VarStruct(value), false);
     *variable = value;
+    _onWrite((VarSlot *)variable);
 
-    if (_hooks)
+    if (_hooks && !_trackChanges)
         _hooks->onVarUpdate(varName, variable);
 
     return variable;
 }
 
+/**
+ * Start new observation period for edge detection (isChanged) outside of state machines,
+ * machines compare to the version they have seen when last evaluated
+ */
+void Store::markVersions()
+{
+    _markVersion = _version;
+}
+
+/**
+ * Number of local and global variables, globals removed by refreshGlobalMemory are counted
+ * once for each removal, so it changes every time variables are created or removed
+ */
+size_t Store::getVarCount()
+{
+    return _localMemory.size() + _globalSlots.size() + _globalRemovals;
+}
+
+/**
+ * Store version, changes on every variable write
+ */
+unsigned long Store::getVersion()
+{
+    return _version;
+}
+
+/**
+ * Version of the last write to variable, consumers can compare it
+ * to version they have seen before instead of comparing values
+ */
+unsigned long Store::getVersion(VarSlot *slot)
+{
+    return slot->version;
+}
+
+VarStruct Store::getPrevious(VarSlot *slot)
+{
+    return getPrevious(slot, _markVersion);
+}
+
+/**
+ * Value of variable at store version seen. Slot keeps the last two value changes, so
+ * value is exact for up to two changes since then, value before the prior change otherwise
+ */
+VarStruct Store::getPrevious(VarSlot *slot, unsigned long seen)
+{
+    if (slot->changedVersion <= seen)
+        return *slot;
+    return slot->priorVersion <= seen ? slot->changedFrom : slot->priorFrom;
+}
+
+/**
+ * @return true if variable was written with different value since last markVersions()
+ */
+bool Store::isChanged(VarSlot *slot)
+{
+    return isChanged(slot, _markVersion);
+}
+
+/**
+ * @return true if variable was written with different value since store version seen
+ */
+bool Store::isChanged(VarSlot *slot, unsigned long seen)
+{
+    return slot->changedVersion > seen && !slot->isSame(getPrevious(slot, seen));
+}
+
+/**
+ * Call function for every variable (local and global) which name starts with prefix (case insensitive),
+ * in name order within local and global variables
+ */
+void Store::forEachPrefix(const char *prefix, VarIteratorFunction callback, void *context)
+{
+    // local variables are stored with device scope, prefix can be in local format as well,
+    // scoped prefix is skipped when its names are within prefix already (ex. empty prefix)
+
+    char scoped[MAX_VAR_NAME_LEN];
+    strcpy(scoped, _withScope(prefix));
+
+    const char *prefixes[] = {prefix, scoped, prefix};
+    std::map<char *, VarSlot *, KeyCompare> *memories[] = {&_localMemory, &_localMemory, &_globalSlots};
+    for (size_t m = 0; m < 3; m++)
+    {
+        size_t len = strlen(prefixes[m]);
+        if (m == 1 && strncasecmp(scoped, prefix, strlen(prefix)) == 0)
+            continue;
+
+        // names sharing prefix are next to each other in case insensitive order
+        std::map<char *, VarSlot *, KeyCompare>::iterator it = memories[m]->lower_bound((char *)prefixes[m]);
+        for (; it != memories[m]->end() && strncasecmp(it->first, prefixes[m], len) == 0; ++it)
+        {
+            if (!(it->second->flags & VAR_FLAG_REMOVED))
+                callback(context, it->first, it->second);
+        }
+    }
+}
+
+/**
+ * Get set of variables matching name pattern (see matchPattern). Set is resolved
+ * on the first call and then updated as new variables are created.
+ */
+VAR_QUERY *Store::query(const char *pattern)
+{
+    std::map<const char *, VAR_QUERY *, KeyCompare>::iterator it = _queries.find(pattern);
+    if (it != _queries.end())
+        return it->second;
+
+    VAR_QUERY *query = new VAR_QUERY();
+    query->pattern = _keyCreator.createKey(pattern);
+    query->scopedPattern = _keyCreator.createKey(_withScope(pattern));
+    _queries[query->pattern] = query;
+
+    // only names starting with literal part of pattern can match
+
+    char prefix[MAX_VAR_NAME_LEN];
+    size_t len = 0;
+    while (pattern[len] && pattern[len] != '*' && pattern[len] != '?' && len < MAX_VAR_NAME_LEN - 1)
+        prefix[len] = pattern[len], len++;
+    prefix[len] = 0;
+
+    forEachPrefix(prefix, _addToQuery, query);
+
+    SM_DEBUG("Query [" << pattern << "] matches " << query->vars.size() << " vars\n");
+
+    return query;
+}
+
+bool Store::isPattern(const char *name)
+{
+    return strpbrk(name, "*?") != nullptr;
+}
+
+/**
+ * Case insensitive glob match, "*" matches any sequence of characters, "?" any single character
+ */
+bool Store::matchPattern(const char *pattern, const char *name)
+{
+    const char *star = nullptr, *resume = nullptr;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = name;
+        }
+        else if (*pattern == '?' || (*pattern && tolower(*pattern) == tolower(*name)))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star)
+        {
+            // let the last star consume one more character
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (*pattern == '*')
+        pattern++;
+
+    return !*pattern;
+}
+
+/**
+ * Write all local variables (with full scoped names) to snapshot
+ */
+void Store::writeSnapshot(BinaryWriter *writer)
+{
+    writer->writeVarUInt(_localMemory.size());
+    for (std::map<char *, VarSlot *, KeyCompare>::iterator it = _localMemory.begin(); it != _localMemory.end(); ++it)
+    {
+        writer->writeString(it->first);
+        writer->writeVar(*it->second);
+    }
+}
+
+/**
+ * Restore variables from snapshot, hooks are not notified
+ * @return false if snapshot data is malformed
+ */
+bool Store::readSnapshot(BinaryReader *reader)
+{
+    char name[MAX_BINARY_STRING_LEN];
+    unsigned long count = reader->readVarUInt();
+
+    for (unsigned long i = 0; i < count && !reader->failed(); i++)
+    {
+        if (!reader->readString(name, MAX_BINARY_STRING_LEN))
+            return false;
+        VarStruct value = reader->readVar();
+        if (reader->failed())
+            return false;
+
+        if (_localMemory.count(name))
+            *_localMemory[name] = value;
+        else
+            _createVar(name, value);
+    }
+
+    return !reader->failed();
+}
+
+/**
+ * Attach persistent storage and restore persistent variables from it.
+ * Restored variables stay persistent, hooks are not notified.
+ */
+void Store::attachJournal(JournalStorage *storage)
+{
+    _journal.attach(storage);
+    _journal.replay(_replayVar, this);
+}
+
+/**
+ * Mark variable as persistent: its changes are written to journal on commitJournal().
+ * Variable is created (as local, with value 0) if it does not exist yet.
+ */
+void Store::setPersistent(const char *varName, bool persistent)
+{
+    VarSlot *var = (VarSlot *)getVar(varName);
+    if (var == nullptr)
+        var = _createVar(_withScope(varName), VarStruct(0l));
+
+    if (persistent)
+        var->flags |= VAR_FLAG_PERSISTENT;
+    else
+        var->flags &= ~VAR_FLAG_PERSISTENT;
+}
+
+/**
+ * Group commit: write latest values of persistent variables changed
+ * since last commit and sync storage once. Compacts log when it is too long.
+ * @return false on storage failure, or if name of a variable is too long for journal
+ */
+bool Store::commitJournal()
+{
+    if (!_journal.isAttached())
+        return true;
+
+    for (std::vector<VarSlot *>::iterator it = _journalQueue.begin(); it != _journalQueue.end(); ++it)
+    {
+        _journal.append((*it)->name, **it);
+        (*it)->flags &= ~VAR_FLAG_JOURNAL_DIRTY;
+    }
+    _journalQueue.clear();
+
+    bool ok = _journal.commit();
+
+    if (_journal.needsCompaction())
+    {
+        unsigned long count = 0;
+        for (std::map<char *, VarSlot *, KeyCompare>::iterator it = _localMemory.begin(); it != _localMemory.end(); ++it)
+            if (it->second->flags & VAR_FLAG_PERSISTENT)
+                count++;
+
+        _journal.beginCompaction(count);
+        for (std::map<char *, VarSlot *, KeyCompare>::iterator it = _localMemory.begin(); it != _localMemory.end(); ++it)
+            if (it->second->flags & VAR_FLAG_PERSISTENT)
+                _journal.compactVar(it->first, *it->second);
+
+        ok = _journal.endCompaction() && ok;
+    }
+
+    return ok;
+}
+
+Journal *Store::getJournal()
+{
+    return &_journal;
+}
+
+/**
+ * When change tracking is on, writes are collected into per-cycle change set
+ * (see collectChanges) instead of calling Hooks::onVarUpdate on every write
+ */
+void Store::setChangeTracking(bool enabled)
+{
+    if (!enabled)
+        clearChanges();
+    _trackChanges = enabled;
+}
+
+bool Store::isTrackingChanges()
+{
+    return _trackChanges;
+}
+
+/**
+ * Drop entries of variables which ended up with their previous value
+ * @return number of entries in change set
+ */
+size_t Store::collectChanges()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < _changes.size(); i++)
+    {
+        VAR_CHANGE &change = _changes[i];
+        change.removed = (((VarSlot *)change.value)->flags & VAR_FLAG_REMOVED) != 0;
+
+        if (!change.created && !change.removed && change.value->isSame(change.previous))
+        {
+            ((VarSlot *)change.value)->flags &= ~VAR_FLAG_CHANGED;
+            continue;
+        }
+
+        _changes[count++] = change;
+    }
+    _changes.resize(count);
+
+    return count;
+}
+
+const VAR_CHANGE *Store::getChanges()
+{
+    return _changes.data();
+}
+
+void Store::clearChanges()
+{
+    for (std::vector<VAR_CHANGE>::iterator it = _changes.begin(); it != _changes.end(); ++it)
+        ((VarSlot *)it->value)->flags &= ~VAR_FLAG_CHANGED;
+    _changes.clear();
+}
+
+VarStruct *Store::_setVar(const char *varName, const VarStruct &value, bool isLocal)
+{
+    // for local variables we need to add scope id
+    char *varNameWithScope = isLocal ? _withScope(varName) : (char *)varName;
+    VarSlot *var;
+
+    std::map<char *, VarSlot *, KeyCompare>::iterator it = _localMemory.find(varNameWithScope);
+    if (it != _localMemory.end())
+    {
+        var = it->second;
+        _beforeWrite(var, value, false);
+        *var = value;
+    }
+    else
+    {
+        var = _createVar(varNameWithScope, value);
+        _beforeWrite(var, value, true);
+    }
+
+    _onWrite(var);
+
+    if (_hooks && !_trackChanges)
+        _hooks->onVarUpdate(varName, var);
+
+    return var;
+}
+
+VarSlot *Store::_createVar(const char *varName, const VarStruct &value)
+{
+    VarSlot *var = new VarSlot(value);
+    var->name = _keyCreator.createKey(varName);
+    _localMemory[(char *)var->name] = var;
+    _onCreate(var);
+    return var;
+}
+
+void Store::_onCreate(VarSlot *var)
+{
+    for (std::map<const char *, VAR_QUERY *, KeyCompare>::iterator it = _queries.begin(); it != _queries.end(); ++it)
+        if (_matchQuery(it->second, var->name))
+            it->second->vars.push_back(var);
+}
+
+void Store::_onRemove(VarSlot *var)
+{
+    for (std::map<const char *, VAR_QUERY *, KeyCompare>::iterator it = _queries.begin(); it != _queries.end(); ++it)
+    {
+        std::vector<VarStruct *> &vars = it->second->vars;
+        for (size_t i = 0; i < vars.size(); i++)
+        {
+            if (vars[i] == var)
+            {
+                vars.erase(vars.begin() + i);
+                break;
+            }
+        }
+    }
+}
+
+void Store::_addToQuery(void *context, const char *varName, VarStruct *var)
+{
+    VAR_QUERY *query = (VAR_QUERY *)context;
+    if (_matchQuery(query, varName))
+        query->vars.push_back(var);
+}
+
+/**
+ * Match stored name, local variable names match in local format too (ex. "zone3.*" matches "device-id.zone3.fan")
+ */
+bool Store::_matchQuery(VAR_QUERY *query, const char *varName)
+{
+    return matchPattern(query->pattern, varName) || matchPattern(query->scopedPattern, varName);
+}
+
+/**
+ * Collect writes of a bulk update into the change set, unless changes are tracked already
+ * @return true if batch was started, it is delivered to hooks by _endBatch then
+ */
+bool Store::_beginBatch()
+{
+    if (_trackChanges)
+        return false;
+    _trackChanges = true;
+    return true;
+}
+
+void Store::_endBatch(bool batch, unsigned long cycleNum)
+{
+    if (!batch)
+        return;
+
+    _trackChanges = false;
+    size_t count = collectChanges();
+    if (_hooks && count > 0)
+        _hooks->onVarsUpdate(getChanges(), count, cycleNum);
+    clearChanges();
+}
+
+void Store::_beforeWrite(VarSlot *var, const VarStruct &value, bool created)
+{
+    var->version = ++_version;
+    if (!created && !var->isSame(value))
+    {
+        var->priorVersion = var->changedVersion;
+        var->priorFrom = var->changedFrom;
+        var->changedVersion = var->version;
+        var->changedFrom = *var;
+    }
+
+    // remember value before the first write in this cycle only
+    if (!_trackChanges || (var->flags & VAR_FLAG_CHANGED))
+        return;
+
+    var->flags |= VAR_FLAG_CHANGED;
+
+    VAR_CHANGE change;
+    change.name = var->name;
+    change.value = var;
+    change.previous = *var;
+    change.created = created;
+    change.removed = false;
+    _changes.push_back(change);
+}
+
+void Store::_onWrite(VarSlot *var)
+{
+    // queue persistent variable once per commit, so repeated writes are coalesced
+    if ((var->flags & (VAR_FLAG_PERSISTENT | VAR_FLAG_JOURNAL_DIRTY)) == VAR_FLAG_PERSISTENT && _journal.isAttached())
+    {
+        var->flags |= VAR_FLAG_JOURNAL_DIRTY;
+        _journalQueue.push_back(var);
+    }
+}
+
+void Store::_replayVar(void *context, const char *varName, const VarStruct &value)
+{
+    Store *store = (Store *)context;
+    VarSlot *var;
+
+    std::map<char *, VarSlot *, KeyCompare>::iterator it = store->_localMemory.find((char *)varName);
+    if (it != store->_localMemory.end())
+    {
+        var = it->second;
+        *var = value;
+    }
+    else
+    {
+        var = store->_createVar(varName, value);
+    }
+
+    var->flags |= VAR_FLAG_PERSISTENT;
+}
+
 char *Store::_withScope(const char *var_name)
 {
     return _keyCreator.withScope(_deviceId, var_name);
@@ -2,14 +2,31 @@
 #define store_h
 
 #include <map>
+#include <vector>
 #include "math.h"
 #include <ArduinoJson.h>
 #include "../keycompare/keycompare.h"
 #include "../keycreate/keycreate.h"
 #include "../hooks/hooks.h"
+#include "../binary/binary.h"
+#include "../journal/journal.h"
 #include "./varStruct.h"
+#include "./varSlot.h"
 
 #define MAX_VARIABLE_SPACE 1024 // maximum size of JSON storing local variables
+#define SET_VARS_SPACE_FACTOR 3 // initial JSON document size for bulk payload, relative to payload size
+
+/*
+ * Set of variables matching name pattern, kept up to date when new variables are created
+ */
+typedef struct var_query
+{
+    const char *pattern;
+    const char *scopedPattern; // pattern of local variables, stored with device scope
+    std::vector<VarStruct *> vars;
+} VAR_QUERY;
+
+typedef void (*VarIteratorFunction)(void *, const char *, VarStruct *);
 
 class Store
 {
@@ -17,28 +34,86 @@ public:
     Store(const char *);
     void setHooks(Hooks *);
     void attachGlobalMemory(JsonDocument *);
+    size_t refreshGlobalMemory();
 
     void setVar(const char *, const VarStruct &, bool isLocal = true);
     void setVar(const char *, long int, bool isLocal = true);
     void setVar(const char *, int, bool isLocal = true);
     void setVar(const char *, float, bool isLocal = true);
+    size_t setVars(JsonObject, const char *scope = nullptr, unsigned long cycleNum = 0);
+    size_t setVars(const char *, size_t, const char *scope = nullptr, unsigned long cycleNum = 0);
+    static size_t maxPayloadCapacity(size_t);
 
     long int getVarInt(const char *, int defaultValue = 0);
     float getVarFloat(const char *, float defaultValue = 0.0f);
     VarStruct *getVar(const char *);
+    VarSlot *getSlot(const char *);
+    size_t getVarCount();
 
     VarStruct *updateVar(VarStruct *, const char *, long int, bool onlyOnValueChange = true);
     VarStruct *updateVar(VarStruct *, const char *, int, bool onlyOnValueChange = true);
     VarStruct *updateVar(VarStruct *, const char *, float, bool onlyOnValueChange = true);
 
+    void markVersions();
+    unsigned long getVersion();
+    unsigned long getVersion(VarSlot *);
+    VarStruct getPrevious(VarSlot *);
+    VarStruct getPrevious(VarSlot *, unsigned long);
+    bool isChanged(VarSlot *);
+    bool isChanged(VarSlot *, unsigned long);
+
+    void forEachPrefix(const char *, VarIteratorFunction, void *);
+    VAR_QUERY *query(const char *);
+    static bool isPattern(const char *);
+    static bool matchPattern(const char *, const char *);
+
+    void writeSnapshot(BinaryWriter *);
+    bool readSnapshot(BinaryReader *);
+
+    void attachJournal(JournalStorage *);
+    void setPersistent(const char *, bool persistent = true);
+    bool commitJournal();
+    Journal *getJournal();
+
+    void setChangeTracking(bool);
+    bool isTrackingChanges();
+    size_t collectChanges();
+    const VAR_CHANGE *getChanges();
+    void clearChanges();
+
 private:
-    std::map<char *, VarStruct *, KeyCompare> _localMemory; // local device variables
-    JsonDocument *_globalMemory;                            // global variables populated from server
+    std::map<char *, VarSlot *, KeyCompare> _localMemory; // local device variables
+    JsonDocument *_globalMemory;                          // global variables populated from server
+    std::map<char *, VarSlot *, KeyCompare> _globalSlots; // cached values of _globalMemory
+    size_t _globalRemovals = 0;                           // globals removed by refreshGlobalMemory (see getVarCount)
 
     Hooks *_hooks = nullptr;
     const char *_deviceId;
     KeyCreate _keyCreator;
     char *_withScope(const char *);
+
+    Journal _journal;
+    std::vector<VarSlot *> _journalQueue; // persistent variables changed since last commit
+
+    std::map<const char *, VAR_QUERY *, KeyCompare> _queries;
+
+    unsigned long _version = 0;     // incremented on every write
+    unsigned long _markVersion = 0; // version at last markVersions()
+
+    bool _trackChanges = false;
+    std::vector<VAR_CHANGE> _changes; // variables written since last clearChanges()
+
+    VarStruct *_setVar(const char *, const VarStruct &, bool);
+    VarSlot *_createVar(const char *, const VarStruct &);
+    void _onCreate(VarSlot *);
+    void _onRemove(VarSlot *);
+    static void _addToQuery(void *, const char *, VarStruct *);
+    static bool _matchQuery(VAR_QUERY *, const char *);
+    bool _beginBatch();
+    void _endBatch(bool, unsigned long);
+    void _beforeWrite(VarSlot *, const VarStruct &, bool);
+    void _onWrite(VarSlot *);
+    static void _replayVar(void *, const char *, const VarStruct &);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef varslot_h
+#define varslot_h
+
+#include "./varStruct.h"
+
+#define VAR_FLAG_PERSISTENT 0x01    // variable is written to journal
+#define VAR_FLAG_JOURNAL_DIRTY 0x02 // variable is queued for the next journal commit
+#define VAR_FLAG_CHANGED 0x04       // variable is in the current change set
+#define VAR_FLAG_SEEN 0x08          // global was found in document during refreshGlobalMemory
+#define VAR_FLAG_REMOVED 0x10       // global is missing from document, getVar does not find it
+
+/*
+ * Store keeps variables in slots, which extend VarStruct with bookkeeping data.
+ * Pointers to slots are handed out as VarStruct *, so slot data is never visible
+ * to actions or plugins, only Store::getSlot exposes it to edge detection and
+ * expression caches. Assigning a VarStruct to a slot copies only value part.
+ */
+typedef struct VarSlot : public VarStruct
+{
+    VarSlot(const VarStruct &value)
+        : VarStruct(value), name(nullptr), flags(0), version(0), changedVersion(0), changedFrom(value), priorVersion(0), priorFrom(value) {}
+
+    void operator=(const VarStruct &value)
+    {
+        VarStruct::operator=(value);
+    }
+
+    const char *name; // full (scoped) variable name, owned by store
+    unsigned char flags;
+    unsigned long version;        // store version of the last write
+    unsigned long changedVersion; // store version of the last write which changed value
+    VarStruct changedFrom;        // value before that change
+    unsigned long priorVersion;   // store version of the change before it
+    VarStruct priorFrom;          // value before the prior change
+} VarSlot;
+
+#endif
@@ -41,6 +41,25 @@ typedef struct VarStruct
             return type == VAR_TYPE_FLOAT || src.type == VAR_TYPE_FLOAT ? VAR_TYPE_FLOAT : VAR_TYPE_LONG;
     }
 
+    /**
+     * Exact comparison: same type and same value, NaN is same as NaN (unlike operator==)
+     */
+    bool isSame(const VarStruct &src) const
+    {
+        if (type != src.type)
+            return false;
+
+        switch (type)
+        {
+        case VAR_TYPE_LONG:
+            return vInt == src.vInt;
+        case VAR_TYPE_FLOAT:
+            return vFloat == src.vFloat;
+        default:
+            return true;
+        }
+    }
+
     VarStruct initType(const VarStruct &src)
     {
         VarStruct result;
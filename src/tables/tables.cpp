@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "tables.h"
+#include "../StateMachineDebug.h"
+
+static bool compareEntries(const LUT_ENTRY &a, const LUT_ENTRY &b)
+{
+    return a.key < b.key;
+}
+
+static bool comparePoints(const INTERP_POINT &a, const INTERP_POINT &b)
+{
+    return a.x < b.x;
+}
+
+Tables::~Tables()
+{
+    clear();
+}
+
+/**
+ * Compile all tables of definition section, tables keep references
+ * to definition, so it has to live as long as tables do
+ */
+void Tables::load(JsonVariant definition)
+{
+    clear();
+
+    if (!definition.is<JsonObject>())
+        return;
+
+    for (JsonPair table : definition.as<JsonObject>())
+    {
+        const char *name = table.key().c_str();
+
+        if (table.value().is<JsonObject>())
+            _lutMap[name] = _compileLut(table.value().as<JsonObject>());
+        else if (table.value().is<JsonArray>())
+            _interpMap[name] = _compileInterp(table.value().as<JsonArray>());
+    }
+}
+
+void Tables::clear()
+{
+    for (std::map<const char *, LUT_TABLE *, KeyCompare>::iterator it = _lutMap.begin(); it != _lutMap.end(); ++it)
+        delete it->second;
+    for (std::map<const char *, std::vector<INTERP_POINT> *, KeyCompare>::iterator it = _interpMap.begin(); it != _interpMap.end(); ++it)
+        delete it->second;
+
+    _lutMap.clear();
+    _interpMap.clear();
+}
+
+/**
+ * Find expression for key in lookup table
+ * @return table entry, default entry if key is missing, null if there is no such table or default
+ */
+JsonVariant Tables::lookup(const char *name, const VarStruct &key)
+{
+    std::map<const char *, LUT_TABLE *, KeyCompare>::iterator it = _lutMap.find(name);
+    if (it == _lutMap.end())
+        return JsonVariant();
+
+    LUT_TABLE *table = it->second;
+    int value = table->defaultValue;
+
+    if (key.type == VAR_TYPE_NAN)
+    {
+        // default
+    }
+    else if (!table->dense.empty())
+    {
+        if (key.vInt >= table->base && (unsigned long)(key.vInt - table->base) < table->dense.size() &&
+            table->dense[key.vInt - table->base] >= 0)
+            value = table->dense[key.vInt - table->base];
+    }
+    else
+    {
+        LUT_ENTRY probe;
+        probe.key = key.vInt;
+        std::vector<LUT_ENTRY>::iterator entry = std::lower_bound(table->sparse.begin(), table->sparse.end(), probe, compareEntries);
+        if (entry != table->sparse.end() && entry->key == key.vInt)
+            value = entry->value;
+    }
+
+    return value < 0 ? JsonVariant() : table->values[value];
+}
+
+/**
+ * Piecewise linear interpolation, values outside of table are clamped to the first/last point
+ */
+VarStruct Tables::interpolate(const char *name, const VarStruct &x)
+{
+    std::map<const char *, std::vector<INTERP_POINT> *, KeyCompare>::iterator it = _interpMap.find(name);
+    if (it == _interpMap.end() || it->second->empty() || x.type == VAR_TYPE_NAN)
+        return VarStruct::NaN();
+
+    std::vector<INTERP_POINT> &points = *it->second;
+
+    INTERP_POINT probe;
+    probe.x = x.vFloat;
+    std::vector<INTERP_POINT>::iterator upper = std::upper_bound(points.begin(), points.end(), probe, comparePoints);
+
+    if (upper == points.begin())
+        return points.front().y;
+    if (upper == points.end())
+        return points.back().y;
+
+    INTERP_POINT &a = *(upper - 1), &b = *upper;
+    return a.y + (b.y - a.y) * (x.vFloat - a.x) / (b.x - a.x);
+}
+
+LUT_TABLE *Tables::_compileLut(JsonObject definition)
+{
+    LUT_TABLE *table = new LUT_TABLE();
+    table->base = 0;
+    table->defaultValue = -1;
+
+    for (JsonPair item : definition)
+    {
+        const char *key = item.key().c_str();
+        int index = table->values.size();
+
+        if (strcasecmp(key, TABLE_DEFAULT_KEY) == 0)
+        {
+            table->values.push_back(item.value());
+            table->defaultValue = index;
+            continue;
+        }
+
+        char *end;
+        long int value = strtol(key, &end, 10);
+        if (!key[0] || *end)
+            continue; // not an integer
+
+        table->values.push_back(item.value());
+        LUT_ENTRY entry = {value, index};
+        table->sparse.push_back(entry);
+    }
+
+    // first definition of duplicate key wins
+
+    std::stable_sort(table->sparse.begin(), table->sparse.end(), compareEntries);
+    table->sparse.erase(std::unique(table->sparse.begin(), table->sparse.end(),
+                                    [](const LUT_ENTRY &a, const LUT_ENTRY &b) { return a.key == b.key; }),
+                        table->sparse.end());
+
+    if (!table->sparse.empty())
+    {
+        long int low = table->sparse.front().key, high = table->sparse.back().key;
+
+        if ((unsigned long)(high - low) < table->sparse.size() + TABLE_DENSE_SLACK)
+        {
+            table->base = low;
+            table->dense.resize(high - low + 1, -1);
+            for (std::vector<LUT_ENTRY>::iterator it = table->sparse.begin(); it != table->sparse.end(); ++it)
+                table->dense[it->key - low] = it->value;
+            table->sparse.clear();
+        }
+    }
+
+    return table;
+}
+
+std::vector<INTERP_POINT> *Tables::_compileInterp(JsonArray definition)
+{
+    std::vector<INTERP_POINT> *points = new std::vector<INTERP_POINT>();
+
+    for (JsonVariant item : definition)
+    {
+        if (!item.is<JsonArray>() || item.size() < 2)
+            continue;
+
+        INTERP_POINT point;
+        point.x = item[0].as<float>();
+        point.y = item[1].as<float>();
+        points->push_back(point);
+    }
+
+    std::stable_sort(points->begin(), points->end(), comparePoints);
+
+    return points;
+}
@@ -0,0 +1,68 @@
+#ifndef tables_h
+#define tables_h
+
+#include <map>
+#include <vector>
+
+#include <ArduinoJson.h>
+
+#include "../keycompare/keycompare.h"
+#include "../store/varStruct.h"
+
+#define TABLE_DEFAULT_KEY "default" // lookup table entry used for missing keys
+#define TABLE_DENSE_SLACK 16        // dense lookup table may be this much larger than number of entries
+
+typedef struct lut_entry
+{
+    long int key;
+    int value; // index of expression in LUT_TABLE::values
+} LUT_ENTRY;
+
+/*
+ * Lookup table, integer keys mapped to expressions. Dense keys are stored
+ * as array indexed by key (O(1)), sparse ones as sorted array (O(log n)).
+ * Expressions are kept in "values" only, JsonVariant can't be reassigned
+ * without changing the definition it points to.
+ */
+typedef struct lut_table
+{
+    std::vector<JsonVariant> values; // expressions, evaluated on lookup
+    long int base;                   // key of dense[0]
+    std::vector<int> dense;          // index of expression, -1 => default
+    std::vector<LUT_ENTRY> sparse;   // sorted by key
+    int defaultValue;                // index of default expression, -1 => none
+} LUT_TABLE;
+
+typedef struct interp_point
+{
+    float x;
+    float y;
+} INTERP_POINT;
+
+/*
+ * Named tables compiled from definition, ex.
+ *   "mode-power": {"0": 0, "1": 250, "2": {"mul": ["boost", 100]}, "default": 0}
+ *   "fan-curve": [[20, 0], [25, 30], [30, 100]]
+ * Objects are lookup tables (for "lut"/"switch"), arrays of [x, y] points
+ * are breakpoint tables for piecewise linear interpolation ("interp").
+ */
+class Tables
+{
+public:
+    ~Tables();
+
+    void load(JsonVariant);
+    void clear();
+
+    JsonVariant lookup(const char *, const VarStruct &);
+    VarStruct interpolate(const char *, const VarStruct &);
+
+    std::map<const char *, LUT_TABLE *, KeyCompare> _lutMap;
+    std::map<const char *, std::vector<INTERP_POINT> *, KeyCompare> _interpMap;
+
+private:
+    LUT_TABLE *_compileLut(JsonObject);
+    std::vector<INTERP_POINT> *_compileInterp(JsonArray);
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include <string.h>
+
+#include "telemetry.h"
+#include "../StateMachineDebug.h"
+
+static void writeValue(BinaryWriter *writer, unsigned long id, const VarStruct &value, const VarStruct &previous)
+{
+    switch (value.type)
+    {
+    case VAR_TYPE_LONG:
+        writer->writeVarUInt((id << 2) | TELEMETRY_KIND_DELTA);
+        writer->writeVarInt((long int)((unsigned long)value.vInt - (unsigned long)previous.vInt));
+        break;
+    case VAR_TYPE_FLOAT:
+        writer->writeVarUInt((id << 2) | TELEMETRY_KIND_FLOAT);
+        writer->writeFloat(value.vFloat);
+        break;
+    default:
+        writer->writeVarUInt((id << 2) | TELEMETRY_KIND_NAN);
+    }
+}
+
+/**************************************************************************
+ *                               Encoder
+ **************************************************************************/
+
+TelemetryEncoder::TelemetryEncoder()
+{
+    reset();
+}
+
+/**
+ * Start over: next frame tells decoder to drop its state and all variables are announced again
+ */
+void TelemetryEncoder::reset()
+{
+    _count = 0;
+    _seq = 0;
+    _reset = true;
+}
+
+/**
+ * Encode change set into a single frame, variables with value equal to last sent one are omitted
+ * @param changes change set (see Hooks::onVarsUpdate)
+ * @param buffer caller provided output buffer
+ * @return frame size, 0 if buffer is too small (encoder state is not changed then)
+ */
+size_t TelemetryEncoder::encode(const VAR_CHANGE *changes, size_t count, unsigned long cycleNum, uint8_t *buffer, size_t size)
+{
+    BinaryWriter writer(buffer, size);
+
+    writer.writeByte(_reset ? TELEMETRY_FRAME_RESET : 0);
+    writer.writeVarUInt(_seq + 1);
+    writer.writeVarUInt(cycleNum);
+
+    // write entries without touching encoder state, so too small buffer can be handled
+
+    size_t assigned = _count;
+    for (size_t i = 0; i < count; i++)
+    {
+        const VarStruct &value = *changes[i].value;
+        int id = _find(changes[i].name);
+
+        if (id >= 0)
+        {
+            if (!value.isSame(_values[id]))
+                writeValue(&writer, id, value, _values[id]);
+            continue;
+        }
+
+        writer.writeVarUInt(((assigned < TELEMETRY_MAX_VARS ? assigned++ : TELEMETRY_MAX_VARS) << 2) | TELEMETRY_KIND_ANNOUNCE);
+        writer.writeString(changes[i].name);
+        writer.writeVar(value);
+    }
+
+    if (writer.overflowed())
+        return 0;
+
+    // frame fits, remember what was sent
+
+    for (size_t i = 0; i < count; i++)
+    {
+        int id = _find(changes[i].name);
+        if (id < 0)
+        {
+            if (_count >= TELEMETRY_MAX_VARS)
+                continue;
+            id = _count++;
+            _names[id] = changes[i].name;
+        }
+        _values[id] = *changes[i].value;
+    }
+
+    _seq++;
+    _reset = false;
+
+    return writer.size();
+}
+
+int TelemetryEncoder::_find(const char *name)
+{
+    for (size_t i = 0; i < _count; i++)
+        if (_names[i] == name)
+            return i;
+    return -1;
+}
+
+/**************************************************************************
+ *                               Decoder
+ **************************************************************************/
+
+TelemetryDecoder::TelemetryDecoder()
+{
+    cycleNum = 0;
+    _count = 0;
+    _seq = 0;
+    _synced = false;
+}
+
+/**
+ * Decode single frame and report every variable it contains, frame is checked
+ * as a whole first so a malformed one neither changes decoder state nor reports anything
+ * @return false if frame is malformed or out of sequence (encoder has to be reset)
+ */
+bool TelemetryDecoder::decode(const uint8_t *buffer, size_t size, TelemetryFunction callback, void *context)
+{
+    BinaryReader reader(buffer, size);
+
+    uint8_t flags = reader.readByte();
+    unsigned long seq = reader.readVarUInt();
+    unsigned long cycle = reader.readVarUInt();
+
+    if (reader.failed())
+        return false;
+
+    bool reset = flags & TELEMETRY_FRAME_RESET;
+    if (!reset && (!_synced || seq != _seq + 1))
+    {
+        SM_DEBUG("Telemetry frame " << seq << " out of sequence\n");
+        _synced = false;
+        return false;
+    }
+
+    BinaryReader check = reader;
+    if (!_validate(&check, reset ? 0 : _count))
+    {
+        SM_DEBUG("Telemetry frame " << seq << " malformed\n");
+        _synced = false;
+        return false;
+    }
+
+    if (reset)
+        _count = 0;
+    _synced = true;
+    _seq = seq;
+    cycleNum = cycle;
+
+    char name[MAX_BINARY_STRING_LEN];
+
+    while (reader.remaining() > 0)
+    {
+        unsigned long header = reader.readVarUInt();
+        unsigned long id = header >> 2;
+        VarStruct value;
+
+        if ((header & 3) == TELEMETRY_KIND_ANNOUNCE)
+        {
+            reader.readString(name, MAX_BINARY_STRING_LEN);
+            value = reader.readVar();
+
+            if (id == _count && _count < TELEMETRY_MAX_VARS)
+            {
+                strncpy(_names[id], name, TELEMETRY_MAX_NAME_LEN - 1);
+                _names[id][TELEMETRY_MAX_NAME_LEN - 1] = 0;
+                _values[id] = value;
+                _count++;
+            }
+
+            callback(context, name, value);
+            continue;
+        }
+
+        switch (header & 3)
+        {
+        case TELEMETRY_KIND_DELTA:
+            value = VarStruct((long int)((unsigned long)_values[id].vInt + (unsigned long)reader.readVarInt()));
+            break;
+        case TELEMETRY_KIND_FLOAT:
+            value = VarStruct(reader.readFloat());
+            break;
+        default:
+            value = VarStruct::NaN();
+        }
+
+        _values[id] = value;
+        callback(context, _names[id], value);
+    }
+
+    return true;
+}
+
+/**
+ * Walk frame entries without applying them, ids are checked against variable count
+ * the decoder would have at that point
+ * @return true if all entries are readable and reference known or just announced variables
+ */
+bool TelemetryDecoder::_validate(BinaryReader *reader, size_t count)
+{
+    char name[MAX_BINARY_STRING_LEN];
+
+    while (reader->remaining() > 0)
+    {
+        unsigned long header = reader->readVarUInt();
+        unsigned long id = header >> 2;
+
+        switch (header & 3)
+        {
+        case TELEMETRY_KIND_ANNOUNCE:
+            reader->readString(name, MAX_BINARY_STRING_LEN);
+            reader->readVar();
+            if (id > count)
+                return false;
+            if (id == count && count < TELEMETRY_MAX_VARS)
+                count++;
+            break;
+        case TELEMETRY_KIND_DELTA:
+            reader->readVarInt();
+            if (id >= count)
+                return false;
+            break;
+        case TELEMETRY_KIND_FLOAT:
+            reader->readFloat();
+            if (id >= count)
+                return false;
+            break;
+        default:
+            if (id >= count)
+                return false;
+        }
+
+        if (reader->failed())
+            return false;
+    }
+
+    return true;
+}
+
+bool TelemetryDecoder::isSynced()
+{
+    return _synced;
+}
@@ -0,0 +1,72 @@
+#ifndef telemetry_h
+#define telemetry_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../store/varStruct.h"
+#include "../hooks/hooks.h"
+#include "../binary/binary.h"
+
+#define TELEMETRY_MAX_VARS 64     // number of interned variable names
+#define TELEMETRY_MAX_NAME_LEN 32 // maximum length of name kept by decoder
+
+#define TELEMETRY_FRAME_RESET 0x01 // decoder should drop interned names and values
+
+#define TELEMETRY_KIND_DELTA 0    // integer, zigzag varint difference to previous value
+#define TELEMETRY_KIND_FLOAT 1    // float, 4 bytes
+#define TELEMETRY_KIND_NAN 2      // NaN, no payload
+#define TELEMETRY_KIND_ANNOUNCE 3 // name followed by full value, assigns id
+
+/*
+ * Frame layout (one frame per cycle):
+ *   [u8 flags][varuint sequence][varuint cycle number] entries...
+ * Entry:
+ *   [varuint (id << 2) | kind][payload]
+ * First change of every variable announces its name together with id, later changes
+ * refer to id only. When id table is full, variable is sent as announce with
+ * id TELEMETRY_MAX_VARS every time. Frames must be decoded in order, after a lost
+ * frame decoder refuses further frames until encoder is reset.
+ */
+
+class TelemetryEncoder
+{
+public:
+    TelemetryEncoder();
+
+    size_t encode(const VAR_CHANGE *, size_t, unsigned long, uint8_t *, size_t);
+    void reset();
+
+private:
+    const char *_names[TELEMETRY_MAX_VARS]; // matched by pointer, store keeps names at fixed address
+    VarStruct _values[TELEMETRY_MAX_VARS];  // last sent values
+    size_t _count;
+    unsigned long _seq;
+    bool _reset;
+
+    int _find(const char *);
+};
+
+typedef void (*TelemetryFunction)(void *, const char *, const VarStruct &);
+
+class TelemetryDecoder
+{
+public:
+    TelemetryDecoder();
+
+    bool decode(const uint8_t *, size_t, TelemetryFunction, void *);
+    bool isSynced();
+
+    unsigned long cycleNum;
+
+private:
+    char _names[TELEMETRY_MAX_VARS][TELEMETRY_MAX_NAME_LEN];
+    VarStruct _values[TELEMETRY_MAX_VARS];
+    size_t _count;
+    unsigned long _seq;
+    bool _synced;
+
+    bool _validate(BinaryReader *, size_t);
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include <limits.h>
 
 #include "../keycompare/keycompare.h"
+#include "../keycreate/keycreate.h"
 #include "timers.h"
 
 std::map<const char *, TIMER_SLOT, KeyCompare> Timers::_timerMap;
@@ -57,11 +58,27 @@ bool Timers::validateTimer(const char *timerName, unsigned long timeout)
     }
     else
     {
-        _timerMap[timerName] = {getTime(), false};
+        // name can point into definition or compiled expression, which may not live as long as timer
+        KeyCreate keyCreator;
+        _timerMap[keyCreator.createKey(timerName)] = {getTime(), false};
         return false;
     }
 }
 
+/**
+ * Time left until armed timer elapses
+ * @return milliseconds, 0 if timer is not armed or has already elapsed
+ */
+unsigned long Timers::remaining(const char *timerName, unsigned long timeout)
+{
+    std::map<const char *, TIMER_SLOT, KeyCompare>::iterator it = _timerMap.find(timerName);
+    if (it == _timerMap.end() || it->second.isElapsed)
+        return 0;
+
+    unsigned long passed = elapsed(it->second.startTime);
+    return passed >= timeout ? 0 : timeout - passed;
+}
+
 unsigned long Timers::elapsed(unsigned long startTime)
 {
     return diff(startTime, getTime());
@@ -73,3 +90,48 @@ unsigned long Timers::diff(unsigned long start, unsigned long end)
     // if end < start it means we had overflow
     return end >= start ? end - start : ULONG_MAX - start + 1 + end;
 }
+
+/**
+ * Write armed timers to snapshot. Time is stored relative to current time,
+ * so timers can be restored after ticks counter restarts
+ */
+void Timers::writeSnapshot(BinaryWriter *writer)
+{
+    writer->writeVarUInt(_timerMap.size());
+    for (std::map<const char *, TIMER_SLOT, KeyCompare>::iterator it = _timerMap.begin(); it != _timerMap.end(); ++it)
+    {
+        writer->writeString(it->first);
+        writer->writeVarUInt(elapsed(it->second.startTime));
+        writer->writeByte(it->second.isElapsed);
+    }
+}
+
+/**
+ * Restore timers from snapshot
+ * @return false if snapshot data is malformed
+ */
+bool Timers::readSnapshot(BinaryReader *reader)
+{
+    char name[MAX_BINARY_STRING_LEN];
+    KeyCreate keyCreator;
+    unsigned long count = reader->readVarUInt();
+    unsigned long now = getTime();
+
+    for (unsigned long i = 0; i < count && !reader->failed(); i++)
+    {
+        if (!reader->readString(name, MAX_BINARY_STRING_LEN))
+            return false;
+        unsigned long elapsedTime = reader->readVarUInt();
+        bool isElapsed = reader->readByte();
+        if (reader->failed())
+            return false;
+
+        TIMER_SLOT slot = {now - elapsedTime, isElapsed};
+        if (_timerMap.count(name))
+            _timerMap[name] = slot;
+        else
+            _timerMap[keyCreator.createKey(name)] = slot;
+    }
+
+    return !reader->failed();
+}
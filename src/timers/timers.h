@@ -3,6 +3,7 @@
 
 #include <map>
 #include "../keycompare/keycompare.h"
+#include "../binary/binary.h"
 
 typedef struct timer_slot
 {
@@ -21,9 +22,13 @@ public:
     GetTimeFunction _getTimeCallback;
     unsigned long getTime();
     bool validateTimer(const char *, unsigned long);
+    unsigned long remaining(const char *, unsigned long);
 
     unsigned long diff(unsigned long, unsigned long);
     unsigned long elapsed(unsigned long);
+
+    void writeSnapshot(BinaryWriter *);
+    bool readSnapshot(BinaryReader *);
 };
 
 #endif
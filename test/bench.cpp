@@ -0,0 +1,136 @@
+#include <ArduinoJson.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/StateMachine.cpp"
+
+#define BENCH_FIELDS 1000
+#define BENCH_ROUNDS 100
+#define BENCH_ACTIONS 100
+
+unsigned long getTime()
+{
+  return 0;
+}
+
+class CountingHooks : public Hooks
+{
+public:
+  unsigned long calls = 0;
+
+  void onVarUpdate(const char *name, VarStruct *value)
+  {
+    calls++;
+  }
+  void onVarsUpdate(const VAR_CHANGE *changes, size_t count, unsigned long cycleNum)
+  {
+    calls++;
+  }
+};
+
+long int benchSum = 0;
+
+void benchAction(ActionContext *ctx)
+{
+  for (size_t i = 0; i < ctx->getCount(); i++)
+    benchSum += ctx->getParamInt(i);
+}
+
+double elapsedUs(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+  std::string payload = "{";
+  for (int i = 0; i < BENCH_FIELDS; i++)
+  {
+    if (i)
+      payload += ",";
+    payload += "\"sensor-" + std::to_string(i) + "\":" + std::to_string(i * 7 % 1000);
+  }
+  payload += "}";
+
+  DynamicJsonDocument doc(payload.size() * SET_VARS_SPACE_FACTOR);
+  deserializeJson(doc, payload);
+  JsonObject values = doc.as<JsonObject>();
+
+  // loop of setVar calls
+
+  CountingHooks loopHooks;
+  StateMachineController loopSm = StateMachineController("bench", NULL, getTime);
+  loopSm.setHooks(&loopHooks);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+    for (JsonObject::iterator it = values.begin(); it != values.end(); ++it)
+      loopSm.setVar(it->key().c_str(), VarStruct(it->value().as<long int>() + round));
+  double loopUs = elapsedUs(start) / BENCH_ROUNDS;
+
+  // bulk setVars on parsed object
+
+  CountingHooks bulkHooks;
+  StateMachineController bulkSm = StateMachineController("bench", NULL, getTime);
+  bulkSm.setHooks(&bulkHooks);
+
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+  {
+    values[values.begin()->key().c_str()] = round; // make sure there is a change every round
+    bulkSm.setVars(values);
+  }
+  double bulkUs = elapsedUs(start) / BENCH_ROUNDS;
+
+  // bulk setVars including payload parsing
+
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+    bulkSm.setVars(payload.c_str(), payload.size());
+  double parseUs = elapsedUs(start) / BENCH_ROUNDS;
+
+  // action invocation, parameters evaluated from definition and compiled at load
+
+  std::string actions = "{\"b\": [";
+  for (int i = 0; i < BENCH_ACTIONS; i++)
+  {
+    if (i)
+      actions += ",";
+    actions += i % 2 ? "{\"bench\": [5, \"sensor-" + std::to_string(i) + "\", \"level * 2\", {\"sum\": [\"level\", 1]}]}"
+                     : "{\":=\": [\"out-" + std::to_string(i) + "\", 7]}";
+  }
+  actions += "]}";
+
+  DynamicJsonDocument actionsDoc(actions.size() * 4);
+  deserializeJson(actionsDoc, actions);
+
+  StateMachineController actionSm = StateMachineController("bench", NULL, getTime);
+  actionSm.registerAction("bench", benchAction);
+  actionSm.setDefinition(&actionsDoc);
+  actionSm.setVars(values);
+  actionSm.setVar("level", 3l);
+  JsonVariant list = actionsDoc["b"];
+
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+    actionSm._runActions(list);
+  double definitionUs = elapsedUs(start) / BENCH_ROUNDS;
+  long int definitionSum = benchSum;
+
+  benchSum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+    actionSm._runActions(list, 0, actionSm._beforeActions);
+  double compiledUs = elapsedUs(start) / BENCH_ROUNDS;
+
+  std::cout << "Ingest " << BENCH_FIELDS << " fields (avg of " << BENCH_ROUNDS << " rounds)\n";
+  std::cout << "  setVar loop:            " << loopUs << " us, hook calls: " << loopHooks.calls / BENCH_ROUNDS << "\n";
+  std::cout << "  setVars(JsonObject):    " << bulkUs << " us, hook calls: " << bulkHooks.calls / BENCH_ROUNDS << "\n";
+  std::cout << "  setVars(payload):       " << parseUs << " us\n";
+  std::cout << "Run " << BENCH_ACTIONS << " actions (avg of " << BENCH_ROUNDS << " rounds)\n";
+  std::cout << "  definition parameters:  " << definitionUs << " us\n";
+  std::cout << "  compiled parameters:    " << compiledUs << " us, same results: " << (definitionSum == benchSum ? "yes" : "no") << "\n";
+
+  return 0;
+}
@@ -8,6 +8,8 @@
 // #define SM_DEBUGGER
 
 #include "../src/StateMachine.cpp"
+#include "../src/analyzer/analyzer.h"
+#include "../src/loader/loader.h"
 
 StaticJsonDocument<1024> _doc;
 char _jsonBuff[1024];
@@ -582,6 +584,60 @@ TEST(StateMachine, evalCondition_elapsed)
   ASSERT_TRUE(sm.compute.evalCondition(cond2));
 }
 
+TEST(StateMachine, evalFilters)
+{
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+
+  JsonVariant filters = makeVariant(
+      "[{\"ema\":[\"f1\", \"in\", 0.5]},{\"lowpass\":[\"f2\", \"in\", 100]},{\"debounce\":[\"f3\", \"in\", 50]},{\"hysteresis\":[\"f4\", \"in\", 20, 10]}]");
+
+  JsonVariant ema = filters[0];
+  JsonVariant lowpass = filters[1];
+  JsonVariant debounce = filters[2];
+  JsonVariant hysteresis = filters[3];
+
+  // first sample initializes filter
+  _time = 0;
+  sm.setVar("in", 10l);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(ema).vFloat, 10.0f);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(lowpass).vFloat, 10.0f);
+
+  sm.setVar("in", 20l);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(ema).vFloat, 15.0f);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(ema).vFloat, 17.5f);
+
+  // no time passed, low-pass output should not move
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(lowpass).vFloat, 10.0f);
+  _time = 100;
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(lowpass).vFloat, 15.0f);
+
+  // debounce: output changes only when input is stable for 50ms
+  _time = 0;
+  sm.setVar("in", 0l);
+  ASSERT_FALSE(sm.compute.evalCondition(debounce));
+  sm.setVar("in", 1l);
+  ASSERT_FALSE(sm.compute.evalCondition(debounce));
+  _time = 49;
+  ASSERT_FALSE(sm.compute.evalCondition(debounce));
+  sm.setVar("in", 0l);
+  ASSERT_FALSE(sm.compute.evalCondition(debounce));
+  sm.setVar("in", 1l);
+  _time = 60;
+  ASSERT_FALSE(sm.compute.evalCondition(debounce));
+  _time = 110;
+  ASSERT_TRUE(sm.compute.evalCondition(debounce));
+
+  // hysteresis: on above 20, off below 10
+  sm.setVar("in", 15l);
+  ASSERT_FALSE(sm.compute.evalCondition(hysteresis));
+  sm.setVar("in", 21l);
+  ASSERT_TRUE(sm.compute.evalCondition(hysteresis));
+  sm.setVar("in", 15l);
+  ASSERT_TRUE(sm.compute.evalCondition(hysteresis));
+  sm.setVar("in", 9l);
+  ASSERT_FALSE(sm.compute.evalCondition(hysteresis));
+}
+
 void sm_init_action(ActionContext *ctx) { ctx->compute->store.setVar("init", 1); }
 void sm_before_action(ActionContext *ctx) { ctx->compute->store.setVar("before", 1); }
 void sm_after_action(ActionContext *ctx) { ctx->compute->store.setVar("after", 1); }
@@ -687,6 +743,1582 @@ TEST(StateMachine, lifeCycle)
   ASSERT_EQ(sm.getVarInt("var1"), 77 + 42);
 }
 
+int snapshotInitCount = 0;
+void snapshot_init_action(ActionContext *ctx) { snapshotInitCount++; }
+
+TEST(StateMachine, snapshotRestore)
+{
+  const char *testSMJson = "{\
+   \"i\":[\"init_action\"],\
+   \"s\":{\
+    \"sm1\": {\
+      \"i\": \"state1\",\
+      \"a\": [\"init_action\"],\
+      \"s\": {\
+        \"state1\": {\"r\": [{\"i\": {\"gt\": [\"var1\", 0]}, \"t\": \"state2\"}]},\
+        \"state2\": {\"r\": [{\"i\": {\"elapsed\": [\"snap-timer\", 100]}, \"t\": \"state1\"}]}\
+      }\
+    },\
+    \"dwell\": {\
+      \"i\": \"wait\",\
+      \"s\": {\"wait\": {\"r\": [{\"i\": {\"in_state\": 300}, \"t\": \"done\"}]}, \"done\": {}}\
+    }\
+   }\
+  }";
+
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, testSMJson);
+
+  _time = 1000;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(&doc);
+  sm.registerAction("init_action", snapshot_init_action);
+  snapshotInitCount = 0;
+  sm.init();
+  ASSERT_EQ(snapshotInitCount, 2);
+
+  sm.setVar("var1", 42l);
+  sm.setVar("var2", 3.5f);
+  sm.compute.setVar("ext.var3", -7l, false);
+  sm.cycle(); // -> state2
+  _time = 1200;
+  sm.cycle(); // arms timer
+  ASSERT_STREQ(sm._stateMachines[0].state, "state2");
+  ASSERT_STREQ(sm._findStateMachine("dwell")->state, "wait");
+
+  uint8_t buffer[512];
+  size_t size = sm.snapshotSize();
+  ASSERT_GT(size, 0u);
+  ASSERT_EQ(sm.snapshot(buffer, size - 1), 0u);
+  ASSERT_EQ(sm.snapshot(buffer, sizeof(buffer)), size);
+
+  // restore into a fresh controller after "restart", timer and time in state should keep elapsed time
+  _time = 50;
+  StateMachineController sm2 = StateMachineController("sm", NULL, getTime);
+  sm2.setDefinition(&doc);
+  sm2.registerAction("init_action", snapshot_init_action);
+  ASSERT_TRUE(sm2.restore(buffer, size));
+
+  ASSERT_EQ(snapshotInitCount, 2);
+  ASSERT_EQ(sm2.cycleNum, 2ul);
+  ASSERT_STREQ(sm2._stateMachines[0].state, "state2");
+  ASSERT_EQ(sm2.getVarInt("var1"), 42);
+  ASSERT_FLOAT_EQ(sm2.getVarFloat("var2"), 3.5f);
+  ASSERT_EQ(sm2.compute.getVarInt("ext.var3"), -7);
+
+  _time = 149;
+  sm2.cycle();
+  ASSERT_STREQ(sm2._stateMachines[0].state, "state2");
+  ASSERT_STREQ(sm2._findStateMachine("dwell")->state, "wait");
+  _time = 150;
+  sm2.cycle();
+  ASSERT_STREQ(sm2._stateMachines[0].state, "state1");
+  ASSERT_STREQ(sm2._findStateMachine("dwell")->state, "done");
+
+  // corrupted snapshot is rejected
+  buffer[size / 2] ^= 0xff;
+  ASSERT_FALSE(sm2.restore(buffer, size));
+  ASSERT_FALSE(sm2.restore(buffer, 4));
+}
+
+class MemoryJournalStorage : public JournalStorage
+{
+public:
+  std::vector<uint8_t> files[3];
+  unsigned long syncs = 0;
+
+  size_t read(uint8_t file, size_t offset, uint8_t *buffer, size_t size)
+  {
+    if (offset >= files[file].size())
+      return 0;
+    size = std::min(size, files[file].size() - offset);
+    memcpy(buffer, files[file].data() + offset, size);
+    return size;
+  }
+  bool append(uint8_t file, const uint8_t *data, size_t size)
+  {
+    files[file].insert(files[file].end(), data, data + size);
+    return true;
+  }
+  bool sync(uint8_t file)
+  {
+    syncs++;
+    return true;
+  }
+  bool truncate(uint8_t file)
+  {
+    files[file].clear();
+    return true;
+  }
+};
+
+TEST(StateMachine, journal)
+{
+  MemoryJournalStorage storage;
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setJournal(&storage);
+  sm.setPersistent("counter");
+  sm.setPersistent("runtime");
+
+  // writes within a cycle are coalesced into a single record and a single sync
+  for (long i = 1; i <= 5; i++)
+    sm.setVar("counter", i);
+  sm.setVar("runtime", 1.5f);
+  sm.setVar("volatile", 42l);
+  sm.cycle();
+  ASSERT_EQ(storage.syncs, 1ul);
+
+  // nothing changed => no sync
+  sm.cycle();
+  ASSERT_EQ(storage.syncs, 1ul);
+
+  StateMachineController sm2 = StateMachineController("sm", NULL, getTime);
+  sm2.setJournal(&storage);
+  ASSERT_EQ(sm2.getVarInt("counter"), 5);
+  ASSERT_FLOAT_EQ(sm2.getVarFloat("runtime"), 1.5f);
+  ASSERT_EQ(sm2.getVarInt("volatile", -1), -1);
+
+  // long log gets compacted into snapshot
+  for (long i = 0; i < 1000; i++)
+  {
+    sm2.setVar("counter", i);
+    sm2.cycle();
+  }
+  ASSERT_LT(storage.files[JOURNAL_FILE_LOG].size(), (size_t)JOURNAL_COMPACT_SIZE);
+  ASSERT_FALSE(storage.files[JOURNAL_FILE_SNAPSHOT_A].empty());
+
+  // torn write at the end of log is ignored
+  storage.files[JOURNAL_FILE_LOG].push_back(42);
+  storage.files[JOURNAL_FILE_LOG].push_back(1);
+
+  StateMachineController sm3 = StateMachineController("sm", NULL, getTime);
+  sm3.setJournal(&storage);
+  ASSERT_EQ(sm3.getVarInt("counter"), 999);
+  ASSERT_FLOAT_EQ(sm3.getVarFloat("runtime"), 1.5f);
+
+  // replay made variables persistent again
+  sm3.setVar("counter", 1000l);
+  sm3.cycle();
+
+  StateMachineController sm4 = StateMachineController("sm", NULL, getTime);
+  sm4.setJournal(&storage);
+  ASSERT_EQ(sm4.getVarInt("counter"), 1000);
+
+  // records around the largest payload: written whole or rejected, never garbled
+  MemoryJournalStorage longStorage;
+  StateMachineController sm5 = StateMachineController("sm", NULL, getTime);
+  sm5.setJournal(&longStorage);
+  for (int len = 240; len <= 260; len++)
+  {
+    std::string name(len, 'n');
+    sm5.setVar(name.c_str(), (long int)len, false);
+    sm5.setPersistent(name.c_str());
+    sm5.setVar(name.c_str(), (long int)len + 1, false);
+  }
+  sm5.setPersistent("short");
+  sm5.setVar("short", 7l);
+  ASSERT_FALSE(sm5.compute.store.commitJournal());
+  ASSERT_GT(sm5.compute.store.getJournal()->rejected, 0ul);
+
+  StateMachineController sm6 = StateMachineController("sm", NULL, getTime);
+  sm6.setJournal(&longStorage);
+  unsigned long restored = 0;
+  for (int len = 240; len <= 260; len++)
+  {
+    long int value = sm6.getVarInt(std::string(len, 'n').c_str(), -1);
+    ASSERT_TRUE(value == -1 || value == len + 1) << len;
+    restored += value != -1;
+  }
+  ASSERT_GE(restored, 7ul); // names up to 246 characters fit
+  ASSERT_EQ(restored + sm5.compute.store.getJournal()->rejected, 21ul);
+  ASSERT_EQ(sm6.getVarInt("short"), 7);
+}
+
+class ChangeSetHooks : public Hooks
+{
+public:
+  int singleUpdates = 0;
+  int batches = 0;
+  std::map<std::string, VAR_CHANGE> changes;
+
+  void onVarUpdate(const char *name, VarStruct *value)
+  {
+    singleUpdates++;
+  }
+  void onVarsUpdate(const VAR_CHANGE *list, size_t count, unsigned long cycleNum)
+  {
+    batches++;
+    changes.clear();
+    for (size_t i = 0; i < count; i++)
+      changes[list[i].name] = list[i];
+  }
+};
+
+class UpdateHooks : public Hooks
+{
+public:
+  std::vector<std::string> names;
+
+  void onVarUpdate(const char *name, VarStruct *value)
+  {
+    names.push_back(name);
+  }
+};
+
+TEST(StateMachine, changeSet)
+{
+  ChangeSetHooks hooks;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setHooks(&hooks);
+  sm.setChangeTracking(true);
+
+  sm.setVar("a", 1l);
+  sm.setVar("b", 2.5f);
+  sm.cycle();
+  ASSERT_EQ(hooks.batches, 1);
+  ASSERT_EQ(hooks.singleUpdates, 0);
+  ASSERT_EQ(hooks.changes.size(), 2ul);
+  ASSERT_TRUE(hooks.changes["sm.a"].created);
+  ASSERT_FLOAT_EQ(hooks.changes["sm.b"].value->vFloat, 2.5f);
+
+  // writes are coalesced, previous value is taken before the first write
+  for (long i = 2; i <= 10; i++)
+    sm.setVar("a", i);
+  sm.setVar("b", 3.0f);
+  sm.setVar("b", 2.5f);
+  sm.cycle();
+  ASSERT_EQ(hooks.batches, 2);
+  ASSERT_EQ(hooks.changes.size(), 1ul);
+  ASSERT_FALSE(hooks.changes["sm.a"].created);
+  ASSERT_EQ(hooks.changes["sm.a"].previous.vInt, 1);
+  ASSERT_EQ(hooks.changes["sm.a"].value->vInt, 10);
+
+  // no changes => no batch
+  sm.setVar("a", 10l);
+  sm.cycle();
+  ASSERT_EQ(hooks.batches, 2);
+
+  sm.setChangeTracking(false);
+  sm.setVar("a", 11l);
+  sm.cycle();
+  ASSERT_EQ(hooks.batches, 2);
+  ASSERT_EQ(hooks.singleUpdates, 1);
+}
+
+class TelemetryHooks : public Hooks
+{
+public:
+  TelemetryEncoder encoder;
+  uint8_t frame[128];
+  size_t frameSize = 0;
+
+  void onVarsUpdate(const VAR_CHANGE *changes, size_t count, unsigned long cycleNum)
+  {
+    frameSize = encoder.encode(changes, count, cycleNum, frame, sizeof(frame));
+  }
+};
+
+void collectTelemetry(void *context, const char *name, const VarStruct &value)
+{
+  (*(std::map<std::string, VarStruct> *)context)[name] = value;
+}
+
+TEST(StateMachine, telemetry)
+{
+  TelemetryHooks hooks;
+  TelemetryDecoder decoder;
+  std::map<std::string, VarStruct> received;
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setHooks(&hooks);
+  sm.setChangeTracking(true);
+
+  sm.setVar("counter", 1000l);
+  sm.setVar("temperature", 21.5f);
+  sm.cycle();
+  size_t announceSize = hooks.frameSize;
+  ASSERT_TRUE(decoder.decode(hooks.frame, hooks.frameSize, collectTelemetry, &received));
+  ASSERT_EQ(decoder.cycleNum, 1ul);
+  ASSERT_EQ(received["sm.counter"].vInt, 1000);
+  ASSERT_FLOAT_EQ(received["sm.temperature"].vFloat, 21.5f);
+
+  // later frames carry ids and deltas only
+  received.clear();
+  sm.setVar("counter", 1003l);
+  sm.cycle();
+  ASSERT_LT(hooks.frameSize, announceSize / 4);
+  ASSERT_TRUE(decoder.decode(hooks.frame, hooks.frameSize, collectTelemetry, &received));
+  ASSERT_EQ(received.size(), 1ul);
+  ASSERT_EQ(received["sm.counter"].vInt, 1003);
+
+  sm.setVar("counter", -5l);
+  sm.setVar("temperature", 22.0f);
+  sm.cycle();
+  ASSERT_TRUE(decoder.decode(hooks.frame, hooks.frameSize, collectTelemetry, &received));
+  ASSERT_EQ(received["sm.counter"].vInt, -5);
+  ASSERT_FLOAT_EQ(received["sm.temperature"].vFloat, 22.0f);
+
+  // too small buffer does not change encoder state
+  VAR_CHANGE change = {"x", sm.compute.store.getVar("counter"), VarStruct(), false};
+  uint8_t small[2];
+  ASSERT_EQ(hooks.encoder.encode(&change, 1, 9, small, sizeof(small)), 0ul);
+
+  // lost frame is detected, reset resynchronizes
+  sm.setVar("counter", 7l);
+  sm.cycle();
+  sm.setVar("counter", 8l);
+  sm.cycle();
+  ASSERT_FALSE(decoder.decode(hooks.frame, hooks.frameSize, collectTelemetry, &received));
+  ASSERT_FALSE(decoder.isSynced());
+
+  hooks.encoder.reset();
+  sm.setVar("counter", 9l);
+  sm.cycle();
+  ASSERT_TRUE(decoder.decode(hooks.frame, hooks.frameSize, collectTelemetry, &received));
+  ASSERT_EQ(received["sm.counter"].vInt, 9);
+
+  // truncated frame is rejected as a whole, entries before the damage are not reported
+  received.clear();
+  unsigned long cycleNum = decoder.cycleNum;
+  sm.setVar("counter", 10l);
+  sm.setVar("temperature", 23.0f);
+  sm.cycle();
+  ASSERT_FALSE(decoder.decode(hooks.frame, hooks.frameSize - 1, collectTelemetry, &received));
+  ASSERT_TRUE(received.empty());
+  ASSERT_EQ(decoder.cycleNum, cycleNum);
+  ASSERT_FALSE(decoder.isSynced());
+}
+
+TEST(StateMachine, globalMemory)
+{
+  ChangeSetHooks hooks;
+  StaticJsonDocument<1024> globals;
+  deserializeJson(globals, "{\"srv.limit\": 10, \"srv.gain\": 1.5, \"srv.name\": \"x\"}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setHooks(&hooks);
+  sm.setChangeTracking(true);
+  sm.attachGlobalMemory(&globals);
+
+  ASSERT_EQ(sm.getVarInt("srv.limit"), 10);
+  ASSERT_FLOAT_EQ(sm.getVarFloat("srv.gain"), 1.5f);
+  ASSERT_EQ(sm.compute.store.getVar("srv.name"), nullptr);
+  ASSERT_TRUE(sm.compute.evalCondition(makeVariant("{\"gt\": [\"srv.limit\", 5]}")));
+
+  // local variables shadow globals
+  sm.setVar("srv.limit", 3l, false);
+  ASSERT_EQ(sm.getVarInt("srv.limit"), 3);
+  sm.cycle();
+
+  deserializeJson(globals, "{\"srv.limit\": 10, \"srv.gain\": 2.5, \"srv.extra\": 1}");
+  ASSERT_EQ(sm.refreshGlobalMemory(), 2ul);
+  sm.cycle();
+  ASSERT_EQ(hooks.changes.size(), 2ul);
+  ASSERT_FLOAT_EQ(hooks.changes["srv.gain"].previous.vFloat, 1.5f);
+  ASSERT_TRUE(hooks.changes["srv.extra"].created);
+  ASSERT_FLOAT_EQ(sm.getVarFloat("srv.gain"), 2.5f);
+
+  // globals missing from a smaller document are removed, until they appear again
+  ASSERT_TRUE(sm.compute.evalCondition(makeVariant("{\"gt\": [\"srv.extra\", 0]}")));
+  deserializeJson(globals, "{\"srv.gain\": 2.5}");
+  ASSERT_EQ(sm.refreshGlobalMemory(), 2ul);
+  sm.cycle();
+  ASSERT_EQ(hooks.changes.size(), 2ul);
+  ASSERT_TRUE(hooks.changes["srv.extra"].removed);
+  ASSERT_TRUE(hooks.changes["srv.limit"].removed);
+  ASSERT_EQ(sm.compute.store.getVar("srv.extra"), nullptr);
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"gt\": [\"srv.extra\", 0]}")));
+  ASSERT_EQ(sm.getVarInt("srv.limit"), 3); // local is still there
+  ASSERT_EQ(sm.refreshGlobalMemory(), 0ul);
+
+  deserializeJson(globals, "{\"srv.gain\": 2.5, \"srv.extra\": 1}");
+  ASSERT_EQ(sm.refreshGlobalMemory(), 1ul);
+  sm.cycle();
+  ASSERT_TRUE(hooks.changes["srv.extra"].created);
+  ASSERT_FALSE(hooks.changes["srv.extra"].removed);
+  ASSERT_EQ(sm.getVarInt("srv.extra"), 1);
+}
+
+TEST(StateMachine, setVars)
+{
+  ChangeSetHooks hooks;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setHooks(&hooks);
+
+  const char *json = "{\"a\": 1, \"b\": 2.5, \"c\": true, \"d\": \"text\"}";
+  ASSERT_EQ(sm.setVars(json, strlen(json)), 3ul);
+  ASSERT_EQ(sm.getVarInt("a"), 1);
+  ASSERT_FLOAT_EQ(sm.getVarFloat("sm.b"), 2.5f);
+  ASSERT_EQ(sm.getVarInt("c"), 1);
+  ASSERT_EQ(hooks.batches, 1);
+  ASSERT_EQ(hooks.singleUpdates, 0);
+  ASSERT_EQ(hooks.changes.size(), 3ul);
+
+  // unchanged values are not reported
+  json = "{\"a\": 1, \"b\": 3.5}";
+  ASSERT_EQ(sm.setVars(json, strlen(json)), 2ul);
+  ASSERT_EQ(hooks.batches, 2);
+  ASSERT_EQ(hooks.changes.size(), 1ul);
+  ASSERT_FLOAT_EQ(hooks.changes["sm.b"].previous.vFloat, 2.5f);
+
+  // explicit scope, MessagePack payload {"a": 5, "b": 1.5}
+  const char msgpack[] = {(char)0x82, (char)0xa1, 'a', 0x05, (char)0xa1, 'b', (char)0xca, 0x3f, (char)0xc0, 0x00, 0x00};
+  ASSERT_EQ(sm.setVars(msgpack, sizeof(msgpack), "zone"), 2ul);
+  ASSERT_EQ(sm.getVarInt("zone.a"), 5);
+  ASSERT_FLOAT_EQ(sm.getVarFloat("zone.b"), 1.5f);
+  ASSERT_EQ(sm.getVarInt("a"), 1);
+
+  // initial document does not fit two slots with keys of MessagePack payload, it grows up to a size fitting any payload
+  ASSERT_LT(sizeof(msgpack) * SET_VARS_SPACE_FACTOR, JSON_OBJECT_SIZE(2) + 4);
+  ASSERT_GE(Store::maxPayloadCapacity(sizeof(msgpack)), JSON_OBJECT_SIZE(2) + 4);
+
+  ASSERT_EQ(sm.setVars("{\"a\": ", 6), 0ul);
+
+  // with change tracking values end up in the cycle change set
+  sm.setChangeTracking(true);
+  json = "{\"a\": 2}";
+  sm.setVars(json, strlen(json), "");
+  ASSERT_EQ(hooks.batches, 3);
+  sm.cycle();
+  ASSERT_EQ(hooks.batches, 4);
+  ASSERT_TRUE(hooks.changes["a"].created);
+
+  // hooks handling single updates only get bulk writes and global refreshes one by one
+  UpdateHooks updates;
+  sm.setChangeTracking(false);
+  sm.setHooks(&updates);
+  json = "{\"a\": 3, \"b\": 3.5, \"e\": 1}";
+  sm.setVars(json, strlen(json));
+  ASSERT_EQ(updates.names.size(), 2ul);
+  ASSERT_EQ(updates.names[0], "sm.a");
+  ASSERT_EQ(updates.names[1], "sm.e");
+
+  StaticJsonDocument<256> globals;
+  deserializeJson(globals, "{\"srv.limit\": 10}");
+  sm.attachGlobalMemory(&globals);
+  ASSERT_EQ(updates.names.size(), 3ul);
+  ASSERT_EQ(updates.names[2], "srv.limit");
+}
+
+void collectNames(void *context, const char *name, VarStruct *value)
+{
+  ((std::vector<std::string> *)context)->push_back(name);
+}
+
+TEST(StateMachine, patternAggregates)
+{
+  ASSERT_TRUE(Store::matchPattern("*.temp", "garage.TEMP"));
+  ASSERT_TRUE(Store::matchPattern("zone3.*.power", "zone3.heater.power"));
+  ASSERT_TRUE(Store::matchPattern("a?c*", "abc"));
+  ASSERT_FALSE(Store::matchPattern("zone3.*.power", "zone3.heater.powerx"));
+  ASSERT_FALSE(Store::matchPattern("*.temp", "temp"));
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setVar("garage.temp", 18l, false);
+  sm.setVar("Kitchen.temp", 22.5f, false);
+  sm.setVar("zone3.heater.power", 100l, false);
+  sm.setVar("zone3.fan.power", 20l, false);
+  sm.setVar("zone4.fan.power", 1000l, false);
+
+  std::vector<std::string> names;
+  sm.compute.store.forEachPrefix("ZONE3.", collectNames, &names);
+  ASSERT_EQ(names.size(), 2ul);
+  ASSERT_EQ(names[0], "zone3.fan.power");
+
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(makeVariant("{\"max\": \"*.temp\"}")).vFloat, 22.5f);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"sum\": \"zone3.*.power\"}")).vInt, 120);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"min\": [\"*.temp\", 10]}")).vInt, 10);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"count\": \"*.power\"}")).vInt, 3);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(makeVariant("{\"avg\": \"zone3.*.power\"}")).vFloat, 60.0f);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"sum\": \"none.*\"}")).vInt, 0);
+
+  // match set follows newly created variables
+  sm.setVar("zone3.pump.power", 30l, false);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"sum\": \"zone3.*.power\"}")).vInt, 150);
+  ASSERT_EQ(sm.compute.store.query("zone3.*.power")->vars.size(), 3ul);
+
+  // local variables are stored with device scope ("sm.zone5.heater.power")
+  sm.setVar("zone5.heater.power", 7l);
+  sm.setVar("zone5.fan.power", 3l);
+  sm.setVar("zone5.pump.power", 5l, false);
+  names.clear();
+  sm.compute.store.forEachPrefix("zone5.", collectNames, &names);
+  ASSERT_EQ(names.size(), 3ul);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"sum\": \"zone5.*.power\"}")).vInt, 15);
+  sm.setVar("zone5.valve.power", 1l);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"sum\": \"zone5.*.power\"}")).vInt, 16);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"count\": \"*.power\"}")).vInt, 8);
+}
+
+TEST(StateMachine, edgeConditions)
+{
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setVar("door", 0l);
+  sm.setVar("level", 5.0f);
+  sm.cycle();
+
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"changed\": \"door\"}")));
+
+  unsigned long version = sm.compute.store.getVersion(sm.compute.store.getSlot("door"));
+  sm.setVar("door", 1l);
+  sm.setVar("level", 4.0f);
+  sm.setVar("level", 3.0f);
+  ASSERT_GT(sm.compute.store.getVersion(sm.compute.store.getSlot("door")), version);
+  ASSERT_TRUE(sm.compute.evalCondition(makeVariant("{\"changed\": \"door\"}")));
+  ASSERT_TRUE(sm.compute.evalCondition(makeVariant("{\"rising\": [\"door\"]}")));
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"falling\": \"door\"}")));
+  ASSERT_TRUE(sm.compute.evalCondition(makeVariant("{\"falling\": \"level\"}")));
+  ASSERT_FLOAT_EQ(sm.compute.store.getPrevious(sm.compute.store.getSlot("level")).vFloat, 5.0f);
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"changed\": \"unknown\"}")));
+
+  // edges are seen for one cycle only
+  sm.cycle();
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"rising\": \"door\"}")));
+
+  // writing the same value is not a change
+  sm.setVar("door", 1l);
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"changed\": \"door\"}")));
+}
+
+TEST(StateMachine, edgesAcrossMachines)
+{
+  // writer "b" copies "go" to "flag", readers wait for rising "flag", in both run orders
+
+  const char *definitions[] = {
+      "{\"s\": {"
+      "\"a\": {\"o\": 2, \"i\": \"idle\", \"s\": {\"idle\": {\"r\": [{\"i\": {\"rising\": \"flag\"}, \"t\": \"up\"}]}, \"up\": {}}},"
+      "\"b\": {\"o\": 1, \"b\": [{\":=\": [\"flag\", \"go\"]}]},"
+      "\"c\": {\"p\": 100, \"i\": \"idle\", \"s\": {\"idle\": {\"r\": [{\"i\": {\"rising\": \"flag\"}, \"t\": \"up\"}]}, \"up\": {}}}"
+      "}}",
+      "{\"s\": {"
+      "\"a\": {\"o\": 1, \"i\": \"idle\", \"s\": {\"idle\": {\"r\": [{\"i\": {\"rising\": \"flag\"}, \"t\": \"up\"}]}, \"up\": {}}},"
+      "\"b\": {\"o\": 2, \"b\": [{\":=\": [\"flag\", \"go\"]}]},"
+      "\"c\": {\"p\": 100, \"i\": \"idle\", \"s\": {\"idle\": {\"r\": [{\"i\": {\"rising\": \"flag\"}, \"t\": \"up\"}]}, \"up\": {}}}"
+      "}}"};
+
+  for (int i = 0; i < 2; i++)
+  {
+    StaticJsonDocument<2048> doc;
+    deserializeJson(doc, definitions[i]);
+
+    _time = 1000;
+    StateMachineController sm = StateMachineController("sm", NULL, getTime);
+    sm.setVar("go", 0l);
+    sm.setVar("flag", 0l);
+    sm.setDefinition(&doc);
+    sm.init();
+    sm.cycle();
+
+    sm.setVar("go", 1l);
+    _time += 10;
+    sm.cycle();
+    _time += 10;
+    sm.cycle();
+    ASSERT_EQ(sm.getVarInt("flag"), 1);
+    ASSERT_STREQ(sm._findStateMachine("a")->state, "up") << definitions[i];
+    ASSERT_STREQ(sm._findStateMachine("c")->state, "idle");
+
+    // periodic machine sees the edge when it runs next
+
+    _time = 1100;
+    sm.cycle();
+    ASSERT_STREQ(sm._findStateMachine("c")->state, "up") << definitions[i];
+  }
+}
+
+TEST(StateMachine, runToCompletion)
+{
+  StaticJsonDocument<2048> doc;
+  deserializeJson(doc, "{\"s\": {"
+                       "\"chain\": {\"i\": \"validate\", \"c\": true, \"s\": {"
+                       "  \"validate\": {\"r\": [{\"i\": {\"gt\": [\"input\", 0]}, \"t\": \"act\"}]},"
+                       "  \"act\": {\"r\": [{\"i\": true, \"t\": \"done\"}]},"
+                       "  \"done\": {}}},"
+                       "\"loop\": {\"i\": \"a\", \"c\": true, \"s\": {"
+                       "  \"a\": {\"r\": [{\"i\": true, \"t\": \"b\"}]},"
+                       "  \"b\": {\"r\": [{\"i\": true, \"t\": \"a\"}]}}},"
+                       "\"bounded\": {\"i\": \"s0\", \"c\": 2, \"s\": {"
+                       "  \"s0\": {\"r\": [{\"i\": true, \"t\": \"s1\"}]},"
+                       "  \"s1\": {\"r\": [{\"i\": true, \"t\": \"s2\"}]},"
+                       "  \"s2\": {\"r\": [{\"i\": true, \"t\": \"s3\"}]},"
+                       "  \"s3\": {}}},"
+                       "\"plain\": {\"i\": \"s0\", \"s\": {"
+                       "  \"s0\": {\"r\": [{\"i\": true, \"t\": \"s1\"}]},"
+                       "  \"s1\": {\"r\": [{\"i\": true, \"t\": \"s2\"}]},"
+                       "  \"s2\": {}}}"
+                       "}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  ASSERT_EQ(sm._findStateMachine("chain")->maxSteps, (unsigned int)RUN_TO_COMPLETION_STEPS);
+  ASSERT_EQ(sm._findStateMachine("plain")->maxSteps, 1u);
+
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("chain")->state, "validate");
+  ASSERT_STREQ(sm._findStateMachine("loop")->state, "a");
+  ASSERT_STREQ(sm._findStateMachine("bounded")->state, "s2");
+  ASSERT_STREQ(sm._findStateMachine("plain")->state, "s1");
+
+  sm.setVar("input", 1l);
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("chain")->state, "done");
+  ASSERT_STREQ(sm._findStateMachine("bounded")->state, "s3");
+}
+
+unsigned long lastSleep = 0;
+
+void recordSleep(unsigned long ms)
+{
+  lastSleep = ms;
+}
+
+TEST(StateMachine, machinePeriods)
+{
+  StaticJsonDocument<2048> doc;
+  deserializeJson(doc, "{\"s\": {"
+                       "\"slow\": {\"p\": 100, \"b\": [{\":=\": [\"slow-runs\", {\"sum\": [\"slow-runs\", 1]}]}]},"
+                       "\"fast\": {\"p\": 10, \"o\": 5, \"b\": [{\":=\": [\"fast-runs\", {\"sum\": [\"fast-runs\", 1]}]}]}"
+                       "}}");
+
+  _time = 1000;
+  StateMachineController sm = StateMachineController("sm", recordSleep, getTime);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  ASSERT_STREQ(sm._stateMachines[sm._runOrder[0]].name, "fast");
+
+  sm.cycle(); // both due
+  ASSERT_EQ(sm.getVarInt("fast-runs"), 1);
+  ASSERT_EQ(sm.getVarInt("slow-runs"), 1);
+  ASSERT_EQ(lastSleep, 10ul);
+
+  for (int i = 0; i < 9; i++)
+  {
+    _time += 10;
+    sm.cycle();
+  }
+  ASSERT_EQ(sm.getVarInt("fast-runs"), 10);
+  ASSERT_EQ(sm.getVarInt("slow-runs"), 1);
+
+  _time += 7;
+  sm.cycle(); // nothing due
+  ASSERT_EQ(sm.getVarInt("fast-runs"), 10);
+  ASSERT_EQ(lastSleep, 3ul);
+
+  _time += 3;
+  sm.cycle();
+  ASSERT_EQ(sm.getVarInt("fast-runs"), 11);
+  ASSERT_EQ(sm.getVarInt("slow-runs"), 2);
+  _time = 0;
+}
+
+unsigned long workTime = 0;
+unsigned long sleepLateness = 0;
+
+void simulatedWork(ActionContext *ctx)
+{
+  _time += workTime;
+}
+
+void simulatedSleep(unsigned long ms)
+{
+  lastSleep = ms;
+  if (ms == 0)
+    return; // yield
+  _time += ms + sleepLateness;
+}
+
+TEST(StateMachine, fixedRate)
+{
+  StaticJsonDocument<256> doc;
+  deserializeJson(doc, "{\"t\": 100, \"a\": [\"work\"]}");
+
+  _time = 0;
+  workTime = 30;
+  sleepLateness = 0;
+  StateMachineController sm = StateMachineController("sm", simulatedSleep, getTime);
+  sm.registerAction("work", simulatedWork);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  sm.cycle();
+  ASSERT_EQ(_time, 130ul); // work time adds up to timeout
+
+  sm.setFixedRate(true);
+  sm.cycle();
+  ASSERT_EQ(lastSleep, 70ul);
+  sm.cycle();
+  ASSERT_EQ(_time, 330ul);
+
+  // overrun, skips deadlines at 430 and 530
+
+  workTime = 250;
+  sm.cycle();
+  ASSERT_EQ(_time, 630ul);
+  ASSERT_EQ(sm.getCycleStats()->overruns, 1ul);
+  ASSERT_EQ(sm.getCycleStats()->skipped, 2ul);
+
+  // late wake ups are recorded, schedule does not drift
+
+  workTime = 10;
+  sleepLateness = 5;
+  sm.cycle();
+  ASSERT_EQ(_time, 735ul);
+  sm.cycle();
+  ASSERT_EQ(lastSleep, 85ul);
+  ASSERT_EQ(sm.getCycleStats()->maxLateness, 5ul);
+  ASSERT_EQ(sm.getCycleStats()->jitter[0], 3ul);
+  ASSERT_EQ(sm.getCycleStats()->jitter[3], 1ul); // 4-7 ms
+
+  // catch up runs missed cycles without sleep
+
+  sm.resetCycleStats();
+  sm.setFixedRate(true, FIXED_RATE_CATCH_UP);
+  sleepLateness = 0;
+  workTime = 150;
+  sm.cycle(); // starts 835, deadline 930 missed
+  ASSERT_EQ(lastSleep, 0ul);
+  workTime = 10;
+  sm.cycle(); // starts 985 for deadline 930, next at 1030
+  ASSERT_EQ(lastSleep, 35ul);
+  ASSERT_EQ(sm.getCycleStats()->maxLateness, 55ul);
+  ASSERT_EQ(sm.getCycleStats()->overruns, 1ul);
+  ASSERT_EQ(sm.getCycleStats()->skipped, 0ul);
+  _time = 0;
+}
+
+TEST(StateMachine, timerParking)
+{
+  StaticJsonDocument<2048> doc;
+  deserializeJson(doc, "{\"s\": {"
+                       "\"blink\": {\"i\": \"on\", \"s\": {"
+                       "  \"on\": {\"r\": [{\"i\": {\"elapsed\": [\"park-on\", 100]}, \"t\": \"off\"}]},"
+                       "  \"off\": {\"r\": [{\"i\": {\"elapsed\": [\"park-off\", 50]}, \"t\": \"on\"},"
+                       "                  {\"i\": {\"elapsed\": [\"park-long\", 70]}, \"t\": \"on\"}]}}},"
+                       "\"other\": {\"i\": \"wait\", \"s\": {"
+                       "  \"wait\": {\"r\": [{\"i\": {\"elapsed\": [\"park-shared\", 10]}, \"t\": \"done\"}]},"
+                       "  \"check\": {\"r\": [{\"i\": {\"elapsed\": [\"park-shared\", 20]}, \"t\": \"done\"}]},"
+                       "  \"var\": {\"r\": [{\"i\": {\"elapsed\": [\"park-var\", \"timeout\"]}, \"t\": \"done\"}]},"
+                       "  \"done\": {}}}"
+                       "}}");
+
+  _time = 1000;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  STATE_MACHINE_SLOT *blink = sm._findStateMachine("blink");
+  STATE_MACHINE_SLOT *other = sm._findStateMachine("other");
+  ASSERT_TRUE(sm._isTimerState(blink, "on"));
+  ASSERT_TRUE(sm._isTimerState(blink, "off"));
+  ASSERT_FALSE(sm._isTimerState(other, "wait"));
+  ASSERT_FALSE(sm._isTimerState(other, "var"));
+
+  sm.cycle(); // arms timer
+  ASSERT_TRUE(blink->parked);
+  ASSERT_EQ(blink->parkedUntil, 1100ul);
+  ASSERT_FALSE(other->parked);
+
+  _time = 1099;
+  sm.cycle();
+  ASSERT_STREQ(blink->state, "on");
+  ASSERT_TRUE(blink->parked);
+
+  _time = 1100;
+  sm.cycle();
+  ASSERT_STREQ(blink->state, "off");
+  ASSERT_FALSE(blink->parked);
+
+  sm.cycle(); // arms both timers, parked until the first one
+  ASSERT_EQ(blink->parkedUntil, 1150ul);
+
+  _time = 1150;
+  sm.cycle();
+  ASSERT_STREQ(blink->state, "on");
+  _time = 0;
+}
+
+TEST(StateMachine, inState)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"s\": {"
+                       "\"a\": {\"i\": \"idle\", \"s\": {"
+                       "  \"idle\": {\"r\": [{\"i\": {\"in_state\": 100}, \"t\": \"busy\"}]},"
+                       "  \"busy\": {\"r\": [{\"i\": {\"and\": [\"go\", {\"in_state\": [30]}]}, \"t\": \"idle\"}]}}}"
+                       "}}");
+
+  _time = 500;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  STATE_MACHINE_SLOT *a = sm._findStateMachine("a");
+  ASSERT_TRUE(sm._isTimerState(a, "idle"));
+  ASSERT_FALSE(sm._isTimerState(a, "busy"));
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"in_state\": 0}"))); // outside of machine
+
+  sm.cycle();
+  ASSERT_TRUE(a->parked);
+  ASSERT_EQ(a->parkedUntil, 600ul);
+
+  _time = 600;
+  sm.cycle();
+  ASSERT_STREQ(a->state, "busy");
+  ASSERT_EQ(a->enteredAt, 600ul);
+
+  sm.setVar("go", 1l);
+  _time = 629;
+  sm.cycle();
+  ASSERT_STREQ(a->state, "busy");
+  _time = 630;
+  sm.cycle();
+  ASSERT_STREQ(a->state, "idle");
+  _time = 0;
+}
+
+int slowRead(ActionContext *ctx, AsyncTask *task)
+{
+  switch (task->step++)
+  {
+  case 0:
+    return task->sleep(ctx->getParamInt(0));
+  case 1:
+    return task->waitState("gate", "open");
+  default:
+    ctx->compute->setVar("value", 42l);
+    return ASYNC_DONE;
+  }
+}
+
+void afterRead(ActionContext *ctx)
+{
+  ctx->compute->setVar("after", ctx->compute->getVarInt("value") + 1);
+}
+
+#ifdef ASYNC_COROUTINES
+AsyncCoroutine slowReadCoroutine(ActionContext *ctx, AsyncTask *task)
+{
+  co_await task->delay(ctx->getParamInt(0));
+  co_await task->state("gate", "open");
+  ctx->compute->setVar("value", 42l);
+}
+#endif
+
+void runAsyncActions(bool coroutine)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"s\": {"
+                       "\"reader\": {\"i\": \"read\", \"s\": {"
+                       "  \"read\": {\"a\": [{\"slow-read\": [100]}, \"after-read\"], \"r\": [{\"i\": \"after\", \"t\": \"done\"}]},"
+                       "  \"done\": {}}},"
+                       "\"gate\": {\"i\": \"closed\", \"b\": [{\":=\": [\"cycles\", {\"sum\": [\"cycles\", 1]}]}], \"s\": {"
+                       "  \"closed\": {\"r\": [{\"i\": {\"gt\": [\"cycles\", 2]}, \"t\": \"open\"}]},"
+                       "  \"open\": {}}}"
+                       "}}");
+
+  _time = 0;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  if (coroutine)
+  {
+#ifdef ASYNC_COROUTINES
+    sm.registerAsyncAction("slow-read", slowReadCoroutine);
+#endif
+  }
+  else
+    sm.registerAsyncAction("slow-read", slowRead);
+  sm.registerAction("after-read", afterRead);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  STATE_MACHINE_SLOT *reader = sm._findStateMachine("reader");
+  ASSERT_EQ(reader->tasks.size(), 1ul);
+  ASSERT_EQ(sm.getVarInt("after"), 0);
+
+  sm.cycle();
+  _time = 99;
+  sm.cycle();
+  ASSERT_EQ(reader->tasks.size(), 1ul);
+  ASSERT_EQ(sm.getVarInt("cycles"), 2); // other machine keeps running
+
+  _time = 100;
+  sm.cycle(); // waits for gate to open
+  ASSERT_EQ(reader->tasks.size(), 1ul);
+  ASSERT_STREQ(sm._findStateMachine("gate")->state, "open");
+
+  sm.cycle();
+  ASSERT_TRUE(reader->tasks.empty());
+  ASSERT_EQ(sm.getVarInt("after"), 43);
+  ASSERT_STREQ(reader->state, "done");
+}
+
+long int typedSpeed = 0;
+float typedTarget = 0;
+VarStruct typedRaw;
+const char *typedName = nullptr;
+int typedCalls = 0;
+
+void typedFan(long int speed, float target, VarStruct raw)
+{
+  typedSpeed = speed;
+  typedTarget = target;
+  typedRaw = raw;
+  typedCalls++;
+}
+
+void typedNamed(ActionContext *context, const char *name, bool on)
+{
+  typedName = name;
+  context->compute->setVar("typed-on", (long int)on);
+  typedCalls++;
+}
+
+void typedNone()
+{
+  typedCalls++;
+}
+
+TEST(StateMachine, typedActions)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"i\": [\"none\", {\"fan\": [{\"sum\": [\"base\", 5]}, 21.5, \"base\"]},"
+                       "       {\"named\": [\"heater\", {\"gt\": [\"base\", 1]}]}, {\"fan\": [1, 2]}, \"fan\"],"
+                       " \"s\": {\"m\": {\"i\": \"a\", \"s\": {\"a\": {\"a\": [{\"none\": [1]}]}}}}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.registerAction("fan", typedFan);
+  sm.registerAction("named", typedNamed);
+  sm.registerAction("none", typedNone);
+  sm.setDefinition(&doc);
+  sm.setVar("base", 10l);
+
+  ASSERT_EQ(sm.getActionArity("fan"), 3);
+  ASSERT_EQ(sm.getActionArity("named"), 2);
+  ASSERT_EQ(sm.getActionArity("none"), 0);
+  ASSERT_EQ(sm.getActionArity("unknown"), -1);
+
+  // parameter count is checked when actions are compiled and by analyzer, mismatched calls are not run
+  ASSERT_EQ(sm.actionErrors.size(), 2ul);
+  ASSERT_STREQ(sm.actionErrors[0].action, "fan");
+  ASSERT_EQ(sm.actionErrors[0].expected, 3);
+  ASSERT_EQ(sm.actionErrors[0].given, 2);
+  ASSERT_EQ(sm.actionErrors[1].given, 0);
+
+  Analyzer analyzer(&sm);
+  ASSERT_EQ(analyzer.analyze(), 3);
+  ASSERT_EQ(analyzer.count(ISSUE_ACTION_ARITY), 3);
+
+  // machine actions are compiled with machines
+  sm.init();
+  ASSERT_EQ(sm.actionErrors.size(), 3ul);
+  ASSERT_STREQ(sm.actionErrors[2].action, "none");
+  ASSERT_EQ(typedCalls, 3);
+  ASSERT_EQ(typedSpeed, 15);
+  ASSERT_FLOAT_EQ(typedTarget, 21.5f);
+  ASSERT_EQ(typedRaw.vInt, 10);
+  ASSERT_STREQ(typedName, "heater");
+  ASSERT_EQ(sm.getVarInt("typed-on"), 1);
+}
+
+long int capturedParams[6];
+size_t capturedCount = 0;
+
+void captureParams(ActionContext *ctx)
+{
+  capturedCount = ctx->getCount();
+  for (size_t i = 0; i < 6; i++)
+    capturedParams[i] = ctx->getParamInt(i, -1);
+}
+
+TEST(StateMachine, actionParams)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"b\": [{\"capture\": [5, \"level\", \"level * 2\", {\"sum\": [\"level\", 1]}, true]}], \"s\": {"
+                       "\"m\": {\"i\": \"a\", \"s\": {"
+                       "  \"a\": {\"a\": [\"none\", {\"capture\": [1, \"missing\"]}],"
+                       "         \"r\": [{\"i\": {\"gt\": [\"level\", 0]}, \"a\": [{\":=\": [\"out\", \"level + 100\"]}], \"t\": \"b\"}]},"
+                       "  \"b\": {}}}}}");
+
+  _time = 0;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.registerAction("capture", captureParams);
+  sm.setDefinition(&doc);
+  sm.init();
+
+  // parameters are compiled at load: constants, variable references and expressions
+  ActionParams *params = sm._beforeActions->get(0, 0);
+  ASSERT_EQ(params->size(), 5);
+  ASSERT_EQ(params->typeAt(0), PARAM_CONSTANT);
+  ASSERT_EQ(params->typeAt(1), PARAM_VARIABLE);
+  ASSERT_EQ(params->typeAt(2), PARAM_EXPRESSION);
+  ASSERT_EQ(params->typeAt(3), PARAM_EXPRESSION);
+  ASSERT_EQ(params->typeAt(4), PARAM_CONSTANT);
+  ASSERT_EQ(params->typeAt(5), -1);
+  ASSERT_TRUE(sm._beforeActions->get(1, 0) == nullptr);
+
+  STATE_ACTIONS *actions = sm._findActions(sm._findStateMachine("m"), "a");
+  ASSERT_TRUE(actions->entry->get(0, 0) == nullptr);
+  ASSERT_EQ(actions->entry->get(1, 0)->size(), 2);
+  ASSERT_EQ(actions->exit.size(), 1);
+  ASSERT_EQ(actions->exit[0]->get(0, 0)->typeAt(1), PARAM_EXPRESSION);
+
+  // entry actions of initial state, variable does not exist yet
+  ASSERT_EQ(capturedCount, 2);
+  ASSERT_EQ(capturedParams[0], 1);
+  ASSERT_EQ(capturedParams[1], 0);
+  ASSERT_EQ(capturedParams[2], -1);
+
+  // variable created after load is resolved when used
+  sm.setVar("level", 3l);
+  sm.cycle();
+  ASSERT_EQ(capturedCount, 5);
+  ASSERT_EQ(capturedParams[0], 5);
+  ASSERT_EQ(capturedParams[1], 3);
+  ASSERT_EQ(capturedParams[2], 6);
+  ASSERT_EQ(capturedParams[3], 4);
+  ASSERT_EQ(capturedParams[4], 1);
+  ASSERT_EQ(capturedParams[5], -1);
+  ASSERT_EQ(sm.getVarInt("out"), 103);
+  ASSERT_STREQ(sm._findStateMachine("m")->state, "b");
+
+  sm.setVar("level", 7l);
+  sm.cycle();
+  ASSERT_EQ(capturedParams[1], 7);
+  ASSERT_EQ(capturedParams[2], 14);
+}
+
+TEST(StateMachine, asyncActions)
+{
+  runAsyncActions(false);
+#ifdef ASYNC_COROUTINES
+  runAsyncActions(true);
+#endif
+}
+
+StateMachineController *eventTarget = nullptr;
+int sleepSlices = 0;
+
+void sleepWithInterrupt(unsigned long ms)
+{
+  if (ms == 0)
+    return;
+  if (++sleepSlices == 3)
+    eventTarget->postEvent("btn");
+  _time += ms;
+}
+
+int wakeups = 0;
+
+void wakeSleep()
+{
+  wakeups++;
+}
+
+void sleepUntilWoken(unsigned long ms)
+{
+  // interrupt arrives 30ms into the first sleep, wake function ends it
+  if (ms == 0)
+    return;
+  if (++sleepSlices == 1)
+  {
+    _time += 30;
+    eventTarget->postEvent("btn");
+    return;
+  }
+  _time += ms;
+}
+
+TEST(StateMachine, events)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"t\": 100, \"s\": {"
+                       "\"button\": {\"i\": \"idle\", \"s\": {"
+                       "  \"idle\": {\"r\": [{\"i\": {\"eq\": [\"btn\", 1]}, \"t\": \"pressed\"}]},"
+                       "  \"pressed\": {}}},"
+                       "\"other\": {\"i\": \"wait\", \"s\": {"
+                       "  \"wait\": {\"r\": [{\"i\": {\"gt\": [\"level\", 10]}, \"t\": \"high\"}]}}}"
+                       "}}");
+
+  _time = 0;
+  sleepSlices = 0;
+  StateMachineController sm = StateMachineController("sm", sleepWithInterrupt, getTime);
+  eventTarget = &sm;
+  sm.setDefinition(&doc);
+  sm.init();
+
+  // handled at the beginning of cycle, only referencing machine is evaluated
+  ASSERT_EQ(sm._eventTargets["level"].size(), 1ul);
+  ASSERT_STREQ(sm._eventTargets["level"][0].state, "wait");
+  ASSERT_EQ(sm._eventTargets.count("nothing"), 0ul);
+  ASSERT_TRUE(sm.postEvent("level", 11l));
+  ASSERT_EQ(sm.processEvents(), 1ul);
+  ASSERT_STREQ(sm._findStateMachine("other")->state, "high");
+
+  // handled while sleeping
+  sm.enableEvents(10);
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("button")->state, "pressed");
+  ASSERT_EQ(_time, 100ul);
+  ASSERT_EQ(sleepSlices, 10);
+
+  for (int i = 0; i < EVENT_QUEUE_SIZE - 1; i++)
+    ASSERT_TRUE(sm.postEvent("flood"));
+  ASSERT_FALSE(sm.postEvent("flood"));
+  ASSERT_EQ(sm._events.dropped, 1ul);
+  ASSERT_EQ(sm.processEvents(), 0ul);
+  ASSERT_TRUE(sm._events.isEmpty());
+
+  // with wake function sleep is not sliced, event ends it early and the rest is slept after handling
+  _time = 0;
+  sleepSlices = 0;
+  wakeups = 0;
+  StateMachineController woken = StateMachineController("sm", sleepUntilWoken, getTime);
+  eventTarget = &woken;
+  woken.setDefinition(&doc);
+  woken.init();
+  woken.enableEvents(EVENT_SLEEP_SLICE, wakeSleep);
+  woken.cycle();
+  ASSERT_STREQ(woken._findStateMachine("button")->state, "pressed");
+  ASSERT_EQ(wakeups, 1);
+  ASSERT_EQ(sleepSlices, 2);
+  ASSERT_EQ(_time, 100ul);
+  _time = 0;
+}
+
+TEST(StateMachine, analyzer)
+{
+  StaticJsonDocument<2048> doc;
+  deserializeJson(doc, "{\"b\": [\"known\", \"missing\"], \"s\": {"
+                       "\"m\": {\"i\": \"a\", \"s\": {"
+                       "  \"a\": {\"a\": [{\"known\": [1], \"nope\": [2]}],"
+                       "         \"r\": [{\"i\": {\"gt\": [\"lvl\", 5]}, \"t\": \"b\"}, {\"t\": \"b\"}, {\"i\": 1, \"t\": \"a\"},"
+                       "                {\"i\": {\"nofn\": [\"lvl\"]}, \"t\": \"dead\"}]},"
+                       "  \"b\": {\"r\": [{\"i\": {\"lt\": [\"lvl\", 5]}, \"t\": \"void\"}]},"
+                       "  \"dead\": {\"r\": [{\"i\": true, \"t\": \"a\"}]}}},"
+                       "\"bad\": {\"i\": \"x\", \"s\": 5}}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.registerAction("known", dummy_action1);
+  sm.setDefinition(&doc);
+
+  Analyzer analyzer(&sm);
+  ASSERT_EQ(analyzer.analyze(), 7);
+  ASSERT_EQ(analyzer.count(ISSUE_UNKNOWN_ACTION), 2);
+  ASSERT_EQ(analyzer.count(ISSUE_INVALID_RULE), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_SHADOWED_RULE), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_MISSING_TARGET), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_UNREACHABLE_STATE), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_INVALID_MACHINE), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_UNKNOWN_FUNCTION), 0); // shadowed rule is not analyzed
+  ASSERT_EQ(analyzer.pruned, 0);
+  ASSERT_STREQ(analyzer.issues[0].name, "missing");
+
+  ASSERT_EQ(analyzer.footprints.size(), 1);
+  ASSERT_EQ(analyzer.footprints[0].states, 3);
+  ASSERT_EQ(analyzer.footprints[0].reachableStates, 2);
+  ASSERT_EQ(analyzer.footprints[0].rules, 6);
+  size_t bytes = analyzer.footprints[0].bytes;
+
+  // pruning removes dead entries, machine behaves the same without validity checks
+  sm.init();
+  ASSERT_EQ(analyzer.analyze(true), 7);
+  ASSERT_EQ(analyzer.pruned, 6);
+  ASSERT_TRUE(sm._validated);
+  ASSERT_EQ(analyzer.footprints[0].states, 2);
+  ASSERT_EQ(analyzer.footprints[0].rules, 3);
+  ASSERT_LT(analyzer.footprints[0].bytes, bytes);
+  ASSERT_EQ(doc["s"].size(), 1);
+  ASSERT_EQ(doc["b"].size(), 1);
+
+  sm.setVar("lvl", 3l);
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("m")->state, "a");
+  sm.setVar("lvl", 6l);
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("m")->state, "b");
+
+  ASSERT_EQ(analyzer.analyze(), 1); // missing target is only reported
+  ASSERT_EQ(analyzer.count(ISSUE_MISSING_TARGET), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_UNKNOWN_ACTION), 0);
+
+  sm.setDefinition(&doc);
+  ASSERT_FALSE(sm._validated);
+
+  // name patterns are operands of aggregates only, "a*b" is not a multiplication
+  StaticJsonDocument<512> patterns;
+  deserializeJson(patterns, "{\"s\": {\"p\": {\"i\": \"a\", \"s\": {"
+                            "  \"a\": {\"r\": [{\"i\": {\"gt\": [{\"max\": [\"*.temp\", \"t?\"]}, \"a*b\"]}, \"t\": \"a\"}]}}}}}");
+  sm.setDefinition(&patterns);
+  ASSERT_EQ(analyzer.analyze(), 1);
+  ASSERT_EQ(analyzer.count(ISSUE_SYNTAX_ERROR), 1);
+  ASSERT_STREQ(analyzer.issues[0].name, "a*b");
+}
+
+TEST(StateMachine, loader)
+{
+  const char *json = "{\"s\": {\"m\": {\"i\": \"a\", \"s\": {\"a\": {\"r\": [{\"i\": true, \"t\": \"b\"}]},"
+                     " \"b\": {\"r\": [{\"i\": true, \"t\": \"a\"}]}}}}, \"x\": [1, \"a\\tb\", [2.5, null]]}";
+
+  DefinitionLoader loader;
+  DynamicJsonDocument *doc = loader.load(json, 4096);
+
+  ASSERT_NE(doc, nullptr);
+  ASSERT_EQ(loader.stats.inputBytes, strlen(json));
+  ASSERT_EQ(loader.stats.slots, 20); // 13 members, 7 array elements
+  ASSERT_EQ(loader.stats.strings, 17);
+  ASSERT_EQ(loader.stats.uniqueStrings, 9);
+  ASSERT_EQ(loader.stats.stringBytes, 16 * 2 + 4);
+  ASSERT_EQ(loader.stats.internedBytes, 8 * 2 + 4);
+  ASSERT_EQ(loader.stats.longestString, 4);
+  ASSERT_EQ(loader.stats.capacity, JSON_OBJECT_SIZE(20) + 20 + 4);
+  ASSERT_LE(doc->capacity(), loader.stats.capacity);
+  ASSERT_EQ(loader.stats.saved, 4096 - doc->capacity());
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(doc);
+  sm.init();
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("m")->state, "b");
+
+  // document measured by walking matches measured text
+  StaticJsonDocument<4096> sized;
+  deserializeJson(sized, json);
+  DynamicJsonDocument *compacted = loader.compact(&sized);
+  ASSERT_NE(compacted, nullptr);
+  ASSERT_EQ(loader.stats.slots, 20);
+  ASSERT_EQ(loader.stats.uniqueStrings, 9);
+  ASSERT_EQ(loader.stats.capacity, JSON_OBJECT_SIZE(20) + 20 + 4);
+  ASSERT_EQ(loader.stats.saved, 4096 - compacted->capacity());
+
+  // duplicates are still found after string table grows
+  std::string many = "{";
+  for (int i = 0; i < 100; i++)
+    many += (i ? ", \"k" : "\"k") + std::to_string(i) + "\": \"v" + std::to_string(i % 10) + "\"";
+  many += "}";
+  ASSERT_GT(loader.measure(many.c_str(), many.length()), 0ul);
+  ASSERT_EQ(loader.stats.strings, 200);
+  ASSERT_EQ(loader.stats.uniqueStrings, 110);
+
+  ASSERT_EQ(loader.load("{\"s\": [1, 2}"), nullptr);
+  ASSERT_TRUE(loader.error);
+
+  delete compacted;
+  delete doc;
+}
+
+TEST(StateMachine, reload)
+{
+  const char *m1 = "\"m1\": {\"i\": \"a\", \"s\": {"
+                   "  \"a\": {\"r\": [{\"i\": {\"gt\": [\"lvl\", 90]}, \"t\": \"b\"}, {\"i\": {\"gt\": [\"lvl\", 80]}, \"t\": \"b\"},"
+                   "                {\"i\": {\"gt\": [\"lvl\", 70]}, \"t\": \"b\"}, {\"i\": {\"gt\": [\"lvl\", 60]}, \"t\": \"b\"}]},"
+                   "  \"b\": {}}}";
+
+  StaticJsonDocument<2048> *doc1 = new StaticJsonDocument<2048>();
+  deserializeJson(*doc1, std::string("{\"i\": [{\":=\": [\"inits\", {\"sum\": [\"inits\", 1]}]}], \"s\": {") + m1 + ","
+                             "\"m2\": {\"i\": \"x\", \"s\": {\"x\": {\"r\": [{\"i\": true, \"t\": \"y\"}]}, \"y\": {}}},"
+                             "\"gone\": {\"i\": \"g\", \"s\": {\"g\": {}}}"
+                             "}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(doc1);
+  sm.init();
+  sm.cycle();
+  sm.setVar("kept", 7l);
+  ASSERT_STREQ(sm._findStateMachine("m2")->state, "y");
+
+  StaticJsonDocument<2048> doc2;
+  deserializeJson(doc2, std::string("{\"i\": [{\":=\": [\"inits\", {\"sum\": [\"inits\", 1]}]}], \"s\": {") + m1 + ","
+                            "\"m2\": {\"i\": \"x\", \"s\": {\"x\": {}, \"z\": {}}},"
+                            "\"fresh\": {\"i\": \"s\", \"s\": {\"s\": {}}}"
+                            "}}");
+
+  RELOAD_STATS stats = sm.reload(&doc2);
+  delete doc1;
+
+  ASSERT_EQ(stats.machinesKept, 1);
+  ASSERT_EQ(stats.machinesReset, 1);
+  ASSERT_EQ(stats.machinesAdded, 1);
+  ASSERT_EQ(stats.machinesRemoved, 1);
+  ASSERT_EQ(stats.rulesReused, 1);
+  ASSERT_EQ(stats.rulesCompiled, 0);
+
+  ASSERT_EQ(sm._findStateMachine("gone"), nullptr);
+  ASSERT_STREQ(sm._findStateMachine("m2")->state, "x");
+  ASSERT_STREQ(sm._findStateMachine("fresh")->state, "s");
+  ASSERT_EQ(sm.getVarInt("kept"), 7);
+  ASSERT_EQ(sm.getVarInt("inits"), 1);
+
+  // reused rule table refers to new definition
+  sm.setVar("lvl", 95l);
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("m1")->state, "b");
+}
+
+TEST(StateMachine, reloadKeepsTimersAndFilters)
+{
+  const char *json = "{\"b\": [{\":=\": [\"reload-avg\", {\"ema\": [\"reload-ema\", \"reload-in\", 0.5]}]}], \"s\": {"
+                     "\"m\": {\"i\": \"a\", \"s\": {"
+                     "  \"a\": {\"r\": [{\"i\": {\"elapsed\": [\"reload-blink\", 500]}, \"t\": \"b\"}]},"
+                     "  \"b\": {}}}}}";
+
+  StaticJsonDocument<1024> *doc1 = new StaticJsonDocument<1024>();
+  deserializeJson(*doc1, json);
+
+  _time = 0;
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(doc1);
+  sm.init();
+  sm.setVar("reload-in", 10l);
+  sm.cycle();
+  ASSERT_FLOAT_EQ(sm.getVarFloat("reload-avg"), 10.0f);
+
+  StaticJsonDocument<1024> doc2;
+  deserializeJson(doc2, json);
+  sm.reload(&doc2);
+
+  // released definition memory is reused, timer and filter names must not point into it
+  (*doc1)["b"][0][":="][1]["ema"][0] = "xxxxxxxxxx";
+  (*doc1)["s"]["m"]["s"]["a"]["r"][0]["i"]["elapsed"][0] = "xxxxxxxxxxxx";
+  delete doc1;
+
+  _time = 300;
+  sm.setVar("reload-in", 20l);
+  sm.cycle();
+  ASSERT_FLOAT_EQ(sm.getVarFloat("reload-avg"), 15.0f);
+  ASSERT_STREQ(sm._findStateMachine("m")->state, "a");
+
+  _time = 500;
+  sm.cycle();
+  ASSERT_STREQ(sm._findStateMachine("m")->state, "b");
+  _time = 0;
+}
+
+TEST(StateMachine, ruleTables)
+{
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+
+  // integer thresholds (with duplicates, mixed operators and reversed operands), dense "eq",
+  // a rule breaking the group, float thresholds of another variable
+  std::string json = "[";
+  const char *ops[] = {"gte", "lt", "gt", "lte"};
+  for (int i = 0; i < 24; i++)
+    json += "{\"i\": {\"" + std::string(ops[i % 4]) + "\": [\"level\", " + std::to_string((i * 37) % 50) + "]}, \"t\": \"s" + std::to_string(i) + "\"},";
+  json += "{\"i\": {\"lt\": [45, \"level\"]}, \"t\": \"rev\"},";
+  for (int i = 0; i < 8; i++)
+    json += "{\"i\": {\"eq\": [\"level\", " + std::to_string(i * 2 - 3) + "]}, \"t\": \"eq" + std::to_string(i) + "\"},";
+  json += "{\"i\": true, \"t\": \"\"},";
+  for (int i = 0; i < 4; i++)
+    json += "{\"i\": {\"eq\": [\"level\", " + std::to_string(i * 1000 + 7) + "]}, \"t\": \"far" + std::to_string(i) + "\"},";
+  for (int i = 0; i < 6; i++)
+    json += "{\"i\": {\"lte\": [\"temp\", " + std::to_string(10 - i) + ".5]}, \"t\": \"t" + std::to_string(i) + "\"},";
+  json += "{\"i\": true, \"t\": \"default\"}]";
+
+  StaticJsonDocument<8192> doc;
+  deserializeJson(doc, json);
+  JsonArray rules = doc.as<JsonArray>();
+
+  RuleTable table;
+  size_t index = 0;
+  for (JsonVariant rule : rules)
+    table.addRule(index++, sm._isValidRule(rule) ? rule["i"].as<JsonVariant>() : JsonVariant(), &sm.compute);
+  ASSERT_TRUE(table.finish());
+  ASSERT_EQ(table.groups.size(), 3ul);
+  ASSERT_EQ(table.groups[0]->end, 33ul);
+  ASSERT_FALSE(table.groups[0]->jumps.empty()); // dense "eq" values
+  ASSERT_TRUE(table.groups[1]->jumps.empty());
+
+  // compiled evaluation has to pick exactly the same rule as rule by rule evaluation
+  for (int v = -10; v <= 1010; v += v < 60 ? 1 : 947)
+  {
+    for (int f = 0; f < 3; f++)
+    {
+      if (f == 0)
+        sm.setVar("level", (long int)v);
+      else
+        sm.setVar("level", v + (f == 1 ? 0.0f : 0.5f));
+      sm.setVar("temp", v / 4.0f);
+      ASSERT_STREQ(sm._getNextState(rules, &table), sm._getNextState(rules)) << "level " << v << " " << f;
+    }
+  }
+  sm.setVar("level", VarStruct::NaN());
+  ASSERT_STREQ(sm._getNextState(rules, &table), sm._getNextState(rules));
+
+  // controller compiles rules of loaded states
+  std::string definition = "{\"s\": {\"m\": {\"i\": \"a\", \"s\": {\"a\": {\"r\": " + json + "}}}}}";
+  StaticJsonDocument<8192> smDoc;
+  deserializeJson(smDoc, definition);
+  sm.setDefinition(&smDoc);
+  sm.init();
+  ASSERT_NE(sm._findRules(&sm._stateMachines[0], "a"), nullptr);
+  sm.setVar("level", 47l);
+  sm.cycle();
+  ASSERT_STREQ(sm._stateMachines[0].state, sm._getNextState(rules));
+
+  // text expression operands are evaluated rule by rule
+  StaticJsonDocument<1024> exprDoc;
+  deserializeJson(exprDoc, "{\"s\": {\"m\": {\"i\": \"a\", \"s\": {\"a\": {\"r\": ["
+                           "{\"i\": {\"gt\": [\"level + 1\", 100]}, \"t\": \"c\"}, {\"i\": {\"gt\": [\"level + 1\", 95]}, \"t\": \"b\"},"
+                           "{\"i\": {\"gt\": [\"level + 1\", 90]}, \"t\": \"c\"}, {\"i\": {\"gt\": [\"level + 1\", 80]}, \"t\": \"c\"}]},"
+                           "\"b\": {}, \"c\": {}}}}}");
+  StateMachineController exprSm = StateMachineController("sm", NULL, getTime);
+  exprSm.setDefinition(&exprDoc);
+  exprSm.init();
+  ASSERT_EQ(exprSm._findRules(&exprSm._stateMachines[0], "a"), nullptr);
+  exprSm.setVar("level", 95l);
+  exprSm.cycle();
+  ASSERT_STREQ(exprSm._stateMachines[0].state, "b");
+}
+
+TEST(StateMachine, tables)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"l\": {"
+                       "\"dense\": {\"0\": 10, \"1\": 20, \"3\": {\"mul\": [\"x\", 2]}, \"default\": -1},"
+                       "\"sparse\": {\"-5\": 1, \"100\": 2, \"100000\": 3},"
+                       "\"curve\": [[30, 100], [20, 0], [25, 30]]"
+                       "}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(&doc);
+  sm.setVar("x", 21l);
+
+  ASSERT_FALSE(sm.compute.tables._lutMap["dense"]->dense.empty());
+  ASSERT_TRUE(sm.compute.tables._lutMap["sparse"]->dense.empty());
+
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"dense\", 1]}")).vInt, 20);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"switch\": [\"dense\", {\"sub\": [\"x\", 18]}]}")).vInt, 42);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"dense\", 2]}")).vInt, -1);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"dense\", 99]}")).vInt, -1);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"sparse\", 100000]}")).vInt, 3);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"sparse\", -5]}")).vInt, 1);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"sparse\", 7]}")).vInt, 0);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"lut\": [\"none\", 1]}")).vInt, 0);
+
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(makeVariant("{\"interp\": [\"curve\", 10]}")).vFloat, 0.0f);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(makeVariant("{\"interp\": [\"curve\", 22.5]}")).vFloat, 15.0f);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(makeVariant("{\"interp\": [\"curve\", 27]}")).vFloat, 58.0f);
+  ASSERT_FLOAT_EQ(sm.compute.evalMath(makeVariant("{\"interp\": [\"curve\", 35]}")).vFloat, 100.0f);
+}
+
+int expressionCalls = 0;
+
+VarStruct countedFunction(ActionContext *ctx)
+{
+  expressionCalls++;
+  return 7l;
+}
+
+TEST(StateMachine, infix)
+{
+  Timers timers(getTime);
+  Compute compute("device", &timers);
+  std::string json;
+
+  serializeJson(compute.infix.compile("garage.humidity > 30 && fan-off-time > ctrl.fan-min-off"), json);
+  ASSERT_STREQ(json.c_str(), "{\"and\":[{\"gt\":[\"garage.humidity\",30]},{\"gt\":[\"fan-off-time\",\"ctrl.fan-min-off\"]}]}");
+  serializeJson(compute.infix.compile("!door || a + b + c - 1 <= max(x, -2) && $heat"), json);
+  ASSERT_STREQ(json.c_str(), "{\"or\":[{\"not\":\"door\"},{\"and\":[{\"lte\":[{\"sub\":[{\"sum\":[\"a\",\"b\",\"c\"]},1]},{\"max\":[\"x\",-2]}]},{\"$\":\"heat\"}]}]}");
+  serializeJson(compute.infix.compile("in_state(500) || elapsed('t 1', 200)"), json);
+  ASSERT_STREQ(json.c_str(), "{\"or\":[{\"in_state\":500},{\"elapsed\":[\"t 1\",200]}]}");
+
+  compute.setVar("a", 7l);
+  compute.setVar("b-c", 2l);
+  ASSERT_EQ(compute.evalMath(makeVariant("\"(a - 1) * 3 + b-c ^ 3 / 4\"")).vInt, 20);
+  ASSERT_FLOAT_EQ(compute.evalMath(makeVariant("\"a / 2.0 - -0.5\"")).vFloat, 4.0f);
+  ASSERT_EQ(compute.evalMath(makeVariant("\"a > 5 ? a * 10 : 0\"")).vInt, 70);
+  ASSERT_EQ(compute.evalMath(makeVariant("\"-(a + 1)\"")).vInt, -8);
+
+  // operators which can not be part of names need no spaces, "*" and "?" are name pattern characters
+  ASSERT_EQ(compute.evalMath(makeVariant("\"a/7\"")).vInt, 1);
+  ASSERT_EQ(compute.evalMath(makeVariant("\"b-c?a:0\"")).vInt, 7);
+  ASSERT_EQ(compute.evalMath(makeVariant("\"-a\"")).vInt, -7);
+  ASSERT_TRUE(Infix::isInfix("b-c?a:0"));
+  ASSERT_FALSE(Infix::isInfix("b-c"));
+  ASSERT_FALSE(Infix::isInfix("zone?.*"));
+  ASSERT_TRUE(compute.evalCondition(makeVariant("\"a == 7 && !(b-c != 2)\"")));
+  ASSERT_FALSE(compute.evalCondition(makeVariant("\"a < 7 || false\"")));
+  ASSERT_TRUE(compute.evalCondition(makeVariant("{\"and\": [\"a >= 7\", \"b-c\"]}")));
+
+  // errors are reported with position, expression evaluates as false
+  ASSERT_FALSE(compute.evalCondition(makeVariant("\"a > (b-c\"")));
+  ASSERT_TRUE(compute.infix.compile("a > (b-c").isNull());
+  ASSERT_TRUE(compute.infix.compile("a = 1").isNull());
+  ASSERT_EQ(compute.infix.errors.size(), 2);
+  ASSERT_STREQ(compute.infix.errors[0].message, "expected ')'");
+  ASSERT_EQ(compute.infix.errors[0].position, 8);
+  ASSERT_EQ(compute.infix.errors[1].position, 2);
+
+  // definitions: compiled at load, rule tables and timer parking see compiled form
+  StaticJsonDocument<2048> doc;
+  deserializeJson(doc, "{\"s\": {\"m\": {\"i\": \"idle\", \"s\": {"
+                       "  \"idle\": {\"r\": [{\"i\": \"level >= 20\", \"t\": \"high\"}, {\"i\": \"level >= 15\", \"t\": \"high\"},"
+                       "                {\"i\": \"level >= 10\", \"t\": \"high\"}, {\"i\": \"5 <= level\", \"t\": \"mid\"}]},"
+                       "  \"mid\": {\"a\": [{\":=\": [\"power\", \"level * 10\"]}], \"r\": [{\"i\": \"elapsed('infix-t', 100)\", \"t\": \"idle\"}]},"
+                       "  \"high\": {}}}}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.setDefinition(&doc);
+  ASSERT_FALSE(sm.compute.infix.find("level * 10").isNull());
+  sm.init();
+
+  STATE_MACHINE_SLOT *slot = sm._findStateMachine("m");
+  ASSERT_NE(slot->ruleTables["idle"], nullptr);
+  ASSERT_NE(slot->ruleTables["idle"]->groupAt(0), nullptr);
+  ASSERT_TRUE(sm._isTimerState(slot, "mid"));
+
+  sm.setVar("level", 6l);
+  sm.cycle();
+  ASSERT_STREQ(slot->state, "mid");
+  ASSERT_EQ(sm.getVarInt("power"), 60);
+  ASSERT_EQ(sm.compute.infix.errors.size(), 0);
+}
+
+TEST(StateMachine, expressions)
+{
+  StaticJsonDocument<1024> doc;
+  deserializeJson(doc, "{\"e\": {"
+                       "\"demand\": {\"sub\": [\"target\", \"temp\"]},"
+                       "\"heat\": {\"gt\": [{\"$\": \"demand\"}, 2]},"
+                       "\"counted\": {\"sum\": [{\"counted\": []}, \"temp\"]}"
+                       "}}");
+
+  StateMachineController sm = StateMachineController("sm", NULL, getTime);
+  sm.registerFunction("counted", countedFunction);
+  sm.setDefinition(&doc);
+  sm.setVar("target", 22l);
+  sm.setVar("temp", 18l);
+
+  ASSERT_FALSE(sm.compute.expressions._expressionMap["demand"]->isVolatile);
+  ASSERT_EQ(sm.compute.expressions._expressionMap["heat"]->inputNames.size(), 2);
+  ASSERT_TRUE(sm.compute.expressions._expressionMap["counted"]->isVolatile);
+
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"$\": \"demand\"}")).vInt, 4);
+  ASSERT_TRUE(sm.compute.evalCondition(makeVariant("{\"$\": \"heat\"}")));
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"mul\": [{\"$\": \"demand\"}, 10]}")).vInt, 40);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"$\": \"none\"}")).vInt, 0);
+
+  // cached value is reused until one of inputs is written
+
+  sm.compute.expressions._expressionMap["demand"]->mathValue = 100l;
+  sm.setVar("other", 1l);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"$\": \"demand\"}")).vInt, 100);
+  sm.setVar("temp", 21l);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"$\": \"demand\"}")).vInt, 1);
+  ASSERT_FALSE(sm.compute.evalCondition(makeVariant("{\"$\": \"heat\"}")));
+
+  // volatile expression is evaluated once per cycle
+
+  expressionCalls = 0;
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"$\": \"counted\"}")).vInt, 28);
+  ASSERT_EQ(sm.compute.evalMath(makeVariant("{\"$\": \"counted\"}")).vInt, 28);
+  ASSERT_EQ(expressionCalls, 1);
+  sm.compute.expressions.nextCycle();
+  sm.compute.evalMath(makeVariant("{\"$\": \"counted\"}"));
+  ASSERT_EQ(expressionCalls, 2);
+}
+
 void pluginAction(Plugin *pl)
 {
   int var = pl->getVarInt("pl_var1");